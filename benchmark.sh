@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Runs the same TCP echo workload against an epoll build, an io_uring build and
+# the multishot io_uring engine of tcp_echo_server and reports throughput, p99 latency and server syscalls per
+# message for each backend.
+#
+# Environment: CONNECTIONS (default 64), MESSAGE_SIZE (64), DURATION (10),
+#              THREADS (server io threads, 1), PORT (7171)
+
+CONNECTIONS=${CONNECTIONS:-64}
+MESSAGE_SIZE=${MESSAGE_SIZE:-64}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-1}
+PORT=${PORT:-7171}
+
+BENCHMARK_DIR="benchmark_output"
+
+if command -v perf &> /dev/null; then
+  SYSCALL_COUNTER="perf"
+elif command -v strace &> /dev/null; then
+  SYSCALL_COUNTER="strace"
+else
+  echo "perf or strace is required to count syscalls"
+  exit 1
+fi
+
+build_backend() {
+  local backend=$1
+  local io_uring=$2
+
+  echo "Building $backend backend..."
+
+  rm -rf "build_benchmark_$backend"
+  mkdir -p "build_benchmark_$backend"
+  cd "build_benchmark_$backend" || exit 1
+
+  cmake -DCMAKE_BUILD_TYPE=Release -DASIO_IO_URING="$io_uring" .. > /dev/null || exit 1
+  make -j tcp_echo_server tcp_echo_client > /dev/null || exit 1
+
+  cd ..
+
+  # Every build type writes to the same output directory, keep a copy per backend
+  mkdir -p "$BENCHMARK_DIR/$backend"
+  cp release/tcp_echo_server release/tcp_echo_client "$BENCHMARK_DIR/$backend/"
+}
+
+count_syscalls() {
+  local pid=$1
+  local output=$2
+
+  if [ "$SYSCALL_COUNTER" == "perf" ]; then
+    perf stat -e raw_syscalls:sys_enter -p "$pid" -x, -o "$output" -- sleep "$DURATION" > /dev/null 2>&1
+    awk -F, '/raw_syscalls:sys_enter/ { print $1 }' "$output"
+  else
+    timeout -s INT "$DURATION" strace -c -f -p "$pid" -o "$output" > /dev/null 2>&1
+    awk '/total/ { print $3 }' "$output"
+  fi
+}
+
+run_backend() {
+  local name=$1
+  local backend=$2
+  local engine=$3
+  local directory="$BENCHMARK_DIR/$backend"
+
+  "$directory/tcp_echo_server" --engine="$engine" --port="$PORT" --threads="$THREADS" --stats_interval=0 --log_level=warning &
+  local server_pid=$!
+  sleep 1
+
+  "$directory/tcp_echo_client" --benchmark --port="$PORT" --connections="$CONNECTIONS" \
+    --message_size="$MESSAGE_SIZE" --duration="$DURATION" --log_level=info > "$directory/client.log" 2>&1 &
+  local client_pid=$!
+
+  local syscalls
+  syscalls=$(count_syscalls "$server_pid" "$directory/syscalls.log")
+
+  wait "$client_pid"
+  kill "$server_pid" 2> /dev/null
+  wait "$server_pid" 2> /dev/null
+
+  local result
+  result=$(grep "benchmark - messages" "$directory/client.log" | sed 's/.*benchmark - //')
+  local messages
+  messages=$(echo "$result" | sed 's/messages: \([0-9]*\).*/\1/')
+
+  echo "$name: $result"
+  if [ -n "$messages" ] && [ "$messages" -gt 0 ] && [ -n "$syscalls" ]; then
+    echo "$name: server syscalls: $syscalls - per message: $(awk -v s="$syscalls" -v m="$messages" 'BEGIN { printf "%.3f", s / m }')"
+  fi
+}
+
+build_backend epoll OFF
+build_backend io_uring ON
+
+echo "Workload: $CONNECTIONS connections, $MESSAGE_SIZE byte messages, $DURATION s, $THREADS server threads"
+
+run_backend epoll epoll asio
+run_backend io_uring io_uring asio
+run_backend uring_engine epoll uring
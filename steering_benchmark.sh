@@ -0,0 +1,109 @@
+#!/bin/bash
+
+# Compares the default SO_REUSEPORT flow hash with CPU steering (reuseport CBPF
+# program plus thread pinning) on the sharded UDP and TCP servers. The server
+# cache misses per message are counted with perf, fewer misses mean less traffic
+# between the cores that take the softirq and the cores that run the echo.
+#
+# Environment: THREADS (server threads and shards, default: CPU count),
+#              SOCKETS (UDP client sockets, 64), CONNECTIONS (TCP connections, 64),
+#              DURATION (10), PAYLOAD_SIZE (64), PORT (7173)
+
+THREADS=${THREADS:-$(nproc)}
+SOCKETS=${SOCKETS:-64}
+CONNECTIONS=${CONNECTIONS:-64}
+DURATION=${DURATION:-10}
+PAYLOAD_SIZE=${PAYLOAD_SIZE:-64}
+PORT=${PORT:-7173}
+
+BENCHMARK_DIR="benchmark_output/steering"
+EVENTS="cache-misses,LLC-load-misses,cpu-migrations"
+
+if ! command -v perf &> /dev/null; then
+  echo "perf is required to count cache misses"
+  exit 1
+fi
+
+echo "Building release..."
+
+mkdir -p build_benchmark_steering
+cd build_benchmark_steering || exit 1
+
+cmake -DCMAKE_BUILD_TYPE=Release .. > /dev/null || exit 1
+make -j tcp_echo_server tcp_echo_client udp_echo_server udp_echo_client > /dev/null || exit 1
+
+cd ..
+
+mkdir -p "$BENCHMARK_DIR"
+
+# Prints "<event> <count>" for every perf event of the output file
+read_events() {
+  awk -F, '$1 ~ /^[0-9]+$/ { print $3, $1 }' "$1"
+}
+
+report() {
+  local name=$1
+  local messages=$2
+  local perf_output=$3
+
+  echo "$name: messages: $messages"
+  read_events "$perf_output" | while read -r event count; do
+    echo "$name: $event: $count - per message: $(awk -v c="$count" -v m="$messages" 'BEGIN { if (m > 0) printf "%.4f", c / m; else print "n/a" }')"
+  done
+}
+
+run_udp() {
+  local steering=$1
+  local name="udp_$steering"
+
+  release/udp_echo_server --threads="$THREADS" --steering="$steering" --receive_mode=batch \
+    --port="$PORT" --stats_interval="$DURATION" --log_level=info > "$BENCHMARK_DIR/$name.log" 2>&1 &
+  local server_pid=$!
+  sleep 1
+
+  release/udp_echo_client --bulk --sockets="$SOCKETS" --payload_size="$PAYLOAD_SIZE" \
+    --port="$PORT" --log_level=info > "$BENCHMARK_DIR/${name}_client.log" 2>&1 &
+  local client_pid=$!
+
+  perf stat -e "$EVENTS" -p "$server_pid" -x, -o "$BENCHMARK_DIR/$name.perf" -- sleep "$DURATION" > /dev/null 2>&1
+
+  kill "$client_pid" "$server_pid" 2> /dev/null
+  wait "$client_pid" "$server_pid" 2> /dev/null
+
+  local pps
+  pps=$(grep "bulk - " "$BENCHMARK_DIR/${name}_client.log" | tail -n 1 | sed 's/.*bulk - \([0-9]*\) datagrams.*/\1/')
+
+  report "$name" "$((${pps:-0} * DURATION))" "$BENCHMARK_DIR/$name.perf"
+}
+
+run_tcp() {
+  local steering=$1
+  local name="tcp_$steering"
+
+  release/tcp_echo_server --threads="$THREADS" --shards="$THREADS" --steering="$steering" \
+    --port="$PORT" --stats_interval=0 --log_level=warning > "$BENCHMARK_DIR/$name.log" 2>&1 &
+  local server_pid=$!
+  sleep 1
+
+  release/tcp_echo_client --benchmark --connections="$CONNECTIONS" --message_size="$PAYLOAD_SIZE" \
+    --duration="$DURATION" --port="$PORT" --log_level=info > "$BENCHMARK_DIR/${name}_client.log" 2>&1 &
+  local client_pid=$!
+
+  perf stat -e "$EVENTS" -p "$server_pid" -x, -o "$BENCHMARK_DIR/$name.perf" -- sleep "$DURATION" > /dev/null 2>&1
+
+  wait "$client_pid"
+  kill "$server_pid" 2> /dev/null
+  wait "$server_pid" 2> /dev/null
+
+  local messages
+  messages=$(grep "benchmark - messages" "$BENCHMARK_DIR/${name}_client.log" | sed 's/.*messages: \([0-9]*\).*/\1/')
+
+  report "$name" "${messages:-0}" "$BENCHMARK_DIR/$name.perf"
+}
+
+echo "Workload: $THREADS server threads, $SOCKETS UDP sockets, $CONNECTIONS TCP connections, $PAYLOAD_SIZE byte messages, $DURATION s"
+
+run_udp hash
+run_udp cpu
+run_tcp hash
+run_tcp cpu
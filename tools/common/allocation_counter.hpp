@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Test hook counting every heap allocation: the global operator new, including
+// its aligned overloads, and with glibc also direct malloc, calloc and realloc
+// calls. Other C libraries only get operator new counted. It is compiled in only
+// with -DALLOCATION_COUNTING (CMake option ALLOCATION_COUNTING) because it
+// replaces the global allocation functions, so include this header from a single
+// translation unit per executable.
+namespace allocation_counter
+{
+	inline std::atomic<uint64_t>& allocations()
+	{
+		static std::atomic<uint64_t> count{ 0 };
+		return count;
+	}
+
+	inline constexpr bool enabled()
+	{
+#if defined(ALLOCATION_COUNTING)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	inline uint64_t get_allocations()
+	{
+		return allocations().load(std::memory_order_relaxed);
+	}
+}
+
+#if defined(ALLOCATION_COUNTING)
+// Kept out of line so the compiler does not pair the inlined free() with new
+#if defined(__GNUC__)
+#define ALLOCATION_COUNTER_NOINLINE __attribute__((noinline))
+#else
+#define ALLOCATION_COUNTER_NOINLINE
+#endif
+
+#if defined(__GLIBC__)
+// The allocator entry points behind malloc, so the replacements below can count
+// the calls and operator new does not count twice
+extern "C"
+{
+	void* __libc_malloc(std::size_t size);
+	void* __libc_calloc(std::size_t count, std::size_t size);
+	void* __libc_realloc(void* pointer, std::size_t size);
+}
+
+extern "C" void* malloc(const std::size_t size)
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(const std::size_t count, const std::size_t size)
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, const std::size_t size)
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+#define ALLOCATION_COUNTER_MALLOC __libc_malloc
+#else
+#define ALLOCATION_COUNTER_MALLOC std::malloc
+#endif
+
+void* operator new(const std::size_t size)
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+
+	if (void* pointer = ALLOCATION_COUNTER_MALLOC(size ? size : 1))
+		return pointer;
+
+	throw std::bad_alloc();
+}
+
+void* operator new(const std::size_t size, const std::nothrow_t&) noexcept
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+	return ALLOCATION_COUNTER_MALLOC(size ? size : 1);
+}
+
+// Over-aligned types, e.g. cache line aligned table entries
+void* operator new(const std::size_t size, const std::align_val_t alignment)
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+
+	void* pointer = nullptr;
+	const auto bytes = size ? size : 1;
+	const auto align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+	if (posix_memalign(&pointer, align, bytes) == 0)
+		return pointer;
+
+	throw std::bad_alloc();
+}
+
+void* operator new(const std::size_t size, const std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+
+	void* pointer = nullptr;
+	const auto align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+	return posix_memalign(&pointer, align, size ? size : 1) == 0 ? pointer : nullptr;
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer, std::size_t) noexcept
+{
+	std::free(pointer);
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+	std::free(pointer);
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer, std::align_val_t) noexcept
+{
+	std::free(pointer);
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept
+{
+	std::free(pointer);
+}
+
+ALLOCATION_COUNTER_NOINLINE void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	std::free(pointer);
+}
+#endif
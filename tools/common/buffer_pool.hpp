@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Size-classed buffer pool shared by every connection of the process. Buffers are
+// carved out of slabs and kept on per-thread free lists, so acquire and release
+// never take a lock. A buffer released on another thread simply joins that
+// thread's free list. Slabs are never returned to the system.
+class buffer_pool
+{
+public:
+	// Power of two size classes from 256 bytes to 1 MiB
+	static constexpr size_t min_buffer_size = 256;
+	static constexpr size_t size_classes = 13;
+	static constexpr size_t max_buffer_size = min_buffer_size << (size_classes - 1);
+
+	static constexpr size_t slab_size = 1048576;
+
+	class buffer
+	{
+	public:
+		buffer() = default;
+
+		buffer(uint8_t* data, const uint8_t size_class)
+			: m_data(data), m_size_class(size_class)
+		{
+		}
+
+		buffer(const buffer&) = delete;
+		buffer& operator=(const buffer&) = delete;
+
+		buffer(buffer&& other) noexcept
+			: m_data(std::exchange(other.m_data, nullptr)), m_size_class(other.m_size_class)
+		{
+		}
+
+		buffer& operator=(buffer&& other) noexcept
+		{
+			if (this != &other)
+			{
+				release();
+				m_data = std::exchange(other.m_data, nullptr);
+				m_size_class = other.m_size_class;
+			}
+
+			return *this;
+		}
+
+		~buffer()
+		{
+			release();
+		}
+
+		uint8_t* data() const
+		{
+			return m_data;
+		}
+
+		size_t size() const
+		{
+			return m_data ? class_size(m_size_class) : 0;
+		}
+
+		bool empty() const
+		{
+			return m_data == nullptr;
+		}
+
+		void release()
+		{
+			if (m_data)
+				buffer_pool::release(std::exchange(m_data, nullptr), m_size_class);
+		}
+
+	private:
+		uint8_t* m_data{ nullptr };
+		uint8_t m_size_class{ 0 };
+	};
+
+	// Smallest buffer able to hold size bytes, capped at max_buffer_size
+	static buffer acquire(const size_t size)
+	{
+		const auto size_class = class_of(size);
+		auto& free_list = local_free_lists()[size_class];
+
+		if (free_list.empty())
+			allocate_slab(size_class, free_list);
+
+		const auto data = free_list.back();
+		free_list.pop_back();
+
+		return { data, static_cast<uint8_t>(size_class) };
+	}
+
+	// Bytes reserved from the system by every thread
+	static uint64_t get_slab_bytes()
+	{
+		return slab_bytes().load(std::memory_order_relaxed);
+	}
+
+	static size_t class_size(const size_t size_class)
+	{
+		return min_buffer_size << size_class;
+	}
+
+	static size_t class_of(const size_t size)
+	{
+		size_t size_class = 0;
+		while (size_class + 1 < size_classes && class_size(size_class) < size)
+			++size_class;
+
+		return size_class;
+	}
+
+private:
+	using free_list = std::vector<uint8_t*>;
+
+	static void release(uint8_t* data, const uint8_t size_class)
+	{
+		local_free_lists()[size_class].push_back(data);
+	}
+
+	static void allocate_slab(const size_t size_class, free_list& free_list)
+	{
+		const auto buffer_size = class_size(size_class);
+		const auto buffers = std::max<size_t>(1, slab_size / buffer_size);
+
+		const auto slab = static_cast<uint8_t*>(::operator new(buffers * buffer_size));
+		slab_bytes().fetch_add(buffers * buffer_size, std::memory_order_relaxed);
+
+		free_list.reserve(free_list.size() + buffers);
+		for (size_t index = 0; index < buffers; ++index)
+			free_list.push_back(slab + index * buffer_size);
+	}
+
+	static std::array<free_list, size_classes>& local_free_lists()
+	{
+		thread_local std::array<free_list, size_classes> free_lists;
+		return free_lists;
+	}
+
+	static std::atomic<uint64_t>& slab_bytes()
+	{
+		static std::atomic<uint64_t> bytes{ 0 };
+		return bytes;
+	}
+};
+
+using pooled_buffer = buffer_pool::buffer;
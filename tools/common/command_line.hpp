@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Minimal "--name=value" / "--flag" parser shared by the tools
+class command_line
+{
+public:
+	command_line(const int argc, char* argv[])
+	{
+		for (int index = 1; index < argc; ++index)
+		{
+			std::string argument = argv[index];
+			if (argument.rfind("--", 0) != 0)
+				continue;
+
+			argument.erase(0, 2);
+
+			const auto separator = argument.find('=');
+			if (separator == std::string::npos)
+				m_values[argument] = "true";
+			else
+				m_values[argument.substr(0, separator)] = argument.substr(separator + 1);
+		}
+	}
+
+	bool has(const std::string& name) const
+	{
+		return m_values.count(name) != 0;
+	}
+
+	std::string get_string(const std::string& name, const std::string& default_value) const
+	{
+		const auto it = m_values.find(name);
+		return it == m_values.end() ? default_value : it->second;
+	}
+
+	uint64_t get_uint(const std::string& name, const uint64_t default_value) const
+	{
+		const auto it = m_values.find(name);
+		if (it == m_values.end())
+			return default_value;
+
+		try
+		{
+			return std::stoull(it->second);
+		}
+		catch (const std::exception&)
+		{
+			return default_value;
+		}
+	}
+
+	bool get_bool(const std::string& name, const bool default_value) const
+	{
+		const auto it = m_values.find(name);
+		if (it == m_values.end())
+			return default_value;
+
+		return it->second == "true" || it->second == "1" || it->second == "on";
+	}
+
+private:
+	std::map<std::string, std::string> m_values;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* PLOG INCLUDES */
+#include <plog/Log.h>
+
+// Thread to core pinning. Thread index i runs on CPU i modulo the CPU count, the
+// same mapping the reuseport CPU steering program uses to pick socket i, so a
+// flow is received, processed and answered on one core.
+namespace cpu_affinity
+{
+	inline size_t cpu_count()
+	{
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	inline size_t cpu_of(const size_t index)
+	{
+		return index % cpu_count();
+	}
+
+	// Returns false where pinning is not supported or the CPU is not allowed
+	inline bool pin_current_thread(const size_t index)
+	{
+#if defined(__linux__)
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		CPU_SET(cpu_of(index), &cpu_set);
+
+		const auto result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+		if (result != 0)
+		{
+			PLOGW << "cannot pin thread " << index << " to cpu " << cpu_of(index) << " - error: " << result;
+			return false;
+		}
+
+		PLOGD << "pinned thread " << index << " to cpu " << cpu_of(index);
+		return true;
+#else
+		(void)index;
+		return false;
+#endif
+	}
+}
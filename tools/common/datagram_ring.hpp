@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Fixed-capacity ring of outbound datagrams. Every slot owns a payload area of
+// slot_size bytes, the payload length and the peer endpoint, so a datagram can be
+// received straight into the next free slot and sent from it later without a copy
+// or an allocation. A ring is not thread safe: the receiving and the sending side
+// both run on the thread of its socket.
+template <typename Endpoint>
+class datagram_ring
+{
+public:
+	struct slot
+	{
+		Endpoint endpoint;
+		uint8_t* data{ nullptr };
+		size_t size{ 0 };
+	};
+
+	// capacity is rounded up to a power of two
+	datagram_ring(const size_t capacity, const size_t slot_size)
+		: m_slot_size(slot_size)
+	{
+		size_t rounded = 1;
+		while (rounded < capacity)
+			rounded <<= 1;
+
+		m_mask = rounded - 1;
+		m_slots.reset(new slot[rounded]);
+
+		// Pages are only touched once a datagram of that size is stored
+		m_payloads.reset(new uint8_t[rounded * slot_size]);
+		for (size_t index = 0; index < rounded; ++index)
+			m_slots[index].data = m_payloads.get() + index * slot_size;
+	}
+
+	datagram_ring(const datagram_ring&) = delete;
+	datagram_ring& operator=(const datagram_ring&) = delete;
+
+	size_t capacity() const
+	{
+		return m_mask + 1;
+	}
+
+	size_t slot_size() const
+	{
+		return m_slot_size;
+	}
+
+	// The next free slot, nullptr when the ring is full. It is queued for sending
+	// with commit(), until then reserve() returns it again.
+	slot* reserve()
+	{
+		if (m_tail - m_head > m_mask)
+			return nullptr;
+
+		return &m_slots[m_tail & m_mask];
+	}
+
+	void commit()
+	{
+		++m_tail;
+	}
+
+	// The oldest queued slot, nullptr when the ring is empty
+	slot* front()
+	{
+		return at(0);
+	}
+
+	// The queued slot offset places behind the oldest one, nullptr past the last
+	slot* at(const size_t offset)
+	{
+		if (offset >= size())
+			return nullptr;
+
+		return &m_slots[(m_head + offset) & m_mask];
+	}
+
+	void pop(const size_t count = 1)
+	{
+		m_head += count;
+	}
+
+	size_t size() const
+	{
+		return m_tail - m_head;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+private:
+	size_t m_slot_size;
+	size_t m_mask{ 0 };
+
+	std::unique_ptr<slot[]> m_slots;
+	std::unique_ptr<uint8_t[]> m_payloads;
+
+	size_t m_head{ 0 };
+	size_t m_tail{ 0 };
+};
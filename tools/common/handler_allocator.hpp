@@ -0,0 +1,127 @@
+#pragma once
+
+/* ASIO INCLUDES */
+#include <asio.hpp>
+#include <array>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Recycling storage for the state of asynchronous operations. Blocks are size
+// classed and kept on per-thread free lists: every connection lives on one io
+// thread, so once its echo loop has warmed up each async_* call reuses the block
+// released by the previous one and no longer reaches malloc. Blocks are not held
+// by idle connections, which keeps their footprint small.
+class handler_memory
+{
+public:
+	// Size classes of 64, 128, ... 2048 bytes, larger requests go to the heap
+	static constexpr size_t min_block_size = 64;
+	static constexpr size_t block_classes = 6;
+
+	// Blocks kept per class and thread, extra releases go back to the heap
+	static constexpr size_t max_cached_blocks = 4096;
+
+	static void* allocate(const size_t size)
+	{
+		const auto block_class = class_of(size);
+		if (block_class == block_classes)
+			return ::operator new(size);
+
+		auto& free_list = local_free_lists()[block_class];
+		if (free_list.empty())
+			return ::operator new(block_size(block_class));
+
+		const auto block = free_list.back();
+		free_list.pop_back();
+
+		return block;
+	}
+
+	static void deallocate(void* block, const size_t size)
+	{
+		const auto block_class = class_of(size);
+		if (block_class == block_classes)
+		{
+			::operator delete(block);
+			return;
+		}
+
+		auto& free_list = local_free_lists()[block_class];
+		if (free_list.size() >= max_cached_blocks)
+		{
+			::operator delete(block);
+			return;
+		}
+
+		free_list.push_back(block);
+	}
+
+private:
+	using free_list = std::vector<void*>;
+
+	static size_t block_size(const size_t block_class)
+	{
+		return min_block_size << block_class;
+	}
+
+	static size_t class_of(const size_t size)
+	{
+		size_t block_class = 0;
+		while (block_class < block_classes && block_size(block_class) < size)
+			++block_class;
+
+		return block_class;
+	}
+
+	static std::array<free_list, block_classes>& local_free_lists()
+	{
+		thread_local std::array<free_list, block_classes> free_lists;
+		return free_lists;
+	}
+};
+
+// Stateless allocator over handler_memory, associated with completion handlers
+// through asio::bind_allocator
+template <typename T>
+class handler_allocator
+{
+public:
+	using value_type = T;
+
+	handler_allocator() noexcept = default;
+
+	template <typename U>
+	handler_allocator(const handler_allocator<U>&) noexcept
+	{
+	}
+
+	T* allocate(const size_t count)
+	{
+		return static_cast<T*>(handler_memory::allocate(sizeof(T) * count));
+	}
+
+	void deallocate(T* pointer, const size_t count)
+	{
+		handler_memory::deallocate(pointer, sizeof(T) * count);
+	}
+
+	template <typename U>
+	bool operator==(const handler_allocator<U>&) const noexcept
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const handler_allocator<U>&) const noexcept
+	{
+		return false;
+	}
+};
+
+template <typename Handler>
+auto make_alloc_handler(Handler&& handler)
+{
+	return asio::bind_allocator(handler_allocator<void>(), std::forward<Handler>(handler));
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+/* ASIO INCLUDES */
+#include <asio.hpp>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/* PLOG INCLUDES */
+#include <plog/Log.h>
+
+/* COMMON INCLUDES */
+#include <cpu_affinity.hpp>
+
+// Pool of io_service instances, each one driven by exactly one thread. Objects
+// created on a pool io_service stay on that thread for their whole life, so the
+// per-connection state never needs locking.
+class io_service_pool
+{
+public:
+	explicit io_service_pool(size_t pool_size)
+	{
+		if (pool_size == 0)
+			pool_size = 1;
+
+		for (size_t index = 0; index < pool_size; ++index)
+		{
+			// Concurrency hint 1: every io_service is run by a single thread
+			m_io_services.push_back(std::make_shared<asio::io_service>(1));
+		}
+	}
+
+	io_service_pool(const io_service_pool&) = delete;
+	io_service_pool& operator=(const io_service_pool&) = delete;
+
+	~io_service_pool()
+	{
+		stop();
+		join();
+	}
+
+	size_t size() const
+	{
+		return m_io_services.size();
+	}
+
+	std::shared_ptr<asio::io_service> get_io_service(const size_t index)
+	{
+		return m_io_services[index % m_io_services.size()];
+	}
+
+	// Pin thread i to CPU i once started, see cpu_affinity
+	void set_pin_threads(const bool pin_threads)
+	{
+		m_pin_threads = pin_threads;
+	}
+
+	// Start one thread per io_service, returns immediately
+	void start()
+	{
+		if (m_started)
+			return;
+
+		m_started = true;
+
+		for (size_t index = 0; index < m_io_services.size(); ++index)
+		{
+			const auto io_service = m_io_services[index];
+			const bool pin_thread = m_pin_threads;
+			m_threads.emplace_back([io_service, index, pin_thread]()
+				{
+					if (pin_thread)
+						cpu_affinity::pin_current_thread(index);
+
+					service_thread(io_service);
+				});
+		}
+
+		PLOGD << "started io_service_pool - threads: " << m_threads.size();
+	}
+
+	// Start the pool and block until every io_service has stopped
+	void run()
+	{
+		start();
+		join();
+	}
+
+	void stop()
+	{
+		for (const auto& io_service : m_io_services)
+			io_service->stop();
+	}
+
+private:
+	static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
+	{
+		asio::io_service::work work(*io_service);
+
+		do
+		{
+			try
+			{
+				io_service->run();
+				break;
+			}
+			catch (const std::system_error& ex)
+			{
+				if (ex.code().value() == (10057) /*asio::error::not_connected*/)
+					continue;
+
+				break;
+			}
+		} while (true);
+	}
+
+	void join()
+	{
+		for (auto& thread : m_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+
+		m_threads.clear();
+	}
+
+	std::vector<std::shared_ptr<asio::io_service>> m_io_services;
+	std::vector<std::thread> m_threads;
+
+	std::atomic<bool> m_started{ false };
+	bool m_pin_threads{ false };
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// High dynamic range histogram of nanosecond latencies, laid out as HdrHistogram
+// lays out its counts: values below sub_bucket_count land in a slot of their own,
+// every doubling above that is one bucket of sub_bucket_count / 2 linear slots.
+// Any value is thus kept within 1 / 128 of itself from 1 ns up to max_value, a
+// record is a shift, a leading zero count and an increment, and two histograms
+// merge by adding their counts. Values past max_value count as max_value.
+//
+// A histogram is not thread safe: every thread records into its own and the
+// reporting side merges them on their threads.
+class latency_histogram
+{
+public:
+	// Two significant decimal digits
+	static constexpr uint32_t sub_bucket_bits = 8;
+	static constexpr uint64_t sub_bucket_count = uint64_t{ 1 } << sub_bucket_bits;
+	static constexpr uint64_t sub_bucket_half_count = sub_bucket_count / 2;
+
+	// One minute
+	static constexpr uint64_t max_value = 60000000000ULL;
+
+	latency_histogram()
+		: m_counts(get_counts_size(), 0)
+	{
+	}
+
+	void record(const uint64_t value)
+	{
+		record(value, 1);
+	}
+
+	void record(uint64_t value, const uint64_t count)
+	{
+		value = std::min(value, max_value);
+
+		m_counts[get_index(value)] += count;
+		m_total += count;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+
+	void merge(const latency_histogram& other)
+	{
+		if (other.m_total == 0)
+			return;
+
+		for (size_t index = 0; index < m_counts.size(); ++index)
+			m_counts[index] += other.m_counts[index];
+
+		m_total += other.m_total;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	void reset()
+	{
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+		m_total = 0;
+		m_min = UINT64_MAX;
+		m_max = 0;
+	}
+
+	uint64_t get_count() const
+	{
+		return m_total;
+	}
+
+	uint64_t get_min() const
+	{
+		return m_total == 0 ? 0 : m_min;
+	}
+
+	uint64_t get_max() const
+	{
+		return m_max;
+	}
+
+	double get_mean() const
+	{
+		if (m_total == 0)
+			return 0;
+
+		double sum = 0;
+		for (size_t index = 0; index < m_counts.size(); ++index)
+		{
+			if (m_counts[index] != 0)
+				sum += static_cast<double>(m_counts[index]) * get_median_value(index);
+		}
+
+		return sum / static_cast<double>(m_total);
+	}
+
+	// Value below which the given percent of the recorded values fall, reported as
+	// the highest value of its slot and never above the largest value recorded
+	uint64_t get_percentile(const double percent) const
+	{
+		if (m_total == 0)
+			return 0;
+
+		const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(
+			std::min(100.0, std::max(0.0, percent)) / 100.0 * static_cast<double>(m_total))));
+
+		uint64_t seen = 0;
+		for (size_t index = 0; index < m_counts.size(); ++index)
+		{
+			seen += m_counts[index];
+			if (seen >= rank)
+				return std::min(get_highest_value(index), m_max);
+		}
+
+		return m_max;
+	}
+
+	// Every non-empty slot in the percentile distribution format of HdrHistogram
+	// (.hgrm), values in the given unit: 1000 writes microseconds
+	void dump(std::ostream& stream, const double unit = 1000.0) const
+	{
+		stream << "       Value     Percentile TotalCount 1/(1-Percentile)\n\n";
+
+		uint64_t seen = 0;
+		for (size_t index = 0; index < m_counts.size(); ++index)
+		{
+			if (m_counts[index] == 0)
+				continue;
+
+			seen += m_counts[index];
+
+			const auto fraction = static_cast<double>(seen) / static_cast<double>(m_total);
+			const auto value = static_cast<double>(std::min(get_highest_value(index), m_max)) / unit;
+
+			stream << std::fixed;
+			stream.width(12);
+			stream.precision(3);
+			stream << value << ' ';
+			stream.width(14);
+			stream.precision(12);
+			stream << fraction << ' ';
+			stream.width(10);
+			stream << seen << ' ';
+
+			if (seen < m_total)
+			{
+				stream.width(14);
+				stream.precision(2);
+				stream << 1.0 / (1.0 - fraction);
+			}
+
+			stream << '\n';
+		}
+
+		stream.precision(3);
+		stream << "#[Mean    = " << get_mean() / unit << ", Max = " << static_cast<double>(m_max) / unit << "]\n";
+		stream << "#[Total count    = " << m_total << "]\n";
+		stream << "#[Buckets = " << get_buckets() << ", SubBuckets = " << sub_bucket_count << "]\n";
+		stream.unsetf(std::ios::floatfield);
+	}
+
+	// Percentiles of the report lines, in microseconds
+	std::string get_summary() const
+	{
+		std::ostringstream summary;
+		summary << "p50: " << static_cast<double>(get_percentile(50)) / 1000.0 << " us"
+			<< " - p90: " << static_cast<double>(get_percentile(90)) / 1000.0 << " us"
+			<< " - p99: " << static_cast<double>(get_percentile(99)) / 1000.0 << " us"
+			<< " - p99.9: " << static_cast<double>(get_percentile(99.9)) / 1000.0 << " us"
+			<< " - p99.99: " << static_cast<double>(get_percentile(99.99)) / 1000.0 << " us"
+			<< " - max: " << static_cast<double>(get_max()) / 1000.0 << " us";
+
+		return summary.str();
+	}
+
+	// Dump to a file for offline plotting, false when it cannot be written
+	bool save(const std::string& path) const
+	{
+		std::ofstream file(path);
+		if (!file)
+			return false;
+
+		dump(file);
+		return static_cast<bool>(file);
+	}
+
+private:
+	// Buckets until the first one whose range reaches max_value
+	static size_t get_buckets()
+	{
+		size_t buckets = 1;
+		for (auto smallest_untrackable = sub_bucket_count; smallest_untrackable <= max_value; smallest_untrackable <<= 1)
+			++buckets;
+
+		return buckets;
+	}
+
+	static size_t get_counts_size()
+	{
+		return (get_buckets() + 1) * sub_bucket_half_count;
+	}
+
+	static size_t get_index(const uint64_t value)
+	{
+		// Bucket 0 covers [0, sub_bucket_count), bucket b the doubling [sub_bucket_count / 2 << b, sub_bucket_count << b)
+		const auto bucket = static_cast<size_t>(64 - count_leading_zeros(value | (sub_bucket_count - 1))) - sub_bucket_bits;
+		const auto sub_bucket = static_cast<size_t>(value >> bucket);
+		return ((bucket + 1) << (sub_bucket_bits - 1)) + sub_bucket - sub_bucket_half_count;
+	}
+
+	static uint64_t get_lowest_value(const size_t index)
+	{
+		auto bucket = static_cast<int64_t>(index >> (sub_bucket_bits - 1)) - 1;
+		auto sub_bucket = static_cast<uint64_t>(index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+		if (bucket < 0)
+		{
+			sub_bucket -= sub_bucket_half_count;
+			bucket = 0;
+		}
+
+		return sub_bucket << bucket;
+	}
+
+	static uint64_t get_highest_value(const size_t index)
+	{
+		const auto bucket = std::max<int64_t>(0, static_cast<int64_t>(index >> (sub_bucket_bits - 1)) - 1);
+		return get_lowest_value(index) + (uint64_t{ 1 } << bucket) - 1;
+	}
+
+	static double get_median_value(const size_t index)
+	{
+		return (static_cast<double>(get_lowest_value(index)) + static_cast<double>(get_highest_value(index))) / 2.0;
+	}
+
+	static uint32_t count_leading_zeros(const uint64_t value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return static_cast<uint32_t>(__builtin_clzll(value));
+#else
+		uint32_t zeros = 0;
+		for (auto bit = uint64_t{ 1 } << 63; bit != 0 && (value & bit) == 0; bit >>= 1)
+			++zeros;
+
+		return zeros;
+#endif
+	}
+
+	std::vector<uint64_t> m_counts;
+	uint64_t m_total{ 0 };
+	uint64_t m_min{ UINT64_MAX };
+	uint64_t m_max{ 0 };
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+
+// Header of every open-loop message: its sequence, the time the schedule meant
+// it to go out and the time it actually went out, in steady clock nanoseconds.
+// Echo servers return it unchanged, so the echo alone tells both latencies: from
+// the intended time, which keeps counting while the sender is held back, and
+// from the actual send, which does not.
+struct schedule_stamp
+{
+	static constexpr uint32_t magic_value = 0x314c504f; // "OPL1"
+	static constexpr size_t size = 32;
+
+	uint64_t sequence{ 0 };
+	uint64_t intended_ns{ 0 };
+	uint64_t sent_ns{ 0 };
+
+	// data must have room for size bytes
+	void write(uint8_t* data) const
+	{
+		const uint32_t reserved = 0;
+		std::memcpy(data, &magic_value, sizeof(magic_value));
+		std::memcpy(data + 4, &reserved, sizeof(reserved));
+		std::memcpy(data + 8, &sequence, sizeof(sequence));
+		std::memcpy(data + 16, &intended_ns, sizeof(intended_ns));
+		std::memcpy(data + 24, &sent_ns, sizeof(sent_ns));
+	}
+
+	// False when the payload is too short or does not start with a stamp
+	bool read(const uint8_t* data, const size_t length)
+	{
+		uint32_t magic = 0;
+		if (length < size)
+			return false;
+
+		std::memcpy(&magic, data, sizeof(magic));
+		if (magic != magic_value)
+			return false;
+
+		std::memcpy(&sequence, data + 8, sizeof(sequence));
+		std::memcpy(&intended_ns, data + 16, sizeof(intended_ns));
+		std::memcpy(&sent_ns, data + 24, sizeof(sent_ns));
+		return true;
+	}
+};
+
+// Send times of an open-loop generator, fixed before anything is sent: evenly
+// spaced at the rate, or Poisson arrivals with exponential gaps of the same mean.
+// A sender that falls behind sends the overdue messages at once with their
+// original times instead of shifting the rest of the schedule, so a stalled
+// server shows in the latency of every message it held up.
+class arrival_schedule
+{
+public:
+	enum class arrivals
+	{
+		constant,
+		poisson
+	};
+
+	// Longest single sleep, so stop() is seen in time
+	static constexpr uint64_t max_sleep_ns = 100000000;
+
+	arrival_schedule(const arrivals kind, const double rate, const uint64_t seed)
+		: m_kind(kind)
+		, m_interval_ns(1e9 / std::max(rate, 1e-9))
+		, m_random(seed)
+		, m_gap(1.0 / m_interval_ns)
+	{
+	}
+
+	static bool parse(const std::string& name, arrivals& kind)
+	{
+		if (name == "constant")
+			kind = arrivals::constant;
+		else if (name == "poisson")
+			kind = arrivals::poisson;
+		else
+			return false;
+
+		return true;
+	}
+
+	static uint64_t now_ns()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// The first message is due at origin_ns
+	void start(const uint64_t origin_ns)
+	{
+		m_origin_ns = origin_ns;
+		m_offset_ns = 0;
+	}
+
+	void stop()
+	{
+		m_is_stopped.store(true, std::memory_order_relaxed);
+	}
+
+	// Intended send time of the next message
+	uint64_t get_next() const
+	{
+		return m_origin_ns + static_cast<uint64_t>(m_offset_ns);
+	}
+
+	void advance()
+	{
+		m_offset_ns += m_kind == arrivals::constant ? m_interval_ns : m_gap(m_random);
+	}
+
+	// Sleep until the next message is due, false once stopped
+	bool wait()
+	{
+		while (!m_is_stopped.load(std::memory_order_relaxed))
+		{
+			const auto now = now_ns();
+			const auto next = get_next();
+			if (next <= now)
+				return true;
+
+			std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(max_sleep_ns, next - now)));
+		}
+
+		return false;
+	}
+
+private:
+	arrivals m_kind;
+	double m_interval_ns;
+	std::mt19937_64 m_random;
+	std::exponential_distribution<double> m_gap;
+
+	std::atomic<bool> m_is_stopped{ false };
+
+	// Owned by the sending thread
+	uint64_t m_origin_ns{ 0 };
+	double m_offset_ns{ 0 };
+};
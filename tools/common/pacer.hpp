@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
+
+// Token bucket pacer of one sending thread. Credit accrues with the elapsed time
+// at the packet rate and at the byte rate, up to max_burst_ns worth of it, and a
+// packet may go out once both buckets hold its cost. wait() sleeps until the
+// next packet is due; whatever a sleep overshoots accrues as credit and leaves as
+// a burst, so the average rate holds without spinning, at ten packets per second
+// as well as at a million. A rate of 0 does not limit.
+class token_bucket_pacer
+{
+public:
+	// Credit kept while the sender is late, larger gaps are not made up
+	static constexpr uint64_t max_burst_ns = 2000000;
+
+	// Longest single sleep, so rate changes and stop() are seen in time
+	static constexpr uint64_t max_sleep_ns = 100000000;
+
+	// Callable from any thread, the sending thread picks the rates up on its next wait
+	void set_rates(const uint64_t packets_per_second, const uint64_t bytes_per_second)
+	{
+		m_packets_per_second.store(packets_per_second, std::memory_order_relaxed);
+		m_bytes_per_second.store(bytes_per_second, std::memory_order_relaxed);
+	}
+
+	void stop()
+	{
+		m_is_stopped.store(true, std::memory_order_relaxed);
+	}
+
+	// Sleep until at least one packet of size bytes may go out, returns how many
+	// may go out now, 0 once stopped
+	size_t wait(const size_t size)
+	{
+		while (!m_is_stopped.load(std::memory_order_relaxed))
+		{
+			const auto packets_per_second = static_cast<double>(m_packets_per_second.load(std::memory_order_relaxed));
+			const auto bytes_per_second = static_cast<double>(m_bytes_per_second.load(std::memory_order_relaxed));
+			const auto cost = static_cast<double>(std::max<size_t>(1, size));
+
+			refill(packets_per_second, bytes_per_second, cost);
+
+			const auto by_packets = packets_per_second > 0 ? m_packet_credit : max_burst_packets;
+			const auto by_bytes = bytes_per_second > 0 ? m_byte_credit / cost : max_burst_packets;
+			const auto ready = std::min({ by_packets, by_bytes, max_burst_packets });
+			if (ready >= 1)
+				return static_cast<size_t>(ready);
+
+			// Time until both buckets hold one more packet
+			double wait_ns = 0;
+			if (packets_per_second > 0 && m_packet_credit < 1)
+				wait_ns = std::max(wait_ns, (1 - m_packet_credit) / packets_per_second * 1e9);
+			if (bytes_per_second > 0 && m_byte_credit < cost)
+				wait_ns = std::max(wait_ns, (cost - m_byte_credit) / bytes_per_second * 1e9);
+
+			std::this_thread::sleep_for(std::chrono::nanoseconds(
+				std::min<uint64_t>(max_sleep_ns, static_cast<uint64_t>(wait_ns) + 1)));
+		}
+
+		return 0;
+	}
+
+	// Pay for packets carrying bytes in total that went out
+	void consume(const size_t packets, const uint64_t bytes)
+	{
+		m_packet_credit -= static_cast<double>(packets);
+		m_byte_credit -= static_cast<double>(bytes);
+	}
+
+	// The default timer slack of 50 us would delay every sleep of the calling
+	// thread by up to that much
+	static void set_precise_timers()
+	{
+#if defined(__linux__)
+		prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+#endif
+	}
+
+private:
+	// Safety bound of one burst when a bucket does not limit
+	static constexpr double max_burst_packets = 65536;
+
+	void refill(const double packets_per_second, const double bytes_per_second, const double cost)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		if (!m_is_started)
+		{
+			m_is_started = true;
+			m_last_refill = now;
+			m_packet_credit = 1;
+			m_byte_credit = cost;
+			return;
+		}
+
+		const auto elapsed = std::chrono::duration<double>(now - m_last_refill).count();
+		m_last_refill = now;
+
+		const auto burst = static_cast<double>(max_burst_ns) / 1e9;
+
+		// A bucket always holds room for two packets however low its rate, so the
+		// time a sleep overshoots the due packet counts towards the next one
+		m_packet_credit = std::min(m_packet_credit + elapsed * packets_per_second, std::max(2.0, packets_per_second * burst));
+		m_byte_credit = std::min(m_byte_credit + elapsed * bytes_per_second, std::max(2.0 * cost, bytes_per_second * burst));
+	}
+
+	std::atomic<uint64_t> m_packets_per_second{ 0 };
+	std::atomic<uint64_t> m_bytes_per_second{ 0 };
+	std::atomic<bool> m_is_stopped{ false };
+
+	// Owned by the sending thread
+	bool m_is_started{ false };
+	std::chrono::steady_clock::time_point m_last_refill;
+	double m_packet_credit{ 0 };
+	double m_byte_credit{ 0 };
+};
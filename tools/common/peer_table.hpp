@@ -0,0 +1,312 @@
+#pragma once
+
+/* ASIO INCLUDES */
+#include <asio.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Per-peer session table of one io thread: an open-addressing hash table with
+// linear probing, keyed by the packed address and port of the peer. The entries
+// hold the counters inline and are cache line aligned, so recording a datagram
+// touches a single cache line.
+// The table grows by doubling up to the capacity of max_peers and never beyond,
+// the datagrams of peers arriving at a full table are counted as untracked.
+class peer_table
+{
+public:
+	struct peer
+	{
+		asio::ip::udp::endpoint endpoint;
+		uint64_t packets{ 0 };
+		uint64_t bytes{ 0 };
+		uint64_t idle_ms{ 0 };
+	};
+
+	explicit peer_table(const size_t max_peers, const size_t initial_capacity = 1024)
+		: m_max_peers(std::max<size_t>(1, max_peers))
+	{
+		// Keep the load factor at 3/4 even when every peer is tracked
+		m_max_capacity = round_up(m_max_peers + m_max_peers / 3 + 1);
+		m_entries.resize(std::min(round_up(initial_capacity), m_max_capacity));
+		m_mask = m_entries.size() - 1;
+	}
+
+	// Count packets datagrams of bytes bytes from the peer, false when the table
+	// is full and the peer is not tracked
+	bool record(const asio::ip::udp::endpoint& endpoint, const uint64_t packets, const uint64_t bytes, const uint64_t now_ms)
+	{
+		const auto key = make_key(endpoint);
+
+		auto index = hash(key) & m_mask;
+		while (m_entries[index].key.family != 0)
+		{
+			if (m_entries[index].key == key)
+			{
+				auto& entry = m_entries[index];
+				entry.packets += packets;
+				entry.recent_packets += packets;
+				entry.bytes += bytes;
+				entry.last_seen_ms = now_ms;
+				return true;
+			}
+
+			index = (index + 1) & m_mask;
+		}
+
+		if (m_size == m_max_peers)
+		{
+			m_untracked_packets += packets;
+			return false;
+		}
+
+		if ((m_size + 1) * 4 > m_entries.size() * 3 && m_entries.size() < m_max_capacity)
+		{
+			grow();
+
+			index = hash(key) & m_mask;
+			while (m_entries[index].key.family != 0)
+				index = (index + 1) & m_mask;
+		}
+
+		auto& entry = m_entries[index];
+		entry.key = key;
+		entry.packets = packets;
+		entry.recent_packets = packets;
+		entry.bytes = bytes;
+		entry.last_seen_ms = now_ms;
+
+		++m_size;
+		return true;
+	}
+
+	// Drop the peers idle for longer than idle_timeout_ms, returns how many
+	size_t sweep(const uint64_t now_ms, const uint64_t idle_timeout_ms)
+	{
+		size_t expired = 0;
+
+		for (size_t index = 0; index < m_entries.size();)
+		{
+			const auto& entry = m_entries[index];
+			if (entry.key.family != 0 && now_ms - entry.last_seen_ms > idle_timeout_ms)
+			{
+				// The slot gets the next entry of the cluster, look at it again
+				erase(index);
+				++expired;
+				continue;
+			}
+
+			++index;
+		}
+
+		return expired;
+	}
+
+	// Peers that sent at least min_packets datagrams since the last call
+	std::vector<asio::ip::udp::endpoint> take_heavy(const uint64_t min_packets)
+	{
+		std::vector<asio::ip::udp::endpoint> endpoints;
+
+		for (auto& entry : m_entries)
+		{
+			if (entry.key.family != 0 && entry.recent_packets >= min_packets)
+				endpoints.push_back(make_endpoint(entry.key));
+
+			entry.recent_packets = 0;
+		}
+
+		return endpoints;
+	}
+
+	// The count peers with the most packets, most active first
+	std::vector<peer> top(const size_t count, const uint64_t now_ms) const
+	{
+		const auto fewer_packets = [](const entry* left, const entry* right)
+			{
+				return left->packets > right->packets;
+			};
+
+		// Min-heap of the best count entries seen so far
+		std::vector<const entry*> heap;
+		heap.reserve(count);
+
+		for (const auto& entry : m_entries)
+		{
+			if (entry.key.family == 0 || count == 0)
+				continue;
+
+			if (heap.size() < count)
+			{
+				heap.push_back(&entry);
+				std::push_heap(heap.begin(), heap.end(), fewer_packets);
+			}
+			else if (entry.packets > heap.front()->packets)
+			{
+				std::pop_heap(heap.begin(), heap.end(), fewer_packets);
+				heap.back() = &entry;
+				std::push_heap(heap.begin(), heap.end(), fewer_packets);
+			}
+		}
+
+		std::sort_heap(heap.begin(), heap.end(), fewer_packets);
+
+		std::vector<peer> peers;
+		peers.reserve(heap.size());
+
+		for (const auto* entry : heap)
+			peers.push_back({ make_endpoint(entry->key), entry->packets, entry->bytes, now_ms - entry->last_seen_ms });
+
+		return peers;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	uint64_t untracked_packets() const
+	{
+		return m_untracked_packets;
+	}
+
+	size_t memory_bytes() const
+	{
+		return m_entries.size() * sizeof(entry);
+	}
+
+private:
+	// IPv4 addresses use the low word only, the family tells the empty slots apart
+	struct key_type
+	{
+		uint64_t address_high{ 0 };
+		uint64_t address_low{ 0 };
+		uint16_t port{ 0 };
+		uint16_t family{ 0 };
+
+		bool operator==(const key_type& other) const
+		{
+			return address_low == other.address_low && address_high == other.address_high
+				&& port == other.port && family == other.family;
+		}
+	};
+
+	// 56 bytes of data: packed to 48 a half of the entries would still straddle
+	// two lines, so every entry gets a line of its own instead
+	struct alignas(64) entry
+	{
+		key_type key;
+		uint64_t packets{ 0 };
+		uint64_t bytes{ 0 };
+		uint64_t last_seen_ms{ 0 };
+
+		// Packets since the last take_heavy
+		uint64_t recent_packets{ 0 };
+	};
+
+	static_assert(sizeof(entry) == 64, "a peer_table entry must fill exactly one cache line");
+
+	static size_t round_up(const size_t value)
+	{
+		size_t rounded = 1;
+		while (rounded < value)
+			rounded <<= 1;
+
+		return rounded;
+	}
+
+	static key_type make_key(const asio::ip::udp::endpoint& endpoint)
+	{
+		key_type key;
+		key.port = endpoint.port();
+
+		const auto address = endpoint.address();
+		if (address.is_v4())
+		{
+			key.address_low = address.to_v4().to_uint();
+			key.family = 4;
+			return key;
+		}
+
+		const auto bytes = address.to_v6().to_bytes();
+		std::memcpy(&key.address_high, bytes.data(), sizeof(key.address_high));
+		std::memcpy(&key.address_low, bytes.data() + sizeof(key.address_high), sizeof(key.address_low));
+		key.family = 6;
+		return key;
+	}
+
+	static asio::ip::udp::endpoint make_endpoint(const key_type& key)
+	{
+		if (key.family == 4)
+			return { asio::ip::address_v4(static_cast<uint32_t>(key.address_low)), key.port };
+
+		asio::ip::address_v6::bytes_type bytes;
+		std::memcpy(bytes.data(), &key.address_high, sizeof(key.address_high));
+		std::memcpy(bytes.data() + sizeof(key.address_high), &key.address_low, sizeof(key.address_low));
+		return { asio::ip::address_v6(bytes), key.port };
+	}
+
+	static uint64_t hash(const key_type& key)
+	{
+		auto value = key.address_high * 0x9e3779b97f4a7c15ULL ^ key.address_low;
+		value ^= static_cast<uint64_t>(key.port) << 48 | key.family;
+
+		value ^= value >> 33;
+		value *= 0xff51afd7ed558ccdULL;
+		value ^= value >> 33;
+		value *= 0xc4ceb9fe1a85ec53ULL;
+		value ^= value >> 33;
+		return value;
+	}
+
+	void grow()
+	{
+		std::vector<entry> entries(m_entries.size() * 2);
+		const auto mask = entries.size() - 1;
+
+		for (const auto& entry : m_entries)
+		{
+			if (entry.key.family == 0)
+				continue;
+
+			auto index = hash(entry.key) & mask;
+			while (entries[index].key.family != 0)
+				index = (index + 1) & mask;
+
+			entries[index] = entry;
+		}
+
+		m_entries.swap(entries);
+		m_mask = mask;
+	}
+
+	// Backward shift deletion: pull the following entries of the cluster into the
+	// hole unless that would move them in front of their home slot
+	void erase(size_t index)
+	{
+		auto next = (index + 1) & m_mask;
+		while (m_entries[next].key.family != 0)
+		{
+			const auto home = hash(m_entries[next].key) & m_mask;
+			if (((next - home) & m_mask) >= ((next - index) & m_mask))
+			{
+				m_entries[index] = m_entries[next];
+				index = next;
+			}
+
+			next = (next + 1) & m_mask;
+		}
+
+		m_entries[index] = entry{};
+		--m_size;
+	}
+
+	std::vector<entry> m_entries;
+	size_t m_mask{ 0 };
+	size_t m_size{ 0 };
+
+	size_t m_max_peers;
+	size_t m_max_capacity{ 0 };
+	uint64_t m_untracked_packets{ 0 };
+};
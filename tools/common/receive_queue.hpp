@@ -0,0 +1,133 @@
+#pragma once
+
+#if defined(__linux__)
+#include <linux/sock_diag.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+
+// Datagrams the kernel drops because the receive queue of the socket is full never
+// reach the application, only the socket counts them (sk_drops). SO_RXQ_OVFL adds
+// that counter to every received datagram as a control message; SO_MEMINFO, or the
+// drops column of /proc/net/udp on kernels without it, reads it together with the
+// bytes waiting in the queue and the size of the receive buffer.
+namespace receive_queue
+{
+	struct state
+	{
+		uint64_t queued_bytes{ 0 };
+		uint64_t buffer_bytes{ 0 };
+		uint64_t drops{ 0 };
+	};
+
+	inline bool enable_overflow_counter(const int fd)
+	{
+#if defined(SO_RXQ_OVFL)
+		const int enable = 1;
+		return setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) == 0;
+#else
+		(void)fd;
+		return false;
+#endif
+	}
+
+	// Drops of the socket when the datagram was queued, 0 when the message has no
+	// counter because nothing was dropped yet
+	inline uint64_t get_overflow_counter(const msghdr& header)
+	{
+#if defined(SO_RXQ_OVFL)
+		for (auto* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(const_cast<msghdr*>(&header), control))
+		{
+			if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SO_RXQ_OVFL)
+				continue;
+
+			uint32_t drops = 0;
+			std::memcpy(&drops, CMSG_DATA(control), sizeof(drops));
+			return drops;
+		}
+#else
+		(void)header;
+#endif
+
+		return 0;
+	}
+
+	// The line of the socket in /proc/net/udp or /proc/net/udp6, found by inode
+	inline bool read_proc(const int fd, state& result)
+	{
+		struct stat status{};
+		if (fstat(fd, &status) != 0)
+			return false;
+
+		for (const auto* path : { "/proc/net/udp", "/proc/net/udp6" })
+		{
+			auto* file = std::fopen(path, "r");
+			if (!file)
+				continue;
+
+			// The first line is the header
+			char line[512];
+			bool found = false;
+			bool header = true;
+
+			while (!found && std::fgets(line, sizeof(line), file))
+			{
+				if (header)
+				{
+					header = false;
+					continue;
+				}
+
+				unsigned long rx_queue = 0;
+				unsigned long inode = 0;
+				unsigned long long drops = 0;
+
+				// sl local remote st tx_queue:rx_queue tr:when retrnsmt uid timeout inode ref pointer drops
+				if (std::sscanf(line, "%*s %*s %*s %*s %*x:%lx %*s %*s %*s %*s %lu %*s %*s %llu",
+					&rx_queue, &inode, &drops) != 3 || inode != status.st_ino)
+				{
+					continue;
+				}
+
+				result.queued_bytes = rx_queue;
+				result.drops = drops;
+				found = true;
+			}
+
+			std::fclose(file);
+
+			if (found)
+			{
+				int buffer = 0;
+				socklen_t length = sizeof(buffer);
+				if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, &length) == 0)
+					result.buffer_bytes = static_cast<uint64_t>(buffer);
+
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	inline bool read(const int fd, state& result)
+	{
+#if defined(SO_MEMINFO)
+		uint32_t memory[SK_MEMINFO_VARS] = {};
+		socklen_t length = sizeof(memory);
+		if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, memory, &length) == 0 && length >= sizeof(uint32_t) * (SK_MEMINFO_DROPS + 1))
+		{
+			result.queued_bytes = memory[SK_MEMINFO_RMEM_ALLOC];
+			result.buffer_bytes = memory[SK_MEMINFO_RCVBUF];
+			result.drops = memory[SK_MEMINFO_DROPS];
+			return true;
+		}
+#endif
+
+		return read_proc(fd, result);
+	}
+}
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Header stamped at the start of every generated datagram: the flow it belongs
+// to, its sequence number within the flow and the time it was sent. Echo servers
+// return it unchanged, so the sender reads it back from the echo.
+struct datagram_stamp
+{
+	static constexpr uint32_t magic_value = 0x31514553; // "SEQ1"
+	static constexpr size_t size = 24;
+
+	uint32_t flow{ 0 };
+	uint64_t sequence{ 0 };
+	uint64_t send_time_ns{ 0 };
+
+	// data must have room for size bytes
+	void write(uint8_t* data) const
+	{
+		std::memcpy(data, &magic_value, sizeof(magic_value));
+		std::memcpy(data + 4, &flow, sizeof(flow));
+		std::memcpy(data + 8, &sequence, sizeof(sequence));
+		std::memcpy(data + 16, &send_time_ns, sizeof(send_time_ns));
+	}
+
+	// False when the payload is too short or does not start with a stamp
+	bool read(const uint8_t* data, const size_t length)
+	{
+		uint32_t magic = 0;
+		if (length < size)
+			return false;
+
+		std::memcpy(&magic, data, sizeof(magic));
+		if (magic != magic_value)
+			return false;
+
+		std::memcpy(&flow, data + 4, sizeof(flow));
+		std::memcpy(&sequence, data + 8, sizeof(sequence));
+		std::memcpy(&send_time_ns, data + 16, sizeof(send_time_ns));
+		return true;
+	}
+};
+
+// Receive side of a sequence-numbered flow: a bitmap of the last window_bits
+// sequences below the highest one received. A sequence ahead of the window slides
+// it forward and counts every sequence pushed out without having arrived as lost;
+// a sequence inside it is either a duplicate or a reordered arrival, whose
+// distance is how far behind the highest sequence it came. Every sequence is
+// touched once on the way in and once on the way out, so the cost per datagram
+// stays constant however far the flow runs.
+class sequence_window
+{
+public:
+	explicit sequence_window(const size_t window_bits = 4096)
+	{
+		size_t bits = 64;
+		while (bits < window_bits)
+			bits <<= 1;
+
+		m_mask = bits - 1;
+		m_words.assign(bits / 64, 0);
+	}
+
+	void receive(const uint64_t sequence)
+	{
+		if (sequence >= m_next)
+		{
+			advance(sequence + 1);
+			set(sequence);
+			++m_received;
+			return;
+		}
+
+		// Fell out of the window, already counted as lost
+		if (m_next - sequence > window_size())
+		{
+			++m_late;
+			return;
+		}
+
+		if (test(sequence))
+		{
+			++m_duplicates;
+			return;
+		}
+
+		set(sequence);
+		++m_received;
+		++m_reordered;
+
+		const auto distance = m_next - 1 - sequence;
+		m_reorder_distance_sum += distance;
+		if (distance > m_max_reorder_distance)
+			m_max_reorder_distance = distance;
+	}
+
+	size_t window_size() const
+	{
+		return m_mask + 1;
+	}
+
+	uint64_t received() const
+	{
+		return m_received;
+	}
+
+	uint64_t lost() const
+	{
+		return m_lost;
+	}
+
+	uint64_t reordered() const
+	{
+		return m_reordered;
+	}
+
+	uint64_t reorder_distance_sum() const
+	{
+		return m_reorder_distance_sum;
+	}
+
+	uint64_t duplicates() const
+	{
+		return m_duplicates;
+	}
+
+	uint64_t late() const
+	{
+		return m_late;
+	}
+
+	// Largest reorder distance since the last call
+	uint64_t take_max_reorder_distance()
+	{
+		const auto distance = m_max_reorder_distance;
+		m_max_reorder_distance = 0;
+		return distance;
+	}
+
+private:
+	bool test(const uint64_t sequence) const
+	{
+		const auto index = sequence & m_mask;
+		return (m_words[index / 64] >> (index % 64)) & 1;
+	}
+
+	void set(const uint64_t sequence)
+	{
+		const auto index = sequence & m_mask;
+		m_words[index / 64] |= uint64_t{ 1 } << (index % 64);
+	}
+
+	// Slide the window so next is the first sequence past it
+	void advance(const uint64_t next)
+	{
+		const auto window = static_cast<uint64_t>(window_size());
+
+		if (next - m_next >= window)
+		{
+			// The whole window leaves, and whatever was skipped never entered it
+			const auto first_valid = m_next > window ? m_next - window : 0;
+			uint64_t present = 0;
+			for (auto& word : m_words)
+			{
+				present += std::bitset<64>(word).count();
+				word = 0;
+			}
+
+			m_lost += (m_next - first_valid) - present;
+			if (next - window > m_next)
+				m_lost += next - window - m_next;
+
+			m_next = next;
+			return;
+		}
+
+		for (auto sequence = m_next; sequence < next; ++sequence)
+		{
+			// The slot still holds the sequence one window behind
+			if (sequence >= window && !test(sequence))
+				++m_lost;
+
+			const auto index = sequence & m_mask;
+			m_words[index / 64] &= ~(uint64_t{ 1 } << (index % 64));
+		}
+
+		m_next = next;
+	}
+
+	std::vector<uint64_t> m_words;
+	size_t m_mask{ 0 };
+
+	// One past the highest sequence received
+	uint64_t m_next{ 0 };
+
+	uint64_t m_received{ 0 };
+	uint64_t m_lost{ 0 };
+	uint64_t m_reordered{ 0 };
+	uint64_t m_reorder_distance_sum{ 0 };
+	uint64_t m_max_reorder_distance{ 0 };
+	uint64_t m_duplicates{ 0 };
+	uint64_t m_late{ 0 };
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+/* ASIO INCLUDES */
+#include <asio.hpp>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <sys/socket.h>
+#endif
+
+// Lets several sockets bind the same address and port, the kernel then spreads
+// incoming connections or datagram flows between them
+#if defined(SO_REUSEPORT)
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#define REUSEPORT_STEERING_SUPPORTED
+#endif
+
+// Replace the flow hash of a SO_REUSEPORT group by the id of the CPU that received
+// the packet or connection: socket cpu % sockets of the group, in bind order.
+// Attach it to any socket of the group once every socket is bound; with threads
+// pinned by cpu_affinity, socket i is served on CPU i.
+inline bool attach_reuseport_cpu_steering(const int fd, const size_t sockets)
+{
+#if defined(REUSEPORT_STEERING_SUPPORTED)
+	sock_filter code[] = {
+		// A = id of the receiving CPU
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+		// A = A % sockets
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(std::max<size_t>(1, sockets)) },
+		// return A, the index of the socket in the group
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+
+	sock_fprog program{ static_cast<unsigned short>(sizeof(code) / sizeof(code[0])), code };
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+	(void)fd;
+	(void)sockets;
+	return false;
+#endif
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/* ASIO INCLUDES */
+#include <asio.hpp>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#endif
+
+// Local endpoints outgoing sockets bind to before they connect. A connection is
+// unique by its four-tuple, so towards one server address and port a client
+// address runs out at the size of the ephemeral port range; every further source
+// address adds another range. Socket i takes address i % addresses, and with an
+// explicit port range port first + (i / addresses) % ports, so consecutive
+// sockets spread over the addresses first.
+class source_addresses
+{
+public:
+	// Comma separated addresses and IPv4 ranges: "127.0.0.2-127.0.0.254,10.0.0.1".
+	// False when an entry does not parse, the entries before it are kept.
+	bool add_addresses(const std::string& list)
+	{
+		for (const auto& entry : split(list, ','))
+		{
+			std::error_code error;
+			const auto dash = entry.find('-');
+			if (dash == std::string::npos)
+			{
+				const auto address = asio::ip::make_address(entry, error);
+				if (error)
+					return false;
+
+				m_addresses.push_back(address);
+				continue;
+			}
+
+			const auto first = asio::ip::make_address_v4(entry.substr(0, dash), error);
+			if (error)
+				return false;
+
+			const auto last = asio::ip::make_address_v4(entry.substr(dash + 1), error);
+			if (error || last.to_uint() < first.to_uint())
+				return false;
+
+			for (auto value = static_cast<uint64_t>(first.to_uint()); value <= last.to_uint(); ++value)
+				m_addresses.push_back(asio::ip::make_address_v4(static_cast<asio::ip::address_v4::uint_type>(value)));
+		}
+
+		return true;
+	}
+
+	// "20000-60000" or a single port, empty leaves the port to the kernel
+	bool set_ports(const std::string& range)
+	{
+		if (range.empty())
+			return true;
+
+		const auto dash = range.find('-');
+		const auto first = to_port(range.substr(0, dash));
+		const auto last = dash == std::string::npos ? first : to_port(range.substr(dash + 1));
+		if (first == 0 || last < first)
+			return false;
+
+		m_first_port = first;
+		m_last_port = last;
+		return true;
+	}
+
+	bool empty() const
+	{
+		return m_addresses.empty();
+	}
+
+	size_t size() const
+	{
+		return m_addresses.size();
+	}
+
+	// Distinct local endpoints, 0 when the kernel picks the ports
+	size_t get_endpoints() const
+	{
+		return m_first_port == 0 ? 0 : m_addresses.size() * (m_last_port - m_first_port + 1);
+	}
+
+	template <typename Endpoint>
+	Endpoint get_endpoint(const size_t index) const
+	{
+		const auto& address = m_addresses[index % m_addresses.size()];
+		if (m_first_port == 0)
+			return Endpoint(address, 0);
+
+		const auto ports = static_cast<size_t>(m_last_port - m_first_port + 1);
+		return Endpoint(address, static_cast<uint16_t>(m_first_port + (index / m_addresses.size()) % ports));
+	}
+
+	// Open the socket and bind it to local. Without a port a TCP socket binds with
+	// IP_BIND_ADDRESS_NO_PORT, so the port is picked at connect time against the
+	// remote endpoint and every address gets the whole ephemeral range for each
+	// server; a plain bind would reserve the port for all destinations. An explicit
+	// port binds with SO_REUSEADDR, so it can be taken again while the previous
+	// connection on it is still in TIME_WAIT.
+	template <typename Socket>
+	static void bind(Socket& socket, const typename Socket::endpoint_type& local, std::error_code& error)
+	{
+		socket.open(local.protocol(), error);
+		if (error)
+			return;
+
+		if (local.port() != 0)
+		{
+			socket.set_option(asio::socket_base::reuse_address(true), error);
+		}
+		else if (std::is_same<typename Socket::protocol_type, asio::ip::tcp>::value)
+		{
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+			const int enable = 1;
+			setsockopt(socket.native_handle(), IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable));
+#endif
+		}
+
+		if (!error)
+			socket.bind(local, error);
+
+		if (error)
+		{
+			std::error_code ignored;
+			socket.close(ignored);
+		}
+	}
+
+private:
+	static std::vector<std::string> split(const std::string& text, const char separator)
+	{
+		std::vector<std::string> parts;
+		size_t begin = 0;
+		while (begin <= text.size())
+		{
+			const auto end = std::min(text.find(separator, begin), text.size());
+			if (end > begin)
+				parts.push_back(text.substr(begin, end - begin));
+
+			begin = end + 1;
+		}
+
+		return parts;
+	}
+
+	static uint16_t to_port(const std::string& text)
+	{
+		if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos || text.size() > 5)
+			return 0;
+
+		const auto value = std::stoul(text);
+		return value > 65535 ? 0 : static_cast<uint16_t>(value);
+	}
+
+	std::vector<asio::ip::address> m_addresses;
+	uint16_t m_first_port{ 0 };
+	uint16_t m_last_port{ 0 };
+};
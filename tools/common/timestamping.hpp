@@ -0,0 +1,143 @@
+#pragma once
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(SO_TIMESTAMPING) && defined(SO_EE_ORIGIN_TIMESTAMPING)
+#define TIMESTAMPING_SUPPORTED
+#endif
+
+// Software timestamps taken by the kernel: the receive time of a packet arrives
+// with the data as a control message, the transmit time of a send is queued on
+// the socket error queue under the id the kernel gave that send (OPT_ID). UDP
+// numbers the sends 0, 1, 2..., TCP uses the offset of the last byte of the send
+// in the byte stream. Both are CLOCK_REALTIME nanoseconds.
+namespace timestamping
+{
+	// Ancillary data area of a timestamped receive
+	struct alignas(cmsghdr) control_buffer
+	{
+		uint8_t data[256];
+	};
+
+	// The clock of the kernel software timestamps
+	inline uint64_t now_ns()
+	{
+		timespec time{};
+		clock_gettime(CLOCK_REALTIME, &time);
+		return static_cast<uint64_t>(time.tv_sec) * 1000000000ULL + static_cast<uint64_t>(time.tv_nsec);
+	}
+
+	inline bool enable(const int fd)
+	{
+#if defined(TIMESTAMPING_SUPPORTED)
+		const int flags = SOF_TIMESTAMPING_SOFTWARE
+			| SOF_TIMESTAMPING_RX_SOFTWARE
+			| SOF_TIMESTAMPING_TX_SOFTWARE
+			| SOF_TIMESTAMPING_OPT_ID
+			| SOF_TIMESTAMPING_OPT_TSONLY;
+
+		return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+#else
+		(void)fd;
+		return false;
+#endif
+	}
+
+	// Timestamp carried by a received message, 0 when it has none
+	inline uint64_t get_receive_time(const msghdr& header)
+	{
+#if defined(TIMESTAMPING_SUPPORTED)
+		for (auto* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(const_cast<msghdr*>(&header), control))
+		{
+			if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SO_TIMESTAMPING)
+				continue;
+
+			// Software stamp first, the other two are hardware stamps
+			timespec time[3];
+			std::memcpy(time, CMSG_DATA(control), sizeof(time));
+			return static_cast<uint64_t>(time[0].tv_sec) * 1000000000ULL + static_cast<uint64_t>(time[0].tv_nsec);
+		}
+#else
+		(void)header;
+#endif
+
+		return 0;
+	}
+
+	// recv() that also returns the receive timestamp of the data, 0 when it has none
+	inline ssize_t receive(const int fd, void* data, const size_t size, uint64_t& receive_time)
+	{
+		iovec vector{ data, size };
+		control_buffer control;
+
+		msghdr header{};
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+		header.msg_control = control.data;
+		header.msg_controllen = sizeof(control.data);
+
+		const auto result = recvmsg(fd, &header, MSG_DONTWAIT);
+		receive_time = result > 0 ? get_receive_time(header) : 0;
+		return result;
+	}
+
+	// Next transmit timestamp queued on the socket, false once the queue is empty
+	inline bool read_transmit_time(const int fd, uint32_t& id, uint64_t& transmit_time)
+	{
+#if defined(TIMESTAMPING_SUPPORTED)
+		while (true)
+		{
+			control_buffer control;
+
+			msghdr header{};
+			header.msg_control = control.data;
+			header.msg_controllen = sizeof(control.data);
+
+			if (recvmsg(fd, &header, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+				return false;
+
+			transmit_time = 0;
+			bool has_id = false;
+
+			for (auto* message = CMSG_FIRSTHDR(&header); message; message = CMSG_NXTHDR(&header, message))
+			{
+				if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SO_TIMESTAMPING)
+				{
+					transmit_time = get_receive_time(header);
+				}
+				else if ((message->cmsg_level == SOL_IP && message->cmsg_type == IP_RECVERR)
+					|| (message->cmsg_level == SOL_IPV6 && message->cmsg_type == IPV6_RECVERR))
+				{
+					sock_extended_err error;
+					std::memcpy(&error, CMSG_DATA(message), sizeof(error));
+
+					if (error.ee_errno == ENOMSG && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+					{
+						id = error.ee_data;
+						has_id = true;
+					}
+				}
+			}
+
+			// Anything else on the error queue is not ours to report
+			if (has_id && transmit_time != 0)
+				return true;
+		}
+#else
+		(void)fd;
+		(void)id;
+		(void)transmit_time;
+		return false;
+#endif
+	}
+}
+#endif
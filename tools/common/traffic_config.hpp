@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <string>
+
+/* JSONCPP INCLUDES */
+#include <json/json.h>
+
+/* PLOG INCLUDES */
+#include <plog/Log.h>
+
+// Traffic settings of configs.ini: where to send and the bounds of the rates the
+// paced generators draw from
+struct traffic_config
+{
+	uint64_t bytes_per_second_min{ 0 };
+	uint64_t bytes_per_second_max{ 0 };
+	uint64_t packets_per_second_min{ 0 };
+	uint64_t packets_per_second_max{ 0 };
+	std::string destination_address{ "127.0.0.1" };
+	uint16_t destination_port{ 0 };
+	std::string protocol{ "UDP" };
+
+	// Missing keys keep their defaults, false when the file cannot be read or parsed
+	bool load(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			PLOGE << "cannot open " << path;
+			return false;
+		}
+
+		Json::Value root;
+		Json::CharReaderBuilder builder;
+		std::string errors;
+		if (!Json::parseFromStream(builder, file, &root, &errors) || !root.isObject())
+		{
+			PLOGE << "cannot parse " << path << ": " << errors;
+			return false;
+		}
+
+		bytes_per_second_min = root.get("bytes_per_seconds_min", Json::UInt64(bytes_per_second_min)).asUInt64();
+		bytes_per_second_max = root.get("bytes_per_seconds_max", Json::UInt64(bytes_per_second_max)).asUInt64();
+		packets_per_second_min = root.get("packet_per_seconds_min", Json::UInt64(packets_per_second_min)).asUInt64();
+		packets_per_second_max = root.get("packet_per_seconds_max", Json::UInt64(packets_per_second_max)).asUInt64();
+		destination_address = root.get("destination_address", destination_address).asString();
+		destination_port = static_cast<uint16_t>(root.get("destination_port", destination_port).asUInt());
+		protocol = root.get("protocol", protocol).asString();
+
+		// Swapped bounds are read as the range they describe
+		if (bytes_per_second_min > bytes_per_second_max)
+			std::swap(bytes_per_second_min, bytes_per_second_max);
+		if (packets_per_second_min > packets_per_second_max)
+			std::swap(packets_per_second_min, packets_per_second_max);
+
+		return true;
+	}
+
+	// Rates drawn uniformly within the bounds
+	template <typename Generator>
+	std::pair<uint64_t, uint64_t> draw_rates(Generator& generator) const
+	{
+		std::uniform_int_distribution<uint64_t> packets(packets_per_second_min, packets_per_second_max);
+		std::uniform_int_distribution<uint64_t> bytes(bytes_per_second_min, bytes_per_second_max);
+		return { packets(generator), bytes(generator) };
+	}
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define UDP_OFFLOAD_SUPPORTED
+#endif
+
+// Ancillary data area of one datagram slot, large enough for the segment size
+// and the other control messages a receive can carry
+struct alignas(cmsghdr) udp_control_buffer
+{
+	uint8_t data[256];
+};
+
+// UDP segmentation offload: with UDP_GRO the kernel hands several datagrams of
+// one flow over in a single receive, with UDP_SEGMENT a single send carries a
+// buffer the kernel cuts back into datagrams of the given size. Every segment
+// has that size except the last one, which may be shorter, so echoing a received
+// buffer with its GRO segment size restores the original datagram boundaries.
+namespace udp_offload
+{
+	// Largest buffer handed over by one GRO receive
+	static constexpr size_t max_buffer_size = 65535;
+
+	// Largest UDP payload over IPv4, the bound of one GSO send
+	static constexpr size_t max_send_size = 65507;
+
+	// Segments per GSO send, UDP_MAX_SEGMENTS in the kernel
+	static constexpr size_t max_segments = 64;
+
+	inline bool enable_receive(const int fd)
+	{
+#if defined(UDP_OFFLOAD_SUPPORTED)
+		const int enable = 1;
+		return setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+#else
+		(void)fd;
+		return false;
+#endif
+	}
+
+	// Segment size of a coalesced receive, 0 when the buffer holds one datagram
+	inline size_t get_segment_size(const msghdr& header)
+	{
+#if defined(UDP_OFFLOAD_SUPPORTED)
+		for (auto* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(const_cast<msghdr*>(&header), control))
+		{
+			if (control->cmsg_level != SOL_UDP || control->cmsg_type != UDP_GRO)
+				continue;
+
+			int segment_size = 0;
+			std::memcpy(&segment_size, CMSG_DATA(control), sizeof(segment_size));
+			return segment_size > 0 ? static_cast<size_t>(segment_size) : 0;
+		}
+#else
+		(void)header;
+#endif
+
+		return 0;
+	}
+
+	// Datagrams carried by a buffer of size bytes
+	inline size_t get_segments(const size_t size, const size_t segment_size)
+	{
+		if (segment_size == 0 || size <= segment_size)
+			return 1;
+
+		return (size + segment_size - 1) / segment_size;
+	}
+
+	// Make the send of header split its buffer into segment_size datagrams, or send
+	// it as one datagram when it is not longer than a segment
+	inline void set_segment_size(msghdr& header, udp_control_buffer& control_buffer, const size_t size, const size_t segment_size)
+	{
+#if defined(UDP_OFFLOAD_SUPPORTED)
+		if (segment_size > 0 && size > segment_size)
+		{
+			std::memset(control_buffer.data, 0, CMSG_SPACE(sizeof(uint16_t)));
+
+			header.msg_control = control_buffer.data;
+			header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+			auto* control = CMSG_FIRSTHDR(&header);
+			control->cmsg_level = SOL_UDP;
+			control->cmsg_type = UDP_SEGMENT;
+			control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+			const auto value = static_cast<uint16_t>(segment_size);
+			std::memcpy(CMSG_DATA(control), &value, sizeof(value));
+			return;
+		}
+#else
+		(void)control_buffer;
+		(void)size;
+		(void)segment_size;
+#endif
+
+		header.msg_control = nullptr;
+		header.msg_controllen = 0;
+	}
+}
+#endif
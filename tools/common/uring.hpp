@@ -0,0 +1,400 @@
+#pragma once
+
+// Multishot receive and provided buffer rings need the Linux 6.0 uapi headers
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define URING_ENGINE_SUPPORTED
+#endif
+#endif
+#endif
+
+#if defined(URING_ENGINE_SUPPORTED)
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <system_error>
+
+// Submission and completion queues of one io_uring instance, driven through the
+// raw system calls so the engine does not depend on liburing. An instance belongs
+// to the thread that created it: the ring is set up single issuer and the
+// deferred completion work only runs while that thread waits for completions.
+class uring
+{
+public:
+	explicit uring(const unsigned entries)
+	{
+		io_uring_params params{};
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+
+#if defined(IORING_SETUP_DEFER_TASKRUN)
+		params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+
+		m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+
+		// Kernels before 6.1 reject the single issuer flags
+		if (m_fd < 0 && errno == EINVAL)
+		{
+			params = {};
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = entries * 4;
+
+			m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		}
+
+		if (m_fd < 0)
+			throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+
+		map_rings(params);
+	}
+
+	uring(const uring&) = delete;
+	uring& operator=(const uring&) = delete;
+
+	~uring()
+	{
+		if (m_sqes)
+			munmap(m_sqes, m_sqes_size);
+
+		if (m_cq_ring && m_cq_ring != m_sq_ring)
+			munmap(m_cq_ring, m_cq_ring_size);
+
+		if (m_sq_ring)
+			munmap(m_sq_ring, m_sq_ring_size);
+
+		close(m_fd);
+	}
+
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	void accept_multishot(const int listen_fd, const uint64_t user_data)
+	{
+		auto* sqe = get_sqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = listen_fd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data = user_data;
+	}
+
+	// Every completion carries a buffer the kernel picked from buffer_group
+	void receive_multishot(const int fd, const uint16_t buffer_group, const uint64_t user_data)
+	{
+		auto* sqe = get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = buffer_group;
+		sqe->user_data = user_data;
+	}
+
+	void send(const int fd, const void* data, const size_t size, const uint64_t user_data)
+	{
+		auto* sqe = get_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64_t>(data);
+		sqe->len = static_cast<uint32_t>(size);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = user_data;
+	}
+
+	// Cancel the operation submitted with target_user_data
+	void cancel(const uint64_t target_user_data, const uint64_t user_data)
+	{
+		auto* sqe = get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = target_user_data;
+		sqe->user_data = user_data;
+	}
+
+	// Submit the queued entries and wait for at least wait_completions completions.
+	// While entries are held back it only waits once they are all in the ring.
+	void submit_and_wait(const unsigned wait_completions)
+	{
+		while (true)
+		{
+			move_held_back();
+			__atomic_store_n(m_sq_tail, m_local_sq_tail, __ATOMIC_RELEASE);
+
+			const auto head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+			const auto to_submit = m_local_sq_tail - head;
+			const auto wait = m_held_back.empty() ? wait_completions : 0u;
+			const auto flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0u;
+
+			if (syscall(__NR_io_uring_enter, m_fd, to_submit, wait, flags, nullptr, 0) < 0)
+			{
+				// Interrupted, or the completion queue is full and has to be reaped first
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+					return;
+
+				throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+			}
+
+			// Done, or the kernel took nothing and the completions have to be reaped
+			if (m_held_back.empty() || __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == head)
+				return;
+		}
+	}
+
+	// Hand every available completion to the handler, returns how many there were
+	template <typename Handler>
+	unsigned for_each_completion(Handler&& handler)
+	{
+		auto head = *m_cq_head;
+		const auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+		unsigned completions = 0;
+		for (; head != tail; ++head, ++completions)
+			handler(m_cqes[head & m_cq_mask]);
+
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+		return completions;
+	}
+
+private:
+	io_uring_sqe* get_sqe()
+	{
+		// The kernel consumes the submitted entries before io_uring_enter returns,
+		// unless it is busy or interrupted
+		if (m_held_back.empty() && is_full())
+			submit_and_wait(0);
+
+		// A slot the kernel has not consumed must not be overwritten: hold the entry
+		// back, behind the ones already waiting so the operations keep their order
+		if (!m_held_back.empty() || is_full())
+		{
+			m_held_back.emplace_back();
+			return &m_held_back.back();
+		}
+
+		auto* sqe = &m_sqes[m_local_sq_tail & m_sq_mask];
+		std::memset(sqe, 0, sizeof(*sqe));
+
+		++m_local_sq_tail;
+		return sqe;
+	}
+
+	bool is_full() const
+	{
+		return m_local_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries;
+	}
+
+	// Copy the held back entries into the free slots, oldest first
+	void move_held_back()
+	{
+		while (!m_held_back.empty() && !is_full())
+		{
+			m_sqes[m_local_sq_tail & m_sq_mask] = m_held_back.front();
+			m_held_back.pop_front();
+
+			++m_local_sq_tail;
+		}
+	}
+
+	void map_rings(const io_uring_params& params)
+	{
+		m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+			m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+		m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+		m_cq_ring = single_mmap ? m_sq_ring : map(m_cq_ring_size, IORING_OFF_CQ_RING);
+
+		m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+
+		const auto sq_ring = static_cast<uint8_t*>(m_sq_ring);
+		m_sq_head = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.head);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.tail);
+		m_sq_mask = *reinterpret_cast<unsigned*>(sq_ring + params.sq_off.ring_mask);
+		m_sq_entries = params.sq_entries;
+		m_local_sq_tail = *m_sq_tail;
+
+		// Submission entries are always consumed in order, the index array never changes
+		const auto sq_array = reinterpret_cast<unsigned*>(sq_ring + params.sq_off.array);
+		for (unsigned index = 0; index < m_sq_entries; ++index)
+			sq_array[index] = index;
+
+		const auto cq_ring = static_cast<uint8_t*>(m_cq_ring);
+		m_cq_head = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq_ring + params.cq_off.tail);
+		m_cq_mask = *reinterpret_cast<unsigned*>(cq_ring + params.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+	}
+
+	void* map(const size_t size, const off_t offset)
+	{
+		const auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+		if (address == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+
+		return address;
+	}
+
+	int m_fd{ -1 };
+
+	void* m_sq_ring{ nullptr };
+	void* m_cq_ring{ nullptr };
+	size_t m_sq_ring_size{ 0 };
+	size_t m_cq_ring_size{ 0 };
+
+	io_uring_sqe* m_sqes{ nullptr };
+	size_t m_sqes_size{ 0 };
+
+	unsigned* m_sq_head{ nullptr };
+	unsigned* m_sq_tail{ nullptr };
+	unsigned m_sq_mask{ 0 };
+	unsigned m_sq_entries{ 0 };
+	unsigned m_local_sq_tail{ 0 };
+
+	// Entries prepared while the submission queue was full
+	std::deque<io_uring_sqe> m_held_back;
+
+	unsigned* m_cq_head{ nullptr };
+	unsigned* m_cq_tail{ nullptr };
+	unsigned m_cq_mask{ 0 };
+	io_uring_cqe* m_cqes{ nullptr };
+};
+
+// Kernel provided buffer ring: receives submitted with its group id take a free
+// buffer only when data arrives, so idle connections hold no memory. Buffers go
+// back to the kernel with recycle() once their data has been consumed.
+class uring_buffer_ring
+{
+public:
+	// entries is rounded up to a power of two, at most 32768
+	uring_buffer_ring(const uring& ring, const uint16_t group, const size_t entries, const size_t buffer_size)
+		: m_group(group)
+		, m_buffer_size(buffer_size)
+	{
+		m_entries = 1;
+		while (m_entries < std::min<size_t>(entries, 32768))
+			m_entries <<= 1;
+
+		m_ring_size = m_entries * sizeof(io_uring_buf);
+		m_buffers_size = m_entries * m_buffer_size;
+
+		m_ring = static_cast<io_uring_buf_ring*>(map(m_ring_size));
+		m_buffers = static_cast<uint8_t*>(map(m_buffers_size));
+
+		io_uring_buf_reg registration{};
+		registration.ring_addr = reinterpret_cast<uint64_t>(m_ring);
+		registration.ring_entries = static_cast<uint32_t>(m_entries);
+		registration.bgid = m_group;
+
+		if (syscall(__NR_io_uring_register, ring.fd(), IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+		{
+			const auto error = errno;
+			release();
+			throw std::system_error(error, std::generic_category(), "io_uring register buffer ring");
+		}
+
+		for (size_t index = 0; index < m_entries; ++index)
+			recycle(static_cast<uint16_t>(index));
+
+		publish();
+	}
+
+	uring_buffer_ring(const uring_buffer_ring&) = delete;
+	uring_buffer_ring& operator=(const uring_buffer_ring&) = delete;
+
+	~uring_buffer_ring()
+	{
+		release();
+	}
+
+	uint16_t group() const
+	{
+		return m_group;
+	}
+
+	size_t buffer_size() const
+	{
+		return m_buffer_size;
+	}
+
+	uint8_t* data(const uint16_t buffer_id) const
+	{
+		return m_buffers + static_cast<size_t>(buffer_id) * m_buffer_size;
+	}
+
+	// Queue the buffer for the kernel, it becomes visible with publish()
+	void recycle(const uint16_t buffer_id)
+	{
+		// The ring is a plain array of io_uring_buf. Its bufs member is declared through
+		// an empty struct that C++ sizes at one byte, so it cannot be indexed directly.
+		auto& entry = reinterpret_cast<io_uring_buf*>(m_ring)[(m_tail + m_pending) & (m_entries - 1)];
+		entry.addr = reinterpret_cast<uint64_t>(data(buffer_id));
+		entry.len = static_cast<uint32_t>(m_buffer_size);
+		entry.bid = buffer_id;
+
+		++m_pending;
+	}
+
+	// Returns false when no buffer was recycled since the last call
+	bool publish()
+	{
+		if (m_pending == 0)
+			return false;
+
+		m_tail = static_cast<uint16_t>(m_tail + m_pending);
+		m_pending = 0;
+
+		__atomic_store_n(&m_ring->tail, m_tail, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	static void* map(const size_t size)
+	{
+		const auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (address == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "buffer ring mmap");
+
+		return address;
+	}
+
+	void release()
+	{
+		if (m_ring)
+			munmap(m_ring, m_ring_size);
+
+		if (m_buffers)
+			munmap(m_buffers, m_buffers_size);
+
+		m_ring = nullptr;
+		m_buffers = nullptr;
+	}
+
+	uint16_t m_group;
+	size_t m_entries{ 0 };
+	size_t m_buffer_size;
+
+	io_uring_buf_ring* m_ring{ nullptr };
+	size_t m_ring_size{ 0 };
+
+	uint8_t* m_buffers{ nullptr };
+	size_t m_buffers_size{ 0 };
+
+	uint16_t m_tail{ 0 };
+	uint16_t m_pending{ 0 };
+};
+#endif
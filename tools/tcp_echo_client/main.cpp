@@ -3,6 +3,18 @@
 #include <utility>
 #include <thread>
 #include <chrono>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <random>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#endif
 
 /* PLOG INCLUDES */
 #include <plog/Log.h>
@@ -10,6 +22,19 @@
 #include <plog/Formatters/TxtFormatter.h>
 #include <plog/Appenders/ColorConsoleAppender.h>
 
+/* COMMON INCLUDES */
+#include <allocation_counter.hpp>
+#include <buffer_pool.hpp>
+#include <command_line.hpp>
+#include <handler_allocator.hpp>
+#include <io_service_pool.hpp>
+#include <latency_histogram.hpp>
+#include <open_loop.hpp>
+#include <pacer.hpp>
+#include <source_addresses.hpp>
+#include <timestamping.hpp>
+#include <traffic_config.hpp>
+
 static std::shared_ptr<asio::io_service> io_service;
 
 static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
@@ -65,8 +90,6 @@ public:
 			m_remote_address = remote_address;
 			m_remote_port = remote_port;
 
-			m_receive_buffer.resize(262144);
-
 			connect(remote_endpoint);
 		}
 		catch (const std::exception& e)
@@ -93,7 +116,7 @@ public:
 		};
 
 		PLOGD << "create and try connect new upstream - " << remote_endpoint;
-		m_upstream_socket->async_connect(remote_endpoint, bounded_function);
+		m_upstream_socket->async_connect(remote_endpoint, make_alloc_handler(bounded_function));
 	}
 
 	void handler_connect(const asio::ip::tcp::endpoint& remote_endpoint, const std::error_code& error)
@@ -110,6 +133,7 @@ public:
 			m_upstream_socket->set_option(asio::ip::tcp::no_delay(true));
 			m_upstream_socket->set_option(asio::socket_base::send_buffer_size(262144));
 			m_upstream_socket->set_option(asio::socket_base::receive_buffer_size(262144));
+			m_upstream_socket->non_blocking(true);
 		}
 		catch (const std::exception& e)
 		{
@@ -118,14 +142,134 @@ public:
 			return;
 		}
 
+		// Before the first send, so the transmit ids count the bytes of this connection
+#if defined(__linux__)
+		if (m_timestamps && !timestamping::enable(m_upstream_socket->native_handle()))
+		{
+			PLOGW << "SO_TIMESTAMPING is not supported, running without kernel timestamps";
+			m_timestamps = false;
+		}
+#else
+		m_timestamps = false;
+#endif
+
 		m_is_connecting = false;
 		m_is_connected = true;
 
 		PLOGD << "on connect - remote_endpoint " << remote_endpoint;
 
 		set_receive();
+
+		if (m_message_size > 0)
+			send_message();
+	}
+
+	// Benchmark mode: keep one message of message_size bytes in flight and
+	// measure the time until its echo is complete
+	void set_benchmark(const size_t message_size)
+	{
+		m_message_size = std::max<size_t>(1, message_size);
+	}
+
+	// Benchmark mode: split every round trip into the kernel round trip, from the
+	// transmit timestamp of the message to the receive timestamp of its echo, and
+	// the rest of the round trip spent in user space
+	void set_timestamps(const bool timestamps)
+	{
+		m_timestamps = timestamps;
+	}
+
+	void send_message()
+	{
+		if (m_is_sending)
+		{
+			// The echo arrived before the previous send completed
+			m_is_message_pending = true;
+			return;
+		}
+
+		auto buffer = buffer_pool::acquire(m_message_size);
+		std::fill_n(buffer.data(), m_message_size, static_cast<uint8_t>('x'));
+
+		m_message_time = std::chrono::steady_clock::now();
+
+		if (m_timestamps)
+		{
+			m_message_send_time = timestamping::now_ns();
+			m_message_transmit_time = 0;
+			m_message_last_byte = m_sent_offset + static_cast<uint32_t>(m_message_size) - 1;
+		}
+
+		send_packet(std::move(buffer), m_message_size);
+	}
+
+	void handler_message(const size_t bytes_transferred)
+	{
+		m_received_bytes += bytes_transferred;
+
+		while (m_received_bytes >= m_message_size)
+		{
+			m_received_bytes -= m_message_size;
+
+			const auto latency = std::chrono::steady_clock::now() - m_message_time;
+			m_latencies.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count()));
+			m_messages.fetch_add(1, std::memory_order_relaxed);
+
+			if (m_timestamps)
+				handler_message_timestamps();
+
+			send_message();
+		}
+	}
+
+	void handler_message_timestamps()
+	{
+#if defined(__linux__)
+		const auto now = timestamping::now_ns();
+
+		read_transmit_times();
+
+		if (m_receive_time == 0 || m_message_transmit_time == 0 || m_receive_time < m_message_transmit_time || now < m_message_send_time)
+			return;
+
+		const auto kernel_round_trip = m_receive_time - m_message_transmit_time;
+		const auto round_trip = now - m_message_send_time;
+
+		m_kernel_latencies.record(kernel_round_trip);
+		m_user_latencies.record(round_trip > kernel_round_trip ? round_trip - kernel_round_trip : 0);
+#endif
+	}
+
+	// A transmit timestamp waiting on the error queue keeps the socket readable,
+	// so every wake takes them all before the wait is armed again
+	void read_transmit_times()
+	{
+#if defined(__linux__)
+		uint32_t id = 0;
+		uint64_t transmit_time = 0;
+		while (timestamping::read_transmit_time(m_upstream_socket->native_handle(), id, transmit_time))
+		{
+			// The send carrying the last byte of the message
+			if (m_message_transmit_time == 0 && static_cast<int32_t>(id - m_message_last_byte) >= 0)
+				m_message_transmit_time = transmit_time;
+		}
+#endif
+	}
+
+	// Must be called on the io_service thread: add the round trips since the last
+	// call to the given histograms and start over
+	void take_latencies(latency_histogram& latencies, latency_histogram& kernel_latencies, latency_histogram& user_latencies)
+	{
+		latencies.merge(m_latencies);
+		kernel_latencies.merge(m_kernel_latencies);
+		user_latencies.merge(m_user_latencies);
+
+		m_latencies.reset();
+		m_kernel_latencies.reset();
+		m_user_latencies.reset();
 	}
 
+	// Wait for readability and borrow a pool buffer only once data is ready
 	void set_receive()
 	{
 		if (m_is_terminated || m_is_receiving)
@@ -137,17 +281,18 @@ public:
 		m_is_receiving = true;
 
 		auto self(shared_from_this());
-		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
+		auto bounded_function = [self](const std::error_code& error)
 		{
-			self->handler_receive(error, bytes_transferred);
+			self->handler_receive(error);
 		};
 
-		const auto asio_buffer = asio::buffer(m_receive_buffer.data(), m_receive_buffer.size());
-		m_upstream_socket->async_receive(asio_buffer, bounded_function);
+		m_upstream_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler(bounded_function));
 	}
 
-	void handler_receive(const std::error_code& error, const size_t bytes_transferred)
+	void handler_receive(const std::error_code& error)
 	{
+		m_is_receiving = false;
+
 		if (error)
 		{
 			PLOGE << "error value: " << error.value() << " - message: " << error.message();
@@ -155,21 +300,54 @@ public:
 			return;
 		}
 
-		const auto end_time = std::chrono::high_resolution_clock::now();
-		const auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - m_start_time);
+		if (m_timestamps)
+			read_transmit_times();
 
-		PLOGD << "recv from " << m_remote_address << ":" << m_remote_port
-			<< " - bytes: " << bytes_transferred
-			<< " - latency: " << elapsed_time.count() << " ms"
-			<< " - buffer: " << std::string(reinterpret_cast<char*>(m_receive_buffer.data()), bytes_transferred);
+		// Readiness is edge triggered: read until the socket would block
+		while (!m_is_terminated)
+		{
+			std::error_code receive_error;
+			auto buffer = buffer_pool::acquire(std::max<size_t>(buffer_pool::min_buffer_size, m_upstream_socket->available(receive_error)));
 
-		send_packet(m_receive_buffer.data(), bytes_transferred);
+			const auto bytes_transferred = m_timestamps
+				? receive_timestamped(buffer.data(), buffer.size(), receive_error)
+				: m_upstream_socket->receive(asio::buffer(buffer.data(), buffer.size()), 0, receive_error);
+
+			if (receive_error == asio::error::would_block || receive_error == asio::error::try_again)
+				break;
+
+			if (receive_error)
+			{
+				PLOGE << "error value: " << receive_error.value() << " - message: " << receive_error.message();
+				terminate();
+				return;
+			}
+
+			if (m_message_size > 0)
+			{
+				handler_message(bytes_transferred);
+				continue;
+			}
+
+			const auto end_time = std::chrono::high_resolution_clock::now();
+			const auto elapsed_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - m_start_time);
+
+			m_messages.fetch_add(1, std::memory_order_relaxed);
+			m_latencies.record(static_cast<uint64_t>(elapsed_time.count()));
+
+			PLOGD << "recv from " << m_remote_address << ":" << m_remote_port
+				<< " - bytes: " << bytes_transferred
+				<< " - latency: " << elapsed_time.count() << " ns"
+				<< " - buffer: " << std::string(reinterpret_cast<char*>(buffer.data()), bytes_transferred);
+
+			send_packet(std::move(buffer), bytes_transferred);
+		}
 
-		m_is_receiving = false;
 		set_receive();
 	}
 
-	void send_packet(void* buffer, const size_t size)
+	// The buffer is kept until the send completes
+	void send_packet(pooled_buffer buffer, const size_t size)
 	{
 		if (m_is_terminated || m_is_sending)
 		{
@@ -177,14 +355,29 @@ public:
 		}
 
 		m_is_sending = true;
+		m_send_buffer = std::move(buffer);
+		m_sent_offset += static_cast<uint32_t>(size);
+
 		auto self(shared_from_this());
 		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
 		{
 			self->handler_send_packet(error, bytes_transferred);
 		};
 
-		const auto asio_buffer = asio::buffer(buffer, size);
-		m_upstream_socket->async_send(asio_buffer, bounded_function);
+		// The round trip starts with the send, its echo may be read before the send completes
+		m_start_time = std::chrono::high_resolution_clock::now();
+
+		const auto asio_buffer = asio::buffer(m_send_buffer.data(), size);
+		m_upstream_socket->async_send(asio_buffer, make_alloc_handler(bounded_function));
+	}
+
+	void send_packet(const void* buffer, const size_t size)
+	{
+		auto send_buffer = buffer_pool::acquire(size);
+		const auto send_size = std::min(size, send_buffer.size());
+
+		std::copy_n(static_cast<const uint8_t*>(buffer), send_size, send_buffer.data());
+		send_packet(std::move(send_buffer), send_size);
 	}
 
 	void handler_send_packet(const std::error_code& error, const size_t bytes_transferred)
@@ -196,10 +389,15 @@ public:
 			return;
 		}
 
-		m_start_time = std::chrono::high_resolution_clock::now();
-
 		PLOGD << "send packet to " << m_remote_address << ":" << m_remote_port << " - bytes: " << bytes_transferred;
+		m_send_buffer.release();
 		m_is_sending = false;
+
+		if (m_is_message_pending)
+		{
+			m_is_message_pending = false;
+			send_message();
+		}
 	}
 
 	void terminate()
@@ -234,7 +432,26 @@ public:
 		return m_is_connected;
 	}
 
+	uint64_t get_messages() const
+	{
+		return m_messages.load(std::memory_order_relaxed);
+	}
+
 private:
+	size_t receive_timestamped(void* data, const size_t size, std::error_code& error)
+	{
+#if defined(__linux__)
+		const auto result = timestamping::receive(m_upstream_socket->native_handle(), data, size, m_receive_time);
+		if (result > 0)
+			return static_cast<size_t>(result);
+
+		error = result == 0 ? std::error_code(asio::error::eof) : std::error_code(errno, asio::error::get_system_category());
+		return 0;
+#else
+		return m_upstream_socket->receive(asio::buffer(data, size), 0, error);
+#endif
+	}
+
 	std::atomic<bool> m_started{false};
 	std::atomic<bool> m_is_connecting{false};
 	std::atomic<bool> m_is_sending{false};
@@ -243,40 +460,1312 @@ private:
 	std::atomic<bool> m_is_connected{false};
 	std::atomic<bool> m_is_terminated{false};
 
+	std::atomic<uint64_t> m_messages{0};
+
+	size_t m_message_size{0};
+	size_t m_received_bytes{0};
+	bool m_is_message_pending{false};
+	std::chrono::steady_clock::time_point m_message_time;
+	latency_histogram m_latencies;
+
+	// Timestamp mode: stream offset of the bytes sent so far, receive timestamp of
+	// the last read and the times of the message in flight
+	bool m_timestamps{ false };
+	uint32_t m_sent_offset{ 0 };
+	uint64_t m_receive_time{ 0 };
+	uint64_t m_message_send_time{ 0 };
+	uint64_t m_message_transmit_time{ 0 };
+	uint32_t m_message_last_byte{ 0 };
+	latency_histogram m_kernel_latencies;
+	latency_histogram m_user_latencies;
+
 	std::string m_remote_address{};
 	uint16_t m_remote_port{0};
 
 	std::shared_ptr<asio::io_service> m_io_service;
 
-	std::vector<uint8_t> m_receive_buffer;
+	pooled_buffer m_send_buffer;
 	std::chrono::time_point<std::chrono::high_resolution_clock> m_start_time;
 
 	std::shared_ptr<asio::ip::tcp::socket> m_upstream_socket;
 };
 
-int main()
+// Connect / abortive close loop used to measure server accepts per second
+class tcp_churn_client
+	: public std::enable_shared_from_this<tcp_churn_client>
 {
-	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
-	init(plog::verbose, &console_appender);
+public:
+	tcp_churn_client(
+		std::shared_ptr<asio::io_service> service,
+		asio::ip::tcp::endpoint remote_endpoint,
+		std::optional<asio::ip::tcp::endpoint> local_endpoint,
+		std::atomic<uint64_t>& connects,
+		std::atomic<uint64_t>& failures)
+		: m_io_service(std::move(service))
+		, m_remote_endpoint(std::move(remote_endpoint))
+		, m_local_endpoint(std::move(local_endpoint))
+		, m_connects(connects)
+		, m_failures(failures)
+		, m_retry_timer(*m_io_service)
+	{
+	}
 
-	PLOGD << "started plog verbose";
+	void connect()
+	{
+		m_upstream_socket = std::make_shared<asio::ip::tcp::socket>(*m_io_service);
 
-	io_service = std::make_shared<asio::io_service>();
-	service_thread(io_service);
+		if (m_local_endpoint)
+		{
+			std::error_code error;
+			source_addresses::bind(*m_upstream_socket, *m_local_endpoint, error);
+			if (error)
+			{
+				handler_failure("bind " + m_local_endpoint->address().to_string() + ":" + std::to_string(m_local_endpoint->port()), error);
+				return;
+			}
+		}
 
-	const auto current_client = std::make_shared<tcp_echo_client>(io_service);
-	PLOGD << "created tcp_echo_client class";
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error)
+		{
+			self->handler_connect(error);
+		};
+
+		m_upstream_socket->async_connect(m_remote_endpoint, make_alloc_handler(bounded_function));
+	}
 
-	current_client->start("127.0.0.1", 7171);
+	void handler_connect(const std::error_code& error)
+	{
+		if (error)
+		{
+			handler_failure("connect", error);
+			return;
+		}
 
-	while (!current_client->get_is_connected())
-		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		m_connects.fetch_add(1, std::memory_order_relaxed);
+		m_retry_delay = min_retry_delay;
 
-	const auto buffer = std::string("get_remote_address");
-	current_client->send_packet((void*)buffer.data(), buffer.size());
+		// Reset instead of FIN so the client side does not pile up TIME_WAIT sockets
+		std::error_code ignored;
+		m_upstream_socket->set_option(asio::socket_base::linger(true, 0), ignored);
+		m_upstream_socket->close(ignored);
+
+		connect();
+	}
+
+private:
+	static constexpr std::chrono::milliseconds min_retry_delay{ 10 };
+	static constexpr std::chrono::milliseconds max_retry_delay{ 1000 };
+
+	// Count the failure and try again after a delay that doubles with every failure
+	// in a row, so a refusing server or an exhausted port range is not hammered.
+	// Only the first failure of a row is logged, the churn line counts the rest.
+	void handler_failure(const std::string& operation, const std::error_code& error)
+	{
+		m_failures.fetch_add(1, std::memory_order_relaxed);
+
+		if (m_retry_delay == min_retry_delay)
+		{
+			PLOGE << operation << " - code: " << error.value() << " - message: " << error.message();
+		}
+
+		std::error_code ignored;
+		m_upstream_socket->close(ignored);
+
+		auto self(shared_from_this());
+		m_retry_timer.expires_after(m_retry_delay);
+		m_retry_timer.async_wait([self](const std::error_code& timer_error)
+		{
+			if (!timer_error)
+				self->connect();
+		});
+
+		m_retry_delay = std::min(m_retry_delay * 2, max_retry_delay);
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	asio::ip::tcp::endpoint m_remote_endpoint;
+	std::optional<asio::ip::tcp::endpoint> m_local_endpoint;
+	std::atomic<uint64_t>& m_connects;
+	std::atomic<uint64_t>& m_failures;
+
+	std::shared_ptr<asio::ip::tcp::socket> m_upstream_socket;
+
+	asio::steady_timer m_retry_timer;
+	std::chrono::milliseconds m_retry_delay{ min_retry_delay };
+};
+
+static void run_churn(const asio::ip::tcp::endpoint& remote_endpoint, const size_t concurrency, const source_addresses& sources)
+{
+	std::atomic<uint64_t> connects{ 0 };
+	std::atomic<uint64_t> failures{ 0 };
 
+	for (size_t index = 0; index < concurrency; ++index)
+	{
+		std::optional<asio::ip::tcp::endpoint> local_endpoint;
+		if (!sources.empty())
+			local_endpoint = sources.get_endpoint<asio::ip::tcp::endpoint>(index);
+
+		std::make_shared<tcp_churn_client>(io_service, remote_endpoint, local_endpoint, connects, failures)->connect();
+	}
+
+	PLOGI << "started churn - concurrency: " << concurrency << " - remote_endpoint " << remote_endpoint;
+
+	uint64_t last_connects = 0;
+	uint64_t last_failures = 0;
 	while (true)
-		std::this_thread::sleep_for(std::chrono::milliseconds(UINT16_MAX));
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		const auto current_connects = connects.load(std::memory_order_relaxed);
+		const auto current_failures = failures.load(std::memory_order_relaxed);
+		PLOGI << "churn - " << current_connects - last_connects << " connects/s - total: " << current_connects
+			<< " - " << current_failures - last_failures << " failures/s - total: " << current_failures;
+
+		last_connects = current_connects;
+		last_failures = current_failures;
+	}
+}
+
+// Closed-loop echo workload used to compare builds: messages/s and latency percentiles
+static void run_benchmark(
+	const std::string& remote_address,
+	const uint16_t remote_port,
+	const size_t connections,
+	const size_t message_size,
+	const uint32_t duration_seconds,
+	const bool timestamps,
+	const std::string& histogram_file)
+{
+	std::vector<std::shared_ptr<tcp_echo_client>> clients;
+	for (size_t index = 0; index < connections; ++index)
+	{
+		const auto client = std::make_shared<tcp_echo_client>(io_service);
+		client->set_benchmark(message_size);
+		client->set_timestamps(timestamps);
+
+		asio::post(*io_service, [client, remote_address, remote_port]()
+		{
+			client->start(remote_address, remote_port);
+		});
+
+		clients.push_back(client);
+	}
+
+	PLOGI << "started benchmark - connections: " << connections
+		<< " - message size: " << message_size
+		<< " - duration: " << duration_seconds << " s";
+
+	std::this_thread::sleep_for(std::chrono::seconds(duration_seconds));
+
+	// Collect on the io thread, the clients are not touched anywhere else
+	latency_histogram latencies;
+	latency_histogram kernel_latencies;
+	latency_histogram user_latencies;
+
+	std::promise<void> result;
+	asio::post(*io_service, [&]()
+	{
+		for (const auto& client : clients)
+		{
+			client->take_latencies(latencies, kernel_latencies, user_latencies);
+			client->terminate();
+		}
+
+		result.set_value();
+	});
+
+	result.get_future().get();
+	io_service->stop();
+
+	PLOGI << "benchmark - messages: " << latencies.get_count()
+		<< " - throughput: " << latencies.get_count() / std::max<uint32_t>(1, duration_seconds) << " msg/s"
+		<< " - " << latencies.get_summary();
+
+	if (!histogram_file.empty() && !latencies.save(histogram_file))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
+
+	if (!timestamps)
+		return;
+
+	PLOGI << "timestamps - round trips: " << kernel_latencies.get_count()
+		<< " - kernel p50: " << kernel_latencies.get_percentile(50) << " ns"
+		<< " - p99: " << kernel_latencies.get_percentile(99) << " ns"
+		<< " - user space p50: " << user_latencies.get_percentile(50) << " ns"
+		<< " - p99: " << user_latencies.get_percentile(99) << " ns";
+}
+
+// Counters of one io thread of the load mode. Only the connections of that thread
+// write them, the reporting thread reads and sums them, so the hot path takes no
+// lock and shares no cache line with the other threads.
+struct alignas(64) load_thread_stats
+{
+	std::atomic<uint64_t> connects{ 0 };
+	std::atomic<uint64_t> connect_failures{ 0 };
+	std::atomic<uint64_t> disconnects{ 0 };
+	std::atomic<uint64_t> messages{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+
+	// Round trips since the last report, only touched on the io thread: the report
+	// merges and resets it there
+	latency_histogram latencies;
+};
+
+// One connection of the load mode, a closed loop with one message in flight:
+// connecting -> sending -> receiving -> sending ... until an error closes it.
+// It keeps no history, so a hundred thousand of them fit in one process.
+class tcp_load_connection
+	: public std::enable_shared_from_this<tcp_load_connection>
+{
+public:
+	enum class state
+	{
+		connecting,
+		sending,
+		receiving,
+		closed
+	};
+
+	tcp_load_connection(
+		std::shared_ptr<asio::io_service> service,
+		load_thread_stats& stats,
+		const size_t message_size)
+		: m_io_service(std::move(service))
+		, m_socket(*m_io_service)
+		, m_stats(stats)
+		, m_buffer(std::max<size_t>(1, message_size), 'x')
+	{
+	}
+
+	void start(const asio::ip::tcp::endpoint& remote_endpoint, const std::optional<asio::ip::tcp::endpoint>& local_endpoint)
+	{
+		m_state = state::connecting;
+
+		if (local_endpoint)
+		{
+			std::error_code error;
+			source_addresses::bind(m_socket, *local_endpoint, error);
+			if (error)
+			{
+				m_stats.connect_failures.fetch_add(1, std::memory_order_relaxed);
+				close();
+				return;
+			}
+		}
+
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error)
+		{
+			self->handler_connect(error);
+		};
+
+		m_socket.async_connect(remote_endpoint, make_alloc_handler(bounded_function));
+	}
+
+private:
+	void handler_connect(const std::error_code& error)
+	{
+		if (error)
+		{
+			m_stats.connect_failures.fetch_add(1, std::memory_order_relaxed);
+			close();
+			return;
+		}
+
+		m_stats.connects.fetch_add(1, std::memory_order_relaxed);
+
+		std::error_code ignored;
+		m_socket.set_option(asio::ip::tcp::no_delay(true), ignored);
+
+		send();
+	}
+
+	void send()
+	{
+		m_state = state::sending;
+		m_send_time = std::chrono::steady_clock::now();
+
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error, const size_t)
+		{
+			self->handler_send(error);
+		};
+
+		asio::async_write(m_socket, asio::buffer(m_buffer), make_alloc_handler(bounded_function));
+	}
+
+	void handler_send(const std::error_code& error)
+	{
+		if (error)
+		{
+			close();
+			return;
+		}
+
+		m_state = state::receiving;
+
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error, const size_t)
+		{
+			self->handler_receive(error);
+		};
+
+		asio::async_read(m_socket, asio::buffer(m_buffer), make_alloc_handler(bounded_function));
+	}
+
+	void handler_receive(const std::error_code& error)
+	{
+		if (error)
+		{
+			close();
+			return;
+		}
+
+		const auto latency = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - m_send_time).count());
+
+		m_stats.messages.fetch_add(1, std::memory_order_relaxed);
+		m_stats.bytes.fetch_add(m_buffer.size(), std::memory_order_relaxed);
+		m_stats.latencies.record(latency);
+
+		send();
+	}
+
+	void close()
+	{
+		// A connection that got through counts as a disconnect when it ends
+		if (m_state != state::connecting)
+			m_stats.disconnects.fetch_add(1, std::memory_order_relaxed);
+
+		m_state = state::closed;
+
+		std::error_code ignored;
+		m_socket.close(ignored);
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	asio::ip::tcp::socket m_socket;
+	load_thread_stats& m_stats;
+
+	state m_state{ state::closed };
+	std::vector<char> m_buffer;
+	std::chrono::steady_clock::time_point m_send_time;
+};
+
+// Raise the open file limit to the hard limit, every connection holds a descriptor
+static uint64_t raise_file_limit()
+{
+#if defined(__linux__)
+	rlimit limit{};
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+		return 0;
+
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	return static_cast<uint64_t>(limit.rlim_cur);
+#else
+	return 0;
+#endif
+}
+
+// N closed-loop connections spread round-robin over M io threads of one process.
+// A launcher thread opens them at connect_rate per second with the pacer of the
+// paced mode, so the server sees a ramp and not a SYN flood; every second the
+// per-thread counters are summed and the per-thread histograms merged into one
+// report.
+static void run_load(
+	const asio::ip::tcp::endpoint& remote_endpoint,
+	const size_t connections,
+	const size_t threads,
+	const uint64_t connect_rate,
+	const size_t message_size,
+	const uint32_t duration_seconds,
+	const source_addresses& sources,
+	const std::string& histogram_file)
+{
+	const auto file_limit = raise_file_limit();
+	if (file_limit != 0 && file_limit < connections + 64)
+	{
+		PLOGW << "open file limit " << file_limit << " is below " << connections << " connections";
+	}
+
+	// Explicit ports are handed out round-robin, beyond that they would collide
+	if (sources.get_endpoints() != 0 && sources.get_endpoints() < connections)
+	{
+		PLOGW << "only " << sources.get_endpoints() << " source endpoints for " << connections << " connections";
+	}
+
+	io_service_pool pool(threads);
+	pool.start();
+
+	std::vector<load_thread_stats> stats(pool.size());
+
+	std::atomic<size_t> launched{ 0 };
+	token_bucket_pacer pacer;
+	pacer.set_rates(connect_rate, 0);
+
+	std::thread launcher([&]()
+	{
+		token_bucket_pacer::set_precise_timers();
+
+		while (launched.load(std::memory_order_relaxed) < connections)
+		{
+			const auto ready = std::min(pacer.wait(1), connections - launched.load(std::memory_order_relaxed));
+			if (ready == 0)
+				return;
+
+			for (size_t count = 0; count < ready; ++count)
+			{
+				const auto number = launched.fetch_add(1, std::memory_order_relaxed);
+				const auto index = number % pool.size();
+				const auto service = pool.get_io_service(index);
+				const auto connection = std::make_shared<tcp_load_connection>(service, stats[index], message_size);
+
+				std::optional<asio::ip::tcp::endpoint> local_endpoint;
+				if (!sources.empty())
+					local_endpoint = sources.get_endpoint<asio::ip::tcp::endpoint>(number);
+
+				// The connection is created and lives on its io thread
+				asio::post(*service, [connection, remote_endpoint, local_endpoint]()
+				{
+					connection->start(remote_endpoint, local_endpoint);
+				});
+			}
+
+			pacer.consume(ready, 0);
+		}
+	});
+
+	PLOGI << "started load - connections: " << connections
+		<< " - threads: " << pool.size()
+		<< " - connect rate: " << connect_rate << "/s"
+		<< " - message size: " << message_size
+		<< " - source addresses: " << sources.size();
+
+	// Each thread merges its histogram into interval on its own thread
+	latency_histogram interval;
+	latency_histogram total;
+	std::mutex interval_mutex;
+
+	const auto take_latencies = [&]()
+	{
+		std::vector<std::promise<void>> results(pool.size());
+		for (size_t index = 0; index < pool.size(); ++index)
+		{
+			asio::post(*pool.get_io_service(index), [&, index]()
+			{
+				{
+					std::lock_guard<std::mutex> lock(interval_mutex);
+					interval.merge(stats[index].latencies);
+				}
+
+				stats[index].latencies.reset();
+				results[index].set_value();
+			});
+		}
+
+		for (auto& result : results)
+			result.get_future().get();
+	};
+
+	uint64_t last_connects = 0;
+	uint64_t last_messages = 0;
+
+	for (uint32_t second = 1; duration_seconds == 0 || second <= duration_seconds; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		uint64_t connects = 0;
+		uint64_t connect_failures = 0;
+		uint64_t disconnects = 0;
+		uint64_t messages = 0;
+
+		for (auto& thread_stats : stats)
+		{
+			connects += thread_stats.connects.load(std::memory_order_relaxed);
+			connect_failures += thread_stats.connect_failures.load(std::memory_order_relaxed);
+			disconnects += thread_stats.disconnects.load(std::memory_order_relaxed);
+			messages += thread_stats.messages.load(std::memory_order_relaxed);
+		}
+
+		interval.reset();
+		take_latencies();
+		total.merge(interval);
+
+		PLOGI << "load - launched: " << launched.load(std::memory_order_relaxed)
+			<< " - established: " << connects - disconnects
+			<< " - connects: " << connects - last_connects << "/s"
+			<< " - connect failures: " << connect_failures
+			<< " - disconnects: " << disconnects
+			<< " - " << messages - last_messages << " msg/s"
+			<< " - latency " << interval.get_summary();
+
+		last_connects = connects;
+		last_messages = messages;
+	}
+
+	pacer.stop();
+	launcher.join();
+
+	interval.reset();
+	take_latencies();
+	total.merge(interval);
+	pool.stop();
+
+	PLOGI << "load - round trips: " << total.get_count() << " - latency " << total.get_summary();
+
+	if (!histogram_file.empty() && !total.save(histogram_file))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
+}
+
+// Rate controlled generator driven by configs.ini: a thread of its own writes
+// messages to one connection as the token bucket pacer lets them out, and the
+// echoed bytes are counted on the io_service. The message size follows the two
+// rates, bytes per second over messages per second, with the fraction carried
+// over to the next messages so both rates hold. A full send buffer holds the
+// sender back, so a server that cannot keep up shows as a rate below the target.
+// Write the whole range from a thread of its own, waiting for room in the send
+// buffer; false once the connection failed. The io_service thread keeps a receive
+// outstanding on the socket and asio allows no concurrent use of a socket object,
+// so on Linux only its descriptor is used here.
+static bool send_stream(asio::ip::tcp::socket& socket, const char* data, size_t size)
+{
+#if defined(__linux__)
+	const auto fd = socket.native_handle();
+	while (size > 0)
+	{
+		const auto sent = ::send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pollfd descriptor{ fd, POLLOUT, 0 };
+				poll(&descriptor, 1, -1);
+				continue;
+			}
+
+			PLOGE << "send error: " << std::strerror(errno);
+			return false;
+		}
+
+		data += sent;
+		size -= static_cast<size_t>(sent);
+	}
+#else
+	while (size > 0)
+	{
+		std::error_code error;
+		const auto sent = socket.send(asio::buffer(data, size), 0, error);
+
+		if (error == asio::error::would_block || error == asio::error::try_again)
+		{
+			socket.wait(asio::socket_base::wait_write, error);
+			continue;
+		}
+
+		if (error)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			return false;
+		}
+
+		data += sent;
+		size -= sent;
+	}
+#endif
+
+	return true;
+}
+
+class tcp_paced_generator
+	: public std::enable_shared_from_this<tcp_paced_generator>
+{
+public:
+	// Messages coalesced into one send
+	static constexpr size_t send_batch = 64;
+
+	// Largest message
+	static constexpr size_t max_message_size = 65536;
+
+	explicit tcp_paced_generator(std::shared_ptr<asio::io_service> service)
+		: m_io_service(std::move(service))
+		, m_send_buffer(send_batch * max_message_size, 'x')
+		, m_receive_buffer(65536)
+	{
+	}
+
+	bool start(const asio::ip::tcp::endpoint& remote_endpoint)
+	{
+		m_socket = std::make_shared<asio::ip::tcp::socket>(*m_io_service);
+
+		std::error_code error;
+		m_socket->connect(remote_endpoint, error);
+		if (error)
+		{
+			PLOGE << "cannot connect to " << remote_endpoint << " - message: " << error.message();
+			return false;
+		}
+
+		m_socket->set_option(asio::ip::tcp::no_delay(true), error);
+		m_socket->non_blocking(true);
+
+		const auto self(shared_from_this());
+		asio::post(*m_io_service, [self]()
+		{
+			self->set_receive();
+		});
+
+		std::thread([self]()
+		{
+			self->send_loop();
+		}).detach();
+
+		return true;
+	}
+
+	void set_rates(const uint64_t messages_per_second, const uint64_t bytes_per_second)
+	{
+		m_pacer.set_rates(messages_per_second, bytes_per_second);
+		m_message_size.store(get_message_size(messages_per_second, bytes_per_second), std::memory_order_relaxed);
+	}
+
+	uint64_t get_messages_sent() const
+	{
+		return m_messages_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_bytes_sent() const
+	{
+		return m_bytes_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_bytes_received() const
+	{
+		return m_bytes_received.load(std::memory_order_relaxed);
+	}
+
+	// Average message size in bytes
+	static double get_message_size(const uint64_t messages_per_second, const uint64_t bytes_per_second)
+	{
+		if (messages_per_second == 0 || bytes_per_second == 0)
+			return 64;
+
+		return std::min(std::max(1.0, static_cast<double>(bytes_per_second) / static_cast<double>(messages_per_second)),
+			static_cast<double>(max_message_size));
+	}
+
+private:
+	void send_loop()
+	{
+		token_bucket_pacer::set_precise_timers();
+
+		double carry = 0;
+
+		while (true)
+		{
+			const auto message_size = m_message_size.load(std::memory_order_relaxed);
+			const auto ready = m_pacer.wait(static_cast<size_t>(message_size + carry));
+			if (ready == 0)
+				return;
+
+			for (size_t first = 0; first < ready; first += send_batch)
+			{
+				const auto count = std::min(send_batch, ready - first);
+
+				uint64_t bytes = 0;
+				for (size_t index = 0; index < count; ++index)
+				{
+					const auto size = static_cast<size_t>(message_size + carry);
+					carry += message_size - static_cast<double>(size);
+					bytes += size;
+				}
+
+				if (!send_stream(*m_socket, m_send_buffer.data(), static_cast<size_t>(bytes)))
+					return;
+
+				m_pacer.consume(count, bytes);
+				m_messages_sent.fetch_add(count, std::memory_order_relaxed);
+				m_bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void set_receive()
+	{
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
+		{
+			self->handler_receive(error, bytes_transferred);
+		};
+
+		m_socket->async_receive(asio::buffer(m_receive_buffer), make_alloc_handler(bounded_function));
+	}
+
+	void handler_receive(const std::error_code& error, const size_t bytes_transferred)
+	{
+		if (error)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			m_pacer.stop();
+			return;
+		}
+
+		m_bytes_received.fetch_add(bytes_transferred, std::memory_order_relaxed);
+		set_receive();
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	std::shared_ptr<asio::ip::tcp::socket> m_socket;
+
+	token_bucket_pacer m_pacer;
+	std::atomic<double> m_message_size{ 64 };
+
+	std::vector<char> m_send_buffer;
+	std::vector<char> m_receive_buffer;
+
+	std::atomic<uint64_t> m_messages_sent{ 0 };
+	std::atomic<uint64_t> m_bytes_sent{ 0 };
+	std::atomic<uint64_t> m_bytes_received{ 0 };
+};
+
+// Draw new rates within the bounds of the configuration every rate_period
+// seconds and report every second how close the generator keeps to them
+static void run_paced(const traffic_config& config, const asio::ip::tcp::endpoint& remote_endpoint, const uint64_t rate_period_seconds)
+{
+	std::mt19937_64 random(std::random_device{}());
+
+	const auto generator = std::make_shared<tcp_paced_generator>(io_service);
+
+	auto rates = config.draw_rates(random);
+	generator->set_rates(rates.first, rates.second);
+	if (!generator->start(remote_endpoint))
+		return;
+
+	PLOGI << "paced - " << remote_endpoint << " - target: " << rates.first << " msg/s, " << rates.second << " bytes/s"
+		<< " - message size: " << tcp_paced_generator::get_message_size(rates.first, rates.second);
+
+	uint64_t last_messages = 0;
+	uint64_t last_bytes = 0;
+	uint64_t last_received = 0;
+
+	for (uint64_t second = 1;; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		const auto messages = generator->get_messages_sent() - last_messages;
+		const auto bytes = generator->get_bytes_sent() - last_bytes;
+		const auto received = generator->get_bytes_received() - last_received;
+
+		const auto error = [](const uint64_t value, const uint64_t target)
+		{
+			return target == 0 ? 0.0 : 100.0 * (static_cast<double>(value) - static_cast<double>(target)) / static_cast<double>(target);
+		};
+
+		PLOGI << "paced - sent: " << messages << " msg/s (" << error(messages, rates.first) << " %)"
+			<< " - " << bytes << " bytes/s (" << error(bytes, rates.second) << " %)"
+			<< " - echoed: " << received << " bytes/s";
+
+		last_messages += messages;
+		last_bytes += bytes;
+		last_received += received;
+
+		if (rate_period_seconds > 0 && second % rate_period_seconds == 0)
+		{
+			rates = config.draw_rates(random);
+			generator->set_rates(rates.first, rates.second);
+
+			PLOGI << "paced - target: " << rates.first << " msg/s, " << rates.second << " bytes/s"
+				<< " - message size: " << tcp_paced_generator::get_message_size(rates.first, rates.second);
+		}
+	}
+}
+
+// Open-loop generator: a thread of its own writes messages on the arrival
+// schedule whether or not the echoes keep up, each stamped with its intended and
+// actual send time, and the echoes are timed against both on the io_service. A
+// full send buffer holds the thread back; the messages that fall due meanwhile
+// go out as soon as it clears, still carrying their intended times.
+class tcp_open_loop_generator
+	: public std::enable_shared_from_this<tcp_open_loop_generator>
+{
+public:
+	// Messages coalesced into one send
+	static constexpr size_t send_batch = 64;
+
+	// Largest message
+	static constexpr size_t max_message_size = 65536;
+
+	tcp_open_loop_generator(
+		std::shared_ptr<asio::io_service> service,
+		const arrival_schedule::arrivals arrivals,
+		const double rate,
+		const size_t message_size,
+		const uint64_t seed)
+		: m_io_service(std::move(service))
+		, m_schedule(arrivals, rate, seed)
+		, m_message_size(std::min(std::max(schedule_stamp::size, message_size), max_message_size))
+		, m_send_buffer(send_batch * m_message_size, 'x')
+		, m_receive_buffer(std::max<size_t>(65536, 2 * m_message_size))
+	{
+	}
+
+	bool start(const asio::ip::tcp::endpoint& remote_endpoint)
+	{
+		m_socket = std::make_shared<asio::ip::tcp::socket>(*m_io_service);
+
+		std::error_code error;
+		m_socket->connect(remote_endpoint, error);
+		if (error)
+		{
+			PLOGE << "cannot connect to " << remote_endpoint << " - message: " << error.message();
+			return false;
+		}
+
+		m_socket->set_option(asio::ip::tcp::no_delay(true), error);
+		m_socket->non_blocking(true);
+
+		const auto self(shared_from_this());
+		asio::post(*m_io_service, [self]()
+		{
+			self->set_receive();
+		});
+
+		std::thread([self]()
+		{
+			self->send_loop();
+		}).detach();
+
+		return true;
+	}
+
+	void stop()
+	{
+		m_schedule.stop();
+	}
+
+	size_t get_message_size() const
+	{
+		return m_message_size;
+	}
+
+	uint64_t get_messages_sent() const
+	{
+		return m_messages_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_messages_received() const
+	{
+		return m_messages_received.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_invalid() const
+	{
+		return m_invalid.load(std::memory_order_relaxed);
+	}
+
+	// Furthest a message went out behind its intended time since the last call
+	uint64_t take_max_send_lag_ns()
+	{
+		return m_max_send_lag_ns.exchange(0, std::memory_order_relaxed);
+	}
+
+	// On the io_service thread: add the latencies of the echoes since the last call
+	void take_latencies(latency_histogram& raw, latency_histogram& corrected)
+	{
+		raw.merge(m_raw_latencies);
+		corrected.merge(m_corrected_latencies);
+		m_raw_latencies.reset();
+		m_corrected_latencies.reset();
+	}
+
+private:
+	void send_loop()
+	{
+		token_bucket_pacer::set_precise_timers();
+
+		auto* const data = reinterpret_cast<uint8_t*>(m_send_buffer.data());
+		uint64_t sequence = 0;
+
+		m_schedule.start(arrival_schedule::now_ns());
+		while (m_schedule.wait())
+		{
+			const auto now = arrival_schedule::now_ns();
+
+			size_t count = 0;
+			while (count < send_batch && m_schedule.get_next() <= now)
+			{
+				const schedule_stamp stamp{ sequence++, m_schedule.get_next(), now };
+				stamp.write(data + count * m_message_size);
+
+				// Only this thread raises the maximum, a load and a store do
+				if (now - stamp.intended_ns > m_max_send_lag_ns.load(std::memory_order_relaxed))
+					m_max_send_lag_ns.store(now - stamp.intended_ns, std::memory_order_relaxed);
+
+				m_schedule.advance();
+				++count;
+			}
+
+			if (!send_stream(*m_socket, m_send_buffer.data(), count * m_message_size))
+				return;
+
+			m_messages_sent.fetch_add(count, std::memory_order_relaxed);
+		}
+	}
+
+	void set_receive()
+	{
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
+		{
+			self->handler_receive(error, bytes_transferred);
+		};
+
+		m_socket->async_receive(asio::buffer(m_receive_buffer.data() + m_received, m_receive_buffer.size() - m_received),
+			make_alloc_handler(bounded_function));
+	}
+
+	void handler_receive(const std::error_code& error, const size_t bytes_transferred)
+	{
+		if (error)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			m_schedule.stop();
+			return;
+		}
+
+		const auto now = arrival_schedule::now_ns();
+		const auto* const data = reinterpret_cast<const uint8_t*>(m_receive_buffer.data());
+
+		m_received += bytes_transferred;
+
+		// Whole messages only, a partial one waits at the front for the rest
+		size_t offset = 0;
+		for (; m_received - offset >= m_message_size; offset += m_message_size)
+		{
+			schedule_stamp stamp;
+			if (!stamp.read(data + offset, m_message_size))
+			{
+				m_invalid.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			m_raw_latencies.record(now - std::min(now, stamp.sent_ns));
+			m_corrected_latencies.record(now - std::min(now, stamp.intended_ns));
+			m_messages_received.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		std::memmove(m_receive_buffer.data(), m_receive_buffer.data() + offset, m_received - offset);
+		m_received -= offset;
+
+		set_receive();
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	std::shared_ptr<asio::ip::tcp::socket> m_socket;
+
+	arrival_schedule m_schedule;
+	size_t m_message_size;
+
+	std::vector<char> m_send_buffer;
+	std::vector<char> m_receive_buffer;
+	size_t m_received{ 0 };
+
+	// Owned by the io_service thread
+	latency_histogram m_raw_latencies;
+	latency_histogram m_corrected_latencies;
+
+	std::atomic<uint64_t> m_messages_sent{ 0 };
+	std::atomic<uint64_t> m_messages_received{ 0 };
+	std::atomic<uint64_t> m_invalid{ 0 };
+	std::atomic<uint64_t> m_max_send_lag_ns{ 0 };
+};
+
+// Open-loop workload: connections generators share the rate, each on its own
+// schedule. Every second reports the rates and the raw and corrected latency of
+// the echoes of that second, and the end of the run both over the whole run.
+// Raw latency starts when a message actually went out, so it leaves out the time
+// a stalled server kept the sender from sending; corrected latency starts at the
+// intended send time and includes it.
+static void run_open_loop(
+	const asio::ip::tcp::endpoint& remote_endpoint,
+	const size_t connections,
+	const double rate,
+	const arrival_schedule::arrivals arrivals,
+	const size_t message_size,
+	const uint32_t duration_seconds,
+	const std::string& histogram_file)
+{
+	std::random_device seed;
+
+	std::vector<std::shared_ptr<tcp_open_loop_generator>> generators;
+	for (size_t index = 0; index < std::max<size_t>(1, connections); ++index)
+	{
+		const auto generator = std::make_shared<tcp_open_loop_generator>(
+			io_service, arrivals, rate / static_cast<double>(std::max<size_t>(1, connections)), message_size, seed());
+		if (!generator->start(remote_endpoint))
+			return;
+
+		generators.push_back(generator);
+	}
+
+	PLOGI << "started open loop - " << remote_endpoint
+		<< " - rate: " << rate << " msg/s"
+		<< " - arrivals: " << (arrivals == arrival_schedule::arrivals::poisson ? "poisson" : "constant")
+		<< " - connections: " << generators.size()
+		<< " - message size: " << generators.front()->get_message_size()
+		<< " - duration: " << duration_seconds << " s";
+
+	// Latencies of the echoes since the last call, collected on the io thread
+	const auto take_latencies = [&](latency_histogram& raw, latency_histogram& corrected)
+	{
+		std::promise<void> result;
+		asio::post(*io_service, [&]()
+		{
+			for (const auto& generator : generators)
+				generator->take_latencies(raw, corrected);
+
+			result.set_value();
+		});
+
+		result.get_future().get();
+	};
+
+	const auto sum = [&](uint64_t (tcp_open_loop_generator::*get)() const)
+	{
+		uint64_t total = 0;
+		for (const auto& generator : generators)
+			total += ((*generator).*get)();
+
+		return total;
+	};
+
+	latency_histogram raw;
+	latency_histogram corrected;
+	latency_histogram raw_total;
+	latency_histogram corrected_total;
+
+	uint64_t last_sent = 0;
+	uint64_t last_received = 0;
+
+	for (uint32_t second = 1; second <= duration_seconds; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		raw.reset();
+		corrected.reset();
+		take_latencies(raw, corrected);
+
+		uint64_t max_send_lag = 0;
+		for (const auto& generator : generators)
+			max_send_lag = std::max(max_send_lag, generator->take_max_send_lag_ns());
+
+		const auto sent = sum(&tcp_open_loop_generator::get_messages_sent);
+		const auto received = sum(&tcp_open_loop_generator::get_messages_received);
+
+		PLOGI << "open loop - sent: " << sent - last_sent << " msg/s"
+			<< " - echoed: " << received - last_received << " msg/s"
+			<< " - send lag max: " << static_cast<double>(max_send_lag) / 1000.0 << " us";
+		PLOGI << "open loop - raw " << raw.get_summary();
+		PLOGI << "open loop - corrected " << corrected.get_summary();
+
+		raw_total.merge(raw);
+		corrected_total.merge(corrected);
+
+		last_sent = sent;
+		last_received = received;
+	}
+
+	for (const auto& generator : generators)
+		generator->stop();
+
+	// The echoes of the last messages get a moment to arrive
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	take_latencies(raw_total, corrected_total);
+
+	const auto sent = sum(&tcp_open_loop_generator::get_messages_sent);
+	const auto received = sum(&tcp_open_loop_generator::get_messages_received);
+
+	PLOGI << "open loop - sent: " << sent
+		<< " - echoed: " << received
+		<< " - unanswered: " << sent - std::min(sent, received)
+		<< " - invalid: " << sum(&tcp_open_loop_generator::get_invalid);
+	PLOGI << "open loop - total raw " << raw_total.get_summary();
+	PLOGI << "open loop - total corrected " << corrected_total.get_summary();
+
+	// The corrected distribution is the one to plot, the raw one goes next to it
+	if (!histogram_file.empty() && (!corrected_total.save(histogram_file) || !raw_total.save(histogram_file + ".raw")))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const command_line options(argc, argv);
+
+	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
+	init(plog::severityFromString(options.get_string("log_level", "verbose").c_str()), &console_appender);
+
+	PLOGD << "started plog verbose";
+
+	io_service = std::make_shared<asio::io_service>();
+	service_thread(io_service);
+
+	// --paced writes at the rates of the traffic configuration, to its destination
+	// unless --address and --port say otherwise
+	if (options.get_bool("paced", false))
+	{
+		traffic_config config;
+		if (!config.load(options.get_string("config", "configs.ini")))
+			return 1;
+
+		if (config.protocol != "TCP")
+		{
+			PLOGW << "configured protocol is " << config.protocol << ", sending TCP";
+		}
+
+		run_paced(config, { asio::ip::make_address(options.get_string("address", config.destination_address)),
+			static_cast<uint16_t>(options.get_uint("port", config.destination_port)) },
+			options.get_uint("rate_period", 10));
+		return 0;
+	}
+
+	const auto remote_address = options.get_string("address", "127.0.0.1");
+	const auto remote_port = static_cast<uint16_t>(options.get_uint("port", 7171));
+
+	// --source_addresses=127.0.0.2-127.0.0.254 binds the churn and load sockets
+	// across those local addresses, --source_ports=20000-60000 to explicit ports
+	source_addresses sources;
+	if (!sources.add_addresses(options.get_string("source_addresses", ""))
+		|| !sources.set_ports(options.get_string("source_ports", "")))
+	{
+		PLOGE << "invalid --source_addresses or --source_ports";
+		return 1;
+	}
+
+	// --churn=N keeps N connect/close loops running against the server
+	if (options.has("churn"))
+	{
+		run_churn({ asio::ip::make_address(remote_address), remote_port }, options.get_uint("churn", 1), sources);
+		return 0;
+	}
+
+	// --load opens --connections over --threads io threads of this process
+	if (options.get_bool("load", false))
+	{
+		run_load({ asio::ip::make_address(remote_address), remote_port },
+			options.get_uint("connections", 1000),
+			options.get_uint("threads", std::max(1U, std::thread::hardware_concurrency())),
+			options.get_uint("connect_rate", 1000),
+			options.get_uint("message_size", 64),
+			static_cast<uint32_t>(options.get_uint("duration", 0)),
+			sources,
+			options.get_string("histogram_file", ""));
+		return 0;
+	}
+
+	// --open_loop sends --rate messages per second on a fixed schedule, whatever the echoes do
+	if (options.get_bool("open_loop", false))
+	{
+		auto arrivals = arrival_schedule::arrivals::constant;
+		if (!arrival_schedule::parse(options.get_string("arrivals", "constant"), arrivals))
+		{
+			PLOGE << "invalid --arrivals, expected constant or poisson";
+			return 1;
+		}
+
+		run_open_loop({ asio::ip::make_address(remote_address), remote_port },
+			options.get_uint("connections", 1),
+			static_cast<double>(options.get_uint("rate", 1000)),
+			arrivals,
+			options.get_uint("message_size", 64),
+			static_cast<uint32_t>(options.get_uint("duration", 10)),
+			options.get_string("histogram_file", ""));
+		return 0;
+	}
+
+	if (options.get_bool("benchmark", false))
+	{
+		run_benchmark(remote_address, remote_port,
+			options.get_uint("connections", 1),
+			options.get_uint("message_size", 64),
+			static_cast<uint32_t>(options.get_uint("duration", 10)),
+			options.get_bool("timestamps", false),
+			options.get_string("histogram_file", ""));
+		return 0;
+	}
+
+	const auto current_client = std::make_shared<tcp_echo_client>(io_service);
+	PLOGD << "created tcp_echo_client class";
+
+	current_client->start(remote_address, remote_port);
+
+	while (!current_client->get_is_connected())
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	const auto buffer = std::string("get_remote_address");
+	current_client->send_packet(buffer.data(), buffer.size());
+
+	uint64_t last_allocations = 0;
+	uint64_t last_messages = 0;
+
+	// --duration=N stops after N seconds with a report over the whole run
+	const auto duration_seconds = options.get_uint("duration", 0);
+
+	latency_histogram latencies;
+	latency_histogram total;
+	latency_histogram unused;
+
+	for (uint64_t second = 1; duration_seconds == 0 || second <= duration_seconds; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		latencies.reset();
+
+		std::promise<void> result;
+		asio::post(*io_service, [&]()
+		{
+			current_client->take_latencies(latencies, unused, unused);
+			result.set_value();
+		});
+
+		result.get_future().get();
+		total.merge(latencies);
+
+		if (latencies.get_count() != 0)
+		{
+			PLOGI << "latency - round trips: " << latencies.get_count() << " - " << latencies.get_summary();
+		}
+
+		if (!allocation_counter::enabled())
+			continue;
+
+		const auto allocations = allocation_counter::get_allocations();
+		const auto messages = current_client->get_messages();
+
+		PLOGI << "allocations - " << allocations - last_allocations
+			<< " in " << messages - last_messages << " messages";
+
+		last_allocations = allocations;
+		last_messages = messages;
+	}
+
+	PLOGI << "latency - round trips: " << total.get_count() << " - total " << total.get_summary();
+
+	// --histogram_file=latency.hgrm dumps the whole distribution for plotting
+	const auto histogram_file = options.get_string("histogram_file", "");
+	if (!histogram_file.empty() && !total.save(histogram_file))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
 
 	PLOGD << "started io_service";
 	return 0;
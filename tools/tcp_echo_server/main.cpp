@@ -1,5 +1,11 @@
 /* ASIO INCLUDES */
 #include <asio.hpp>
+#include <fstream>
+
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
 
 /* PLOG INCLUDES */
 #include <plog/Log.h>
@@ -7,28 +13,111 @@
 #include <plog/Formatters/TxtFormatter.h>
 #include <plog/Appenders/ColorConsoleAppender.h>
 
-static std::shared_ptr<asio::io_service> io_service;
+/* COMMON INCLUDES */
+#include <allocation_counter.hpp>
+#include <buffer_pool.hpp>
+#include <command_line.hpp>
+#include <cpu_affinity.hpp>
+#include <handler_allocator.hpp>
+#include <io_service_pool.hpp>
+#include <socket_options.hpp>
+#include <timestamping.hpp>
+#include <uring.hpp>
+
+static std::shared_ptr<io_service_pool> io_pool;
+
+// Resident set size from /proc/self/statm, 0 where it is not available
+static uint64_t process_rss_bytes()
+{
+#if defined(__linux__)
+	std::ifstream statm("/proc/self/statm");
+
+	uint64_t size_pages = 0;
+	uint64_t resident_pages = 0;
+	if (!(statm >> size_pages >> resident_pages))
+		return 0;
+
+	return resident_pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#else
+	return 0;
+#endif
+}
+
+// Counters owned by one io thread, read by the stats timer
+struct alignas(64) worker_stats
+{
+	std::atomic<uint64_t> connections{ 0 };
+	std::atomic<uint64_t> bytes_received{ 0 };
+	std::atomic<uint64_t> bytes_sent{ 0 };
+
+	// Bytes waiting in the outbound queues of the worker connections
+	std::atomic<uint64_t> queued_bytes{ 0 };
+	std::atomic<uint64_t> max_queued_bytes{ 0 };
+	std::atomic<uint64_t> read_pauses{ 0 };
+
+	// Echo path cost: payload bytes copied in user space
+	std::atomic<uint64_t> messages{ 0 };
+	std::atomic<uint64_t> copied_bytes{ 0 };
+
+	// Kernel timestamps: receive timestamp to the read that returned the data,
+	// and receive timestamp to transmit timestamp of its echo, in nanoseconds
+	std::atomic<uint64_t> timestamped_receives{ 0 };
+	std::atomic<uint64_t> receive_delay_ns{ 0 };
+	std::atomic<uint64_t> timestamped_sends{ 0 };
+	std::atomic<uint64_t> turnaround_ns{ 0 };
+};
+
+struct downstream_options
+{
+	// Reads pause once the outbound queue holds high_water bytes and resume at low_water
+	size_t send_high_water{ 1048576 };
+	size_t send_low_water{ 262144 };
+
+	// Pool buffers a connection may borrow at once, at least two so the next read
+	// can start while the previous buffer is still being written. Every queued
+	// write holds one of them, so together they must exceed send_high_water or the
+	// queue is capped by the buffers before the water mark is ever reached.
+	size_t receive_buffers{ 8 };
+	size_t receive_buffer_size{ 262144 };
+
+	// Submit the reads themselves instead of waiting for readiness and reading
+	// synchronously. With the io_uring backend this saves the readiness round trip
+	// and a recv call per read, at the price of a buffer held by idle connections.
+#if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+	bool direct_receive{ true };
+#else
+	bool direct_receive{ false };
+#endif
+
+	// Read with recvmsg and collect SO_TIMESTAMPING receive and transmit
+	// timestamps, needs the readiness receive mode
+	bool timestamps{ false };
+};
+
+// A pool buffer travelling from the read side to the write side
+struct echo_chunk
+{
+	pooled_buffer buffer;
+	size_t size{ 0 };
+};
 
-static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
+// Non-owning view of the gathered buffers: the write operation copies two
+// pointers instead of the whole vector
+struct const_buffer_span
 {
-	asio::io_service::work work(*io_service);
+	const asio::const_buffer* first;
+	const asio::const_buffer* last;
 
-	do
+	const asio::const_buffer* begin() const
 	{
-		try
-		{
-			io_service->run();
-			break;
-		}
-		catch (const std::system_error& ex)
-		{
-			if (ex.code().value() == (10057) /*asio::error::not_connected*/)
-				continue;
+		return first;
+	}
 
-			break;
-		}
-	} while (true);
-}
+	const asio::const_buffer* end() const
+	{
+		return last;
+	}
+};
 
 class tcp_downstream
 	: public std::enable_shared_from_this<tcp_downstream>
@@ -36,19 +125,33 @@ class tcp_downstream
 public:
 	using shared_ptr = std::shared_ptr<tcp_downstream>;
 
-	explicit tcp_downstream(std::shared_ptr<asio::io_service> service)
+	// Upper bound of queued chunks handed to one gather write
+	static constexpr size_t max_gather_buffers = 64;
+
+	tcp_downstream(std::shared_ptr<asio::io_service> service, worker_stats& stats, const downstream_options& options)
 		: m_io_service(std::move(service))
+		, m_stats(stats)
+		, m_options(options)
 		, m_remote_port(0)
 	{
 		m_downstream_socket = std::make_shared<asio::ip::tcp::socket>(*m_io_service);
 	}
 
+	~tcp_downstream()
+	{
+		if (m_started)
+			m_stats.connections.fetch_sub(1, std::memory_order_relaxed);
+
+		m_stats.queued_bytes.fetch_sub(m_send_queue_bytes, std::memory_order_relaxed);
+	}
+
 	void start()
 	{
 		if (m_started)
 			return;
 
 		m_started = true;
+		m_stats.connections.fetch_add(1, std::memory_order_relaxed);
 
 		try
 		{
@@ -57,8 +160,7 @@ public:
 			m_downstream_socket->set_option(asio::ip::tcp::no_delay(true));
 			m_downstream_socket->set_option(asio::socket_base::send_buffer_size(262144));
 			m_downstream_socket->set_option(asio::socket_base::receive_buffer_size(262144));
-
-			m_receive_buffer.resize(262144);
+			m_downstream_socket->non_blocking(true);
 		}
 		catch (const std::exception& e)
 		{
@@ -67,8 +169,25 @@ public:
 			return;
 		}
 
-		m_remote_address = m_downstream_socket->remote_endpoint().address().to_v4().to_string();
-		m_remote_port = m_downstream_socket->remote_endpoint().port();
+		// Before the first send, so the transmit ids count the bytes of this connection
+		if (m_options.timestamps && !timestamping::enable(m_downstream_socket->native_handle()))
+		{
+			PLOGW << "SO_TIMESTAMPING is not supported, running without kernel timestamps";
+			m_options.timestamps = false;
+		}
+
+		// The peer may already be gone when the connection is started
+		std::error_code error;
+		const auto remote_endpoint = m_downstream_socket->remote_endpoint(error);
+		if (error)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			terminate();
+			return;
+		}
+
+		m_remote_address = remote_endpoint.address().to_v4().to_string();
+		m_remote_port = remote_endpoint.port();
 
 		set_receive();
 	}
@@ -78,6 +197,11 @@ public:
 		return m_downstream_socket;
 	}
 
+	std::shared_ptr<asio::io_service> get_io_service()
+	{
+		return m_io_service;
+	}
+
 	void terminate()
 	{
 		if (m_is_terminated)
@@ -89,7 +213,8 @@ public:
 		m_is_terminated = true;
 
 		const auto self(shared_from_this());
-		PLOGD << "call terminate downstream - m_is_terminated: " << self->m_is_terminated;
+		PLOGD << "call terminate downstream - m_is_terminated: " << self->m_is_terminated
+			<< " - max queued bytes: " << self->m_max_send_queue_bytes;
 		try
 		{
 			self->m_downstream_socket->close();
@@ -101,27 +226,70 @@ public:
 		}
 	}
 
-	void send_packet(void* buffer, const size_t size)
+	// Queue the buffer the data was received into, the payload is never copied
+	void send_packet(pooled_buffer buffer, size_t size)
+	{
+		if (m_is_terminated)
+		{
+			return;
+		}
+
+		static constexpr char remote_address_request[] = "get_remote_address";
+		static constexpr size_t remote_address_request_size = sizeof(remote_address_request) - 1;
+
+		if (size == remote_address_request_size && std::equal(buffer.data(), buffer.data() + size, remote_address_request))
+		{
+			const auto remote_address = m_remote_address + ":" + std::to_string(m_remote_port);
+			size = std::min(buffer.size(), remote_address.size());
+
+			std::copy_n(remote_address.begin(), size, buffer.data());
+			m_stats.copied_bytes.fetch_add(size, std::memory_order_relaxed);
+		}
+
+		m_send_queue.push_back({ std::move(buffer), size });
+
+		// The transmit timestamp of the send carrying the last byte of the chunk
+		// closes its turnaround
+		m_queued_offset += static_cast<uint32_t>(size);
+		if (m_options.timestamps && m_receive_time != 0)
+			m_transmit_pending.push_back({ m_queued_offset - 1, m_receive_time });
+
+		m_send_queue_bytes += size;
+		m_max_send_queue_bytes = std::max(m_max_send_queue_bytes, m_send_queue_bytes);
+
+		const auto queued_bytes = m_stats.queued_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+		if (queued_bytes > m_stats.max_queued_bytes.load(std::memory_order_relaxed))
+			m_stats.max_queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+
+		set_send();
+	}
+
+	// Write out the head of the queue with a single gather write
+	void set_send()
 	{
-		if (m_is_terminated || m_is_sending)
+		if (m_is_terminated || m_is_sending || m_send_queue.empty())
 		{
 			return;
 		}
 
 		m_is_sending = true;
 
+		m_send_buffers.clear();
+		for (const auto& chunk : m_send_queue)
+		{
+			m_send_buffers.emplace_back(chunk.buffer.data(), chunk.size);
+			if (m_send_buffers.size() == max_gather_buffers)
+				break;
+		}
+
 		auto self(shared_from_this());
 		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
 			{
 				self->handler_send_packet(error, bytes_transferred);
 			};
 
-		auto data_buffer = std::string(static_cast<char*>(buffer), size);
-		if (data_buffer == "get_remote_address")
-			data_buffer = m_remote_address + ":" + std::to_string(m_remote_port);
-
-		const auto asio_buffer = asio::buffer(data_buffer.data(), data_buffer.size());
-		m_downstream_socket->async_send(asio_buffer, bounded_function);
+		const const_buffer_span send_buffers{ m_send_buffers.data(), m_send_buffers.data() + m_send_buffers.size() };
+		asio::async_write(*m_downstream_socket, send_buffers, make_alloc_handler(bounded_function));
 	}
 
 	void handler_send_packet(const std::error_code& error, size_t bytes_transferred)
@@ -134,10 +302,42 @@ public:
 		}
 
 		PLOGD << "send packet to " << m_remote_address << ":" << m_remote_port << " - bytes: " << bytes_transferred;
+		m_stats.bytes_sent.fetch_add(bytes_transferred, std::memory_order_relaxed);
+
+		// async_write completes only once every gathered chunk is written, the
+		// buffers go back to the pool
+		const auto written = m_send_queue.begin() + static_cast<std::ptrdiff_t>(m_send_buffers.size());
+		for (auto it = m_send_queue.begin(); it != written; ++it)
+			m_send_queue_bytes -= it->size;
+
+		m_send_queue.erase(m_send_queue.begin(), written);
+		m_borrowed_buffers -= m_send_buffers.size();
+
+		m_stats.queued_bytes.fetch_sub(bytes_transferred, std::memory_order_relaxed);
 
 		m_is_sending = false;
+
+		if (m_options.timestamps)
+			read_transmit_times();
+
+		set_send();
+
+		if (m_is_read_paused && m_send_queue_bytes <= m_options.send_low_water)
+		{
+			PLOGD << "resume reads - queued bytes: " << m_send_queue_bytes;
+
+			m_is_read_paused = false;
+
+			// Readiness is edge triggered, data may already be waiting
+			if (m_options.direct_receive)
+				set_receive();
+			else
+				receive_available();
+		}
 	}
 
+	// Idle connections hold no buffer: wait for readability and borrow one from the
+	// pool only once data is ready
 	void set_receive()
 	{
 		if (m_is_terminated || m_is_receiving)
@@ -146,20 +346,62 @@ public:
 			return;
 		}
 
+		if (m_options.direct_receive)
+		{
+			set_receive_direct();
+			return;
+		}
+
+		m_is_receiving = true;
+
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error)
+			{
+				self->handler_receive(error);
+			};
+
+		m_downstream_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler(bounded_function));
+	}
+
+	void set_receive_direct()
+	{
+		if (!can_borrow_buffer())
+			return;
+
 		m_is_receiving = true;
 
+		++m_borrowed_buffers;
+		m_receive_buffer = buffer_pool::acquire(m_options.receive_buffer_size);
+
 		auto self(shared_from_this());
 		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
 			{
-				self->handler_receive(error, bytes_transferred);
+				self->handler_receive_direct(error, bytes_transferred);
 			};
 
 		const auto asio_buffer = asio::buffer(m_receive_buffer.data(), m_receive_buffer.size());
-		m_downstream_socket->async_receive(asio_buffer, bounded_function);
+		m_downstream_socket->async_receive(asio_buffer, make_alloc_handler(bounded_function));
+	}
+
+	void handler_receive_direct(const std::error_code& error, const size_t bytes_transferred)
+	{
+		m_is_receiving = false;
+
+		if (error)
+		{
+			PLOGE << "error value: " << error.value() << " - message: " << error.message();
+			terminate();
+			return;
+		}
+
+		if (handler_received(std::exchange(m_receive_buffer, {}), bytes_transferred))
+			set_receive();
 	}
 
-	void handler_receive(const std::error_code& error, const size_t bytes_transferred)
+	void handler_receive(const std::error_code& error)
 	{
+		m_is_receiving = false;
+
 		if (error)
 		{
 			PLOGE << "error value: " << error.value() << " - message: " << error.message();
@@ -167,16 +409,144 @@ public:
 			return;
 		}
 
+		receive_available();
+	}
+
+	// Read until the socket would block or the connection has to pause
+	void receive_available()
+	{
+		while (!m_is_terminated && !m_is_read_paused)
+		{
+			if (!can_borrow_buffer())
+				return;
+
+			auto buffer = buffer_pool::acquire(receive_size());
+
+			std::error_code error;
+			const auto bytes_transferred = m_options.timestamps
+				? receive_timestamped(buffer.data(), buffer.size(), error)
+				: m_downstream_socket->receive(asio::buffer(buffer.data(), buffer.size()), 0, error);
+
+			if (error == asio::error::would_block || error == asio::error::try_again)
+			{
+				set_receive();
+				return;
+			}
+
+			if (error)
+			{
+				PLOGE << "error value: " << error.value() << " - message: " << error.message();
+				terminate();
+				return;
+			}
+
+			++m_borrowed_buffers;
+			if (!handler_received(std::move(buffer), bytes_transferred))
+				return;
+		}
+	}
+
+	// Returns false when reads have to pause
+	bool handler_received(pooled_buffer buffer, const size_t bytes_transferred)
+	{
 		PLOGD << "recv from " << m_remote_address << ":" << m_remote_port << " - bytes: " << bytes_transferred;
+		m_stats.bytes_received.fetch_add(bytes_transferred, std::memory_order_relaxed);
+		m_stats.messages.fetch_add(1, std::memory_order_relaxed);
 
-		send_packet(m_receive_buffer.data(), bytes_transferred);
+		// The filled buffer moves to the write side, the next read borrows another one
+		send_packet(std::move(buffer), bytes_transferred);
 
-		m_is_receiving = false;
-		set_receive();
+		// Backpressure: stop reading until the peer drains the outbound queue
+		if (m_send_queue_bytes >= m_options.send_high_water)
+		{
+			PLOGD << "pause reads - queued bytes: " << m_send_queue_bytes;
+
+			m_is_read_paused = true;
+			m_stats.read_pauses.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool can_borrow_buffer()
+	{
+		if (m_borrowed_buffers < std::max<size_t>(2, m_options.receive_buffers))
+			return true;
+
+		// Every buffer is queued for writing, resume once one comes back
+		PLOGD << "pause reads - no free receive buffer";
+
+		m_is_read_paused = true;
+		m_stats.read_pauses.fetch_add(1, std::memory_order_relaxed);
+		return false;
 	}
 
 private:
+	size_t receive_timestamped(void* data, const size_t size, std::error_code& error)
+	{
+#if defined(__linux__)
+		const auto result = timestamping::receive(m_downstream_socket->native_handle(), data, size, m_receive_time);
+		if (result > 0)
+		{
+			const auto now = timestamping::now_ns();
+			if (m_receive_time != 0 && now > m_receive_time)
+			{
+				m_stats.timestamped_receives.fetch_add(1, std::memory_order_relaxed);
+				m_stats.receive_delay_ns.fetch_add(now - m_receive_time, std::memory_order_relaxed);
+			}
+
+			return static_cast<size_t>(result);
+		}
+
+		error = result == 0 ? std::error_code(asio::error::eof) : std::error_code(errno, asio::error::get_system_category());
+		return 0;
+#else
+		return m_downstream_socket->receive(asio::buffer(data, size), 0, error);
+#endif
+	}
+
+	// Every transmit timestamp closes the chunks that ended at or before its byte
+	void read_transmit_times()
+	{
+#if defined(__linux__)
+		uint64_t sends = 0;
+		uint64_t turnaround = 0;
+
+		uint32_t id = 0;
+		uint64_t transmit_time = 0;
+		while (timestamping::read_transmit_time(m_downstream_socket->native_handle(), id, transmit_time))
+		{
+			auto pending = m_transmit_pending.begin();
+			for (; pending != m_transmit_pending.end() && static_cast<int32_t>(id - pending->last_byte) >= 0; ++pending)
+			{
+				if (transmit_time < pending->receive_time)
+					continue;
+
+				++sends;
+				turnaround += transmit_time - pending->receive_time;
+			}
+
+			m_transmit_pending.erase(m_transmit_pending.begin(), pending);
+		}
+
+		m_stats.timestamped_sends.fetch_add(sends, std::memory_order_relaxed);
+		m_stats.turnaround_ns.fetch_add(turnaround, std::memory_order_relaxed);
+#endif
+	}
+
+	// Size the borrowed buffer by the bytes already queued in the socket
+	size_t receive_size()
+	{
+		std::error_code error;
+		const auto available = m_downstream_socket->available(error);
+
+		return std::min(m_options.receive_buffer_size, std::max<size_t>(buffer_pool::min_buffer_size, available));
+	}
+
 	std::shared_ptr<asio::io_service> m_io_service;
+	worker_stats& m_stats;
+	downstream_options m_options;
 
 	std::string m_remote_address;
 	uint16_t m_remote_port;
@@ -185,22 +555,96 @@ private:
 	std::atomic<bool> m_is_sending{ false };
 	std::atomic<bool> m_is_receiving{ false };
 	std::atomic<bool> m_is_terminated{ false };
+	std::atomic<bool> m_is_read_paused{ false };
+
+	pooled_buffer m_receive_buffer;
+	size_t m_borrowed_buffers{ 0 };
+
+	// Never longer than receive_buffers, so a vector stays cheap and allocates nothing while idle
+	std::vector<echo_chunk> m_send_queue;
+	std::vector<asio::const_buffer> m_send_buffers;
+	size_t m_send_queue_bytes{ 0 };
+	size_t m_max_send_queue_bytes{ 0 };
+
+	// Timestamp mode: receive time of the last read, stream offset of the bytes
+	// queued so far and the chunks still waiting for their transmit timestamp
+	struct transmit_pending
+	{
+		uint32_t last_byte;
+		uint64_t receive_time;
+	};
 
-	std::vector<uint8_t> m_receive_buffer;
+	uint64_t m_receive_time{ 0 };
+	uint32_t m_queued_offset{ 0 };
+	std::vector<transmit_pending> m_transmit_pending;
 
 	std::shared_ptr<asio::ip::tcp::socket> m_downstream_socket;
 };
 
+// One listening socket and the io_service that serves it
+struct acceptor_shard
+{
+	static constexpr std::chrono::milliseconds min_retry_delay{ 10 };
+	static constexpr std::chrono::milliseconds max_retry_delay{ 1000 };
+
+	size_t index{ 0 };
+	std::shared_ptr<asio::io_service> io_service;
+	std::shared_ptr<asio::ip::tcp::acceptor> acceptor;
+
+	// Owned by the shard thread
+	size_t pending_accepts{ 0 };
+	std::shared_ptr<tcp_downstream> spare_downstream;
+
+	// Drain mode: wait before accepting again after a failed accept
+	std::unique_ptr<asio::steady_timer> retry_timer;
+	std::chrono::milliseconds retry_delay{ min_retry_delay };
+
+	std::atomic<uint64_t> accepted{ 0 };
+	uint64_t last_accepted{ 0 };
+};
+
+struct accept_options
+{
+	// 0: a single acceptor hands connections to the pool in round-robin order
+	// N: one SO_REUSEPORT acceptor per io thread, the kernel spreads connections
+	size_t shards{ 0 };
+
+	// Concurrent async_accept operations kept outstanding on every acceptor
+	size_t depth{ 1 };
+
+	// Wait for readiness and drain the backlog with non-blocking accepts instead
+	bool drain{ false };
+
+	int backlog{ asio::socket_base::max_listen_connections };
+
+	// Sharded only: pick the acceptor by the CPU that received the connection
+	// request instead of the flow hash
+	bool cpu_steering{ false };
+};
+
 class tcp_echo_server
 	: public std::enable_shared_from_this<tcp_echo_server>
 {
 public:
-	explicit tcp_echo_server(std::shared_ptr<asio::io_service> service)
-		: m_io_service(std::move(service)), m_local_port(0)
+	// Upper bound of connections accepted per readiness event in drain mode, so a
+	// reconnect storm cannot starve the connections served by the same thread
+	static constexpr size_t max_accept_burst = 1024;
+
+	tcp_echo_server(
+		std::shared_ptr<io_service_pool> pool,
+		const downstream_options& options,
+		const uint32_t stats_interval_seconds)
+		: m_io_pool(std::move(pool))
+		, m_io_service(m_io_pool->get_io_service(0))
+		, m_downstream_options(options)
+		, m_local_port(0)
+		, m_stats_timer(*m_io_service)
+		, m_stats_interval_seconds(stats_interval_seconds)
+		, m_worker_stats(m_io_pool->size())
 	{
 	}
 
-	void listen(const std::string& address, const uint16_t port)
+	void listen(const std::string& address, const uint16_t port, const accept_options& options = {})
 	{
 		if (m_started)
 			return;
@@ -211,111 +655,1060 @@ public:
 
 		m_local_address = address;
 		m_local_port = port;
+		m_accept_options = options;
+		m_accept_options.depth = std::max<size_t>(1, m_accept_options.depth);
+		m_sharded = m_accept_options.shards > 0;
+
+#if !defined(SO_REUSEPORT)
+		if (m_sharded)
+		{
+			PLOGW << "SO_REUSEPORT is not supported, using a single acceptor";
+			m_sharded = false;
+		}
+#endif
 
 		// Prepare endpoint
 		m_endpoint = std::make_shared<asio::ip::tcp::endpoint>(asio::ip::make_address(address), port);
-		m_acceptor = std::make_shared<asio::ip::tcp::acceptor>(*m_io_service);
 
-		m_acceptor->open(m_endpoint->protocol());
-		m_acceptor->bind(*m_endpoint);
+		const auto shard_count = m_sharded ? m_accept_options.shards : 1;
+		for (size_t index = 0; index < shard_count; ++index)
+		{
+			auto shard = std::make_unique<acceptor_shard>();
+			shard->index = index;
+			shard->io_service = m_io_pool->get_io_service(index);
+			shard->retry_timer = std::make_unique<asio::steady_timer>(*shard->io_service);
+
+			m_shards.push_back(std::move(shard));
+		}
+
+		for (const auto& shard : m_shards)
+		{
+			listen_shard(*shard);
+			set_accept(*shard);
+		}
 
-		m_acceptor->listen();
+		// A shard reopened by terminate() rejoins the group last and keeps the
+		// program, only its position in the CPU mapping changes
+		if (m_sharded && m_accept_options.cpu_steering)
+		{
+			if (attach_reuseport_cpu_steering(m_shards.front()->acceptor->native_handle(), m_shards.size()))
+			{
+				PLOGI << "reuseport cpu steering attached - shards: " << m_shards.size();
+			}
+			else
+			{
+				PLOGW << "reuseport cpu steering is not supported, using the flow hash";
+			}
+		}
 
-		set_accept();
+		m_base_rss_bytes = process_rss_bytes();
+		set_stats_timer();
 	}
 
-	void set_accept()
+	void listen_shard(acceptor_shard& shard)
+	{
+		shard.acceptor = std::make_shared<asio::ip::tcp::acceptor>(*shard.io_service);
+		shard.pending_accepts = 0;
+
+		shard.acceptor->open(m_endpoint->protocol());
+
+#if defined(SO_REUSEPORT)
+		if (m_sharded)
+			shard.acceptor->set_option(reuse_port(true));
+#endif
+
+		shard.acceptor->bind(*m_endpoint);
+
+		shard.acceptor->listen(m_accept_options.backlog);
+
+		if (m_accept_options.drain)
+			shard.acceptor->non_blocking(true);
+
+		PLOGD << "listen shard " << shard.index << " - endpoint " << *m_endpoint
+			<< " - backlog: " << m_accept_options.backlog;
+	}
+
+	std::shared_ptr<tcp_downstream> create_downstream(const acceptor_shard& shard)
+	{
+		// Every connection is owned by one pool io_service for its whole life: the shard
+		// io_service when sharded, otherwise the next one in round-robin order
+		const auto worker_index = m_sharded
+			? shard.index % m_io_pool->size()
+			: m_next_worker++ % m_io_pool->size();
+
+		return std::make_shared<tcp_downstream>(
+			m_io_pool->get_io_service(worker_index), m_worker_stats[worker_index], m_downstream_options);
+	}
+
+	void set_accept(acceptor_shard& shard)
 	{
-		if (!m_started || m_accepting)
+		if (!m_started)
+			return;
+
+		if (m_accept_options.drain)
 		{
-			PLOGE << "is accepting";
+			set_accept_ready(shard);
 			return;
 		}
 
-		m_accepting = true;
-
 		auto self(this->shared_from_this());
 
-		const auto downstream_socket = std::make_shared<tcp_downstream>(m_io_service);
-		auto bounded_function = [self, downstream_socket](const std::error_code error)
-			{
-				self->handler_accept(downstream_socket, error);
-			};
+		// Keep accept depth operations outstanding on the acceptor
+		while (shard.pending_accepts < m_accept_options.depth)
+		{
+			++shard.pending_accepts;
+
+			const auto downstream_socket = create_downstream(shard);
+			const auto acceptor = shard.acceptor;
+
+			auto bounded_function = [self, &shard, acceptor, downstream_socket](const std::error_code error)
+				{
+					self->handler_accept(shard, acceptor, downstream_socket, error);
+				};
 
-		PLOGD << "create and try listen new downstream - ";
-		PLOGD << "endpoint " << m_acceptor->local_endpoint().address().to_v4().to_string() << ":" << m_acceptor->local_endpoint().port();
+			PLOGD << "create and try listen new downstream - shard " << shard.index;
 
-		m_acceptor->async_accept(*downstream_socket->socket(), bounded_function);
+			acceptor->async_accept(*downstream_socket->socket(), make_alloc_handler(bounded_function));
+		}
 	}
 
-	void handler_accept(const std::shared_ptr<tcp_downstream>& downstream_socket, const std::error_code& error)
+	void handler_accept(
+		acceptor_shard& shard,
+		const std::shared_ptr<asio::ip::tcp::acceptor>& acceptor,
+		const std::shared_ptr<tcp_downstream>& downstream_socket,
+		const std::error_code& error)
 	{
+		// Completion of an acceptor that was already closed by terminate()
+		if (acceptor != shard.acceptor)
+			return;
+
+		--shard.pending_accepts;
+
 		if (error)
 		{
+			if (error == asio::error::operation_aborted)
+				return;
+
 			PLOGE << "code: " << error.value() << " - message: " << error.message();
-			terminate();
+			terminate(shard);
 			return;
 		}
 
-		m_accepting = false;
+		start_downstream(shard, downstream_socket);
+
+		set_accept(shard);
+	}
+
+	void set_accept_ready(acceptor_shard& shard)
+	{
+		if (shard.pending_accepts > 0)
+			return;
+
+		shard.pending_accepts = 1;
 
-		downstream_socket->start();
-		PLOGD << "on accept - remote_endpoint " << downstream_socket->socket()->remote_endpoint();
+		auto self(this->shared_from_this());
+		const auto acceptor = shard.acceptor;
+
+		auto bounded_function = [self, &shard, acceptor](const std::error_code& error)
+			{
+				self->handler_accept_ready(shard, acceptor, error);
+			};
 
-		set_accept();
+		acceptor->async_wait(asio::socket_base::wait_read, make_alloc_handler(bounded_function));
 	}
 
-	void terminate()
+	void handler_accept_ready(
+		acceptor_shard& shard,
+		const std::shared_ptr<asio::ip::tcp::acceptor>& acceptor,
+		const std::error_code& error)
 	{
-		if (m_is_terminated)
+		if (acceptor != shard.acceptor)
+			return;
+
+		shard.pending_accepts = 0;
+
+		if (error)
 		{
-			PLOGI << "upstream already terminated";
+			if (error == asio::error::operation_aborted)
+				return;
+
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			terminate(shard);
 			return;
 		}
 
-		m_is_terminated = true;
+		// Drain the backlog until the non-blocking accept would block
+		for (size_t burst = 0; burst < max_accept_burst; ++burst)
+		{
+			if (!shard.spare_downstream)
+				shard.spare_downstream = create_downstream(shard);
 
-		const auto self(shared_from_this());
-		self->m_is_terminated = false;
-		self->m_accepting = false;
-		self->m_started = false;
+			std::error_code accept_error;
+			acceptor->accept(*shard.spare_downstream->socket(), accept_error);
 
-		self->m_endpoint.reset();
-		self->m_acceptor.reset();
+			if (accept_error == asio::error::would_block || accept_error == asio::error::try_again)
+				break;
 
-		self->listen(self->m_local_address, self->m_local_port);
-	}
+			if (accept_error)
+			{
+				set_accept_retry(shard, acceptor, accept_error);
+				return;
+			}
 
-private:
-	std::shared_ptr<asio::ip::tcp::endpoint> m_endpoint;
-	std::shared_ptr<asio::ip::tcp::acceptor> m_acceptor;
+			shard.retry_delay = acceptor_shard::min_retry_delay;
 
-	std::shared_ptr<asio::io_service> m_io_service;
+			start_downstream(shard, std::move(shard.spare_downstream));
+			shard.spare_downstream.reset();
+		}
 
-	std::string m_local_address;
-	uint16_t m_local_port;
+		set_accept(shard);
+	}
 
-	std::atomic<bool> m_started{ false };
-	std::atomic<bool> m_accepting{ false };
-	std::atomic<bool> m_is_terminated{ false };
-};
+	// Out of descriptors (EMFILE, ENFILE) the connection stays in the backlog and
+	// the acceptor stays readable, so waiting for readiness again would spin. Wait
+	// instead, twice as long for every failure in a row, and log the first one only.
+	void set_accept_retry(
+		acceptor_shard& shard,
+		const std::shared_ptr<asio::ip::tcp::acceptor>& acceptor,
+		const std::error_code& error)
+	{
+		if (shard.retry_delay == acceptor_shard::min_retry_delay)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message()
+				<< " - shard " << shard.index << " retries accepting with backoff";
+		}
 
-int main()
-{
-	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
-	init(plog::verbose, &console_appender);
+		// Keeps set_accept_ready from waiting for readiness meanwhile
+		shard.pending_accepts = 1;
 
-	PLOGD << "started plog verbose";
+		auto self(this->shared_from_this());
+		shard.retry_timer->expires_after(shard.retry_delay);
+		shard.retry_timer->async_wait([self, &shard, acceptor](const std::error_code& timer_error)
+			{
+				if (timer_error || acceptor != shard.acceptor)
+					return;
 
-	io_service = std::make_shared<asio::io_service>();
+				shard.pending_accepts = 0;
+				self->set_accept(shard);
+			});
 
-	const auto current_server = std::make_shared<tcp_echo_server>(io_service);
-	PLOGD << "created tcp_echo_server class";
+		shard.retry_delay = std::min(shard.retry_delay * 2, acceptor_shard::max_retry_delay);
+	}
+
+	void start_downstream(acceptor_shard& shard, std::shared_ptr<tcp_downstream> downstream_socket)
+	{
+		shard.accepted.fetch_add(1, std::memory_order_relaxed);
+
+		PLOGD << "on accept - shard " << shard.index;
+
+		if (downstream_socket->get_io_service() == shard.io_service)
+		{
+			downstream_socket->start();
+			return;
+		}
+
+		// The socket belongs to the downstream io_service, start it on that thread
+		asio::post(*downstream_socket->get_io_service(), make_alloc_handler([downstream_socket]()
+			{
+				downstream_socket->start();
+			}));
+	}
+
+	// Close the failed acceptor and listen on it again
+	void terminate(acceptor_shard& shard)
+	{
+		PLOGD << "call terminate shard " << shard.index;
+
+		try
+		{
+			std::error_code ignored;
+			shard.acceptor->close(ignored);
+			shard.acceptor.reset();
+
+			listen_shard(shard);
+			set_accept(shard);
+		}
+		catch (const std::exception& e)
+		{
+			PLOGE << e.what();
+		}
+	}
+
+	void set_stats_timer()
+	{
+		if (m_stats_interval_seconds == 0 || m_stats_timer_started)
+			return;
+
+		m_stats_timer_started = true;
+
+		auto self(shared_from_this());
+		m_stats_timer.expires_after(std::chrono::seconds(m_stats_interval_seconds));
+		m_stats_timer.async_wait([self](const std::error_code& error)
+			{
+				self->handler_stats_timer(error);
+			});
+	}
+
+	void handler_stats_timer(const std::error_code& error)
+	{
+		m_stats_timer_started = false;
+
+		if (error)
+			return;
+
+		uint64_t total_connections = 0;
+		uint64_t total_bytes_received = 0;
+		uint64_t total_bytes_sent = 0;
+		uint64_t total_messages = 0;
+
+		for (size_t index = 0; index < m_worker_stats.size(); ++index)
+		{
+			const auto& stats = m_worker_stats[index];
+			const auto connections = stats.connections.load(std::memory_order_relaxed);
+			const auto bytes_received = stats.bytes_received.load(std::memory_order_relaxed);
+			const auto bytes_sent = stats.bytes_sent.load(std::memory_order_relaxed);
+
+			PLOGI << "worker " << index
+				<< " - connections: " << connections
+				<< " - bytes received: " << bytes_received
+				<< " - bytes sent: " << bytes_sent
+				<< " - queued bytes: " << stats.queued_bytes.load(std::memory_order_relaxed)
+				<< " - max queued bytes: " << stats.max_queued_bytes.load(std::memory_order_relaxed)
+				<< " - read pauses: " << stats.read_pauses.load(std::memory_order_relaxed);
+
+			const auto messages = std::max<uint64_t>(1, stats.messages.load(std::memory_order_relaxed));
+			PLOGI << "worker " << index
+				<< " - messages: " << stats.messages.load(std::memory_order_relaxed)
+				<< " - copied bytes per message: " << static_cast<double>(stats.copied_bytes.load(std::memory_order_relaxed)) / messages;
+
+			if (m_downstream_options.timestamps)
+			{
+				PLOGI << "worker " << index
+					<< " - kernel to user: " << stats.receive_delay_ns.load(std::memory_order_relaxed)
+						/ std::max<uint64_t>(1, stats.timestamped_receives.load(std::memory_order_relaxed)) << " ns"
+					<< " - receive to transmit: " << stats.turnaround_ns.load(std::memory_order_relaxed)
+						/ std::max<uint64_t>(1, stats.timestamped_sends.load(std::memory_order_relaxed)) << " ns"
+					<< " - timestamped sends: " << stats.timestamped_sends.load(std::memory_order_relaxed);
+			}
+
+			total_connections += connections;
+			total_bytes_received += bytes_received;
+			total_bytes_sent += bytes_sent;
+			total_messages += stats.messages.load(std::memory_order_relaxed);
+		}
+
+		for (const auto& shard : m_shards)
+		{
+			const auto accepted = shard->accepted.load(std::memory_order_relaxed);
+
+			PLOGI << "shard " << shard->index
+				<< " - accepted: " << accepted
+				<< " - " << (accepted - shard->last_accepted) / m_stats_interval_seconds << " accepts/s";
+
+			shard->last_accepted = accepted;
+		}
+
+		const auto received_per_second = (total_bytes_received - m_last_bytes_received) / m_stats_interval_seconds;
+		const auto sent_per_second = (total_bytes_sent - m_last_bytes_sent) / m_stats_interval_seconds;
+
+		m_last_bytes_received = total_bytes_received;
+		m_last_bytes_sent = total_bytes_sent;
+
+		PLOGI << "total - connections: " << total_connections
+			<< " - received: " << received_per_second << " bytes/s"
+			<< " - sent: " << sent_per_second << " bytes/s";
+
+		if (allocation_counter::enabled())
+		{
+			const auto allocations = allocation_counter::get_allocations();
+			const auto messages = total_messages - m_last_messages;
+
+			PLOGI << "allocations - " << allocations - m_last_allocations
+				<< " in " << messages << " messages"
+				<< " - per message: " << static_cast<double>(allocations - m_last_allocations) / std::max<uint64_t>(1, messages);
+
+			m_last_allocations = allocations;
+		}
+
+		m_last_messages = total_messages;
+
+		// Growth since listen divided by the open connections
+		const auto rss = process_rss_bytes();
+		const auto rss_growth = rss > m_base_rss_bytes ? rss - m_base_rss_bytes : 0;
+
+		PLOGI << "memory - rss: " << rss << " bytes"
+			<< " - per connection: " << (total_connections ? rss_growth / total_connections : 0) << " bytes"
+			<< " - buffer pool slabs: " << buffer_pool::get_slab_bytes() << " bytes";
+
+		set_stats_timer();
+	}
+
+private:
+	std::shared_ptr<asio::ip::tcp::endpoint> m_endpoint;
+	std::vector<std::unique_ptr<acceptor_shard>> m_shards;
+	accept_options m_accept_options;
+	bool m_sharded{ false };
+
+	std::shared_ptr<io_service_pool> m_io_pool;
+	std::shared_ptr<asio::io_service> m_io_service;
+
+	downstream_options m_downstream_options;
+
+	std::string m_local_address;
+	uint16_t m_local_port;
+
+	std::atomic<bool> m_started{ false };
+
+	std::atomic<size_t> m_next_worker{ 0 };
+
+	asio::steady_timer m_stats_timer;
+	uint32_t m_stats_interval_seconds;
+	std::atomic<bool> m_stats_timer_started{ false };
+
+	std::vector<worker_stats> m_worker_stats;
+	uint64_t m_last_bytes_received{ 0 };
+	uint64_t m_last_bytes_sent{ 0 };
+	uint64_t m_base_rss_bytes{ 0 };
+	uint64_t m_last_messages{ 0 };
+	uint64_t m_last_allocations{ 0 };
+};
+
+#if defined(URING_ENGINE_SUPPORTED)
+struct uring_options
+{
+	// Provided buffers per thread and their size, the kernel picks one per receive
+	size_t buffers{ 4096 };
+	size_t buffer_size{ 16384 };
+
+	unsigned queue_depth{ 4096 };
+
+	// Pin worker i to CPU i and steer connection requests to the worker of the
+	// receiving CPU
+	bool pin_threads{ false };
+	bool cpu_steering{ false };
+};
+
+// A received buffer waiting to be echoed
+struct uring_chunk
+{
+	uint16_t buffer_id{ 0 };
+	uint32_t size{ 0 };
+	uint32_t sent{ 0 };
+};
+
+// Connection slot of the io_uring engine, reused by later connections
+struct uring_connection
+{
+	int fd{ -1 };
+
+	bool is_receiving{ false };
+	bool is_sending{ false };
+	bool is_closing{ false };
+	bool is_read_paused{ false };
+	bool is_waiting_buffers{ false };
+
+	std::vector<uring_chunk> send_queue;
+	size_t send_queue_bytes{ 0 };
+};
+
+// One io thread of the io_uring engine: its own ring, provided buffer ring and
+// SO_REUSEPORT listening socket. A multishot accept and one multishot receive per
+// connection stay armed across completions, so the steady state submits only the
+// sends, and the kernel picks the receive buffer when data arrives.
+class uring_echo_worker
+{
+public:
+	enum operation : uint64_t
+	{
+		operation_accept = 1,
+		operation_receive,
+		operation_send,
+		operation_cancel
+	};
+
+	uring_echo_worker(size_t index, worker_stats& stats, const downstream_options& downstream, const uring_options& options)
+		: m_index(index)
+		, m_stats(stats)
+		, m_downstream_options(downstream)
+		, m_options(options)
+	{
+	}
+
+	void listen(const asio::ip::tcp::endpoint& endpoint, const int backlog)
+	{
+		m_listen_fd = socket(endpoint.protocol().family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (m_listen_fd < 0)
+			throw std::system_error(errno, std::generic_category(), "socket");
+
+		const int enable = 1;
+		setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+		if (bind(m_listen_fd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) < 0)
+			throw std::system_error(errno, std::generic_category(), "bind");
+
+		if (::listen(m_listen_fd, backlog) < 0)
+			throw std::system_error(errno, std::generic_category(), "listen");
+
+		PLOGD << "uring worker " << m_index << " - listen endpoint " << endpoint << " - backlog: " << backlog;
+	}
+
+	int listen_fd() const
+	{
+		return m_listen_fd;
+	}
+
+	void start()
+	{
+		m_thread = std::thread([this]()
+			{
+				run();
+			});
+	}
+
+	void join()
+	{
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	// The worker thread ended on an error and serves nothing anymore
+	bool is_failed() const
+	{
+		return m_is_failed.load(std::memory_order_relaxed);
+	}
+
+private:
+	static uint64_t make_user_data(const operation type, const uint32_t slot)
+	{
+		return (static_cast<uint64_t>(type) << 32) | slot;
+	}
+
+	void run()
+	{
+		try
+		{
+			if (m_options.pin_threads)
+				cpu_affinity::pin_current_thread(m_index);
+
+			// Created on the worker thread, the only one submitting to it
+			uring ring(m_options.queue_depth);
+			uring_buffer_ring buffers(ring, 0, m_options.buffers, m_options.buffer_size);
+
+			m_ring = &ring;
+			m_buffers = &buffers;
+
+			set_accept();
+
+			while (true)
+			{
+				m_ring->submit_and_wait(1);
+				m_ring->for_each_completion([this](const io_uring_cqe& cqe)
+					{
+						handle_completion(cqe);
+					});
+
+				// Every buffer released by this batch goes back to the kernel at once
+				if (m_buffers->publish())
+					resume_waiting_receives();
+			}
+		}
+		catch (const std::exception& e)
+		{
+			PLOGE << "uring worker " << m_index << " - " << e.what();
+			m_is_failed.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	void handle_completion(const io_uring_cqe& cqe)
+	{
+		const auto type = static_cast<operation>(cqe.user_data >> 32);
+		const auto slot = static_cast<uint32_t>(cqe.user_data);
+		const bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+		switch (type)
+		{
+		case operation_accept:
+			handler_accept(cqe.res, more);
+			break;
+		case operation_receive:
+			handler_receive(slot, cqe.res, cqe.flags, more);
+			break;
+		case operation_send:
+			handler_send(slot, cqe.res);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void set_accept()
+	{
+		m_ring->accept_multishot(m_listen_fd, make_user_data(operation_accept, 0));
+	}
+
+	void handler_accept(const int result, const bool more)
+	{
+		if (result < 0)
+		{
+			PLOGE << "uring worker " << m_index << " - accept error: " << std::strerror(-result);
+
+			// Multishot accept is not supported by this kernel
+			if (result == -EINVAL)
+				throw std::system_error(-result, std::generic_category(), "multishot accept");
+		}
+		else
+		{
+			start_connection(result);
+		}
+
+		// The kernel ends a multishot operation on errors and overflows, re-arm it
+		if (!more)
+			set_accept();
+	}
+
+	void start_connection(const int fd)
+	{
+		const int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+		uint32_t slot;
+		if (m_free_slots.empty())
+		{
+			slot = static_cast<uint32_t>(m_connections.size());
+			m_connections.emplace_back();
+		}
+		else
+		{
+			slot = m_free_slots.back();
+			m_free_slots.pop_back();
+		}
+
+		auto& connection = m_connections[slot];
+		connection.fd = fd;
+
+		m_stats.connections.fetch_add(1, std::memory_order_relaxed);
+		PLOGD << "uring worker " << m_index << " - on accept - slot: " << slot;
+
+		set_receive(slot);
+	}
+
+	void set_receive(const uint32_t slot)
+	{
+		auto& connection = m_connections[slot];
+		if (connection.is_receiving || connection.is_closing || connection.is_read_paused)
+			return;
+
+		connection.is_receiving = true;
+		m_ring->receive_multishot(connection.fd, m_buffers->group(), make_user_data(operation_receive, slot));
+	}
+
+	void handler_receive(const uint32_t slot, const int result, const uint32_t flags, const bool more)
+	{
+		auto& connection = m_connections[slot];
+		if (!more)
+			connection.is_receiving = false;
+
+		if (result > 0 && (flags & IORING_CQE_F_BUFFER) != 0)
+		{
+			const auto buffer_id = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+			if (connection.is_closing)
+				m_buffers->recycle(buffer_id);
+			else
+				handler_received(slot, buffer_id, static_cast<uint32_t>(result));
+		}
+		else if (result == -ENOBUFS)
+		{
+			// Every provided buffer is queued for writing, resume once some come back
+			if (!connection.is_waiting_buffers)
+			{
+				connection.is_waiting_buffers = true;
+				m_waiting_slots.push_back(slot);
+				m_stats.read_pauses.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		else if (result == 0)
+		{
+			terminate(slot);
+		}
+		else if (result < 0 && result != -ECANCELED)
+		{
+			PLOGE << "uring worker " << m_index << " - receive error: " << std::strerror(-result);
+			terminate(slot);
+		}
+
+		if (connection.is_receiving)
+			return;
+
+		if (connection.is_closing)
+			release(slot);
+		else if (!connection.is_waiting_buffers)
+			set_receive(slot);
+	}
+
+	void handler_received(const uint32_t slot, const uint16_t buffer_id, uint32_t size)
+	{
+		auto& connection = m_connections[slot];
+
+		m_stats.bytes_received.fetch_add(size, std::memory_order_relaxed);
+		m_stats.messages.fetch_add(1, std::memory_order_relaxed);
+
+		static constexpr char remote_address_request[] = "get_remote_address";
+		static constexpr size_t remote_address_request_size = sizeof(remote_address_request) - 1;
+
+		const auto data = m_buffers->data(buffer_id);
+		if (size == remote_address_request_size && std::equal(data, data + size, remote_address_request))
+			size = write_remote_address(connection.fd, data);
+
+		connection.send_queue.push_back({ buffer_id, size, 0 });
+		connection.send_queue_bytes += size;
+
+		const auto queued_bytes = m_stats.queued_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+		if (queued_bytes > m_stats.max_queued_bytes.load(std::memory_order_relaxed))
+			m_stats.max_queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+
+		// Backpressure: cancel the multishot receive until the peer drains the queue
+		if (connection.send_queue_bytes >= m_downstream_options.send_high_water && !connection.is_read_paused)
+		{
+			connection.is_read_paused = true;
+			m_stats.read_pauses.fetch_add(1, std::memory_order_relaxed);
+
+			if (connection.is_receiving)
+				m_ring->cancel(make_user_data(operation_receive, slot), make_user_data(operation_cancel, slot));
+		}
+
+		set_send(slot);
+	}
+
+	uint32_t write_remote_address(const int fd, uint8_t* data)
+	{
+		asio::ip::tcp::endpoint endpoint;
+		auto size = static_cast<socklen_t>(endpoint.capacity());
+		if (getpeername(fd, endpoint.data(), &size) < 0)
+			return 0;
+
+		endpoint.resize(size);
+
+		const auto remote_address = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+		const auto copied = std::min(m_buffers->buffer_size(), remote_address.size());
+
+		std::copy_n(remote_address.begin(), copied, data);
+		m_stats.copied_bytes.fetch_add(copied, std::memory_order_relaxed);
+
+		return static_cast<uint32_t>(copied);
+	}
+
+	void set_send(const uint32_t slot)
+	{
+		auto& connection = m_connections[slot];
+		if (connection.is_sending || connection.is_closing || connection.send_queue.empty())
+			return;
+
+		connection.is_sending = true;
+
+		const auto& chunk = connection.send_queue.front();
+		m_ring->send(connection.fd, m_buffers->data(chunk.buffer_id) + chunk.sent, chunk.size - chunk.sent,
+			make_user_data(operation_send, slot));
+	}
+
+	void handler_send(const uint32_t slot, const int result)
+	{
+		auto& connection = m_connections[slot];
+		connection.is_sending = false;
+
+		if (result < 0 || connection.is_closing)
+		{
+			if (result < 0)
+			{
+				PLOGE << "uring worker " << m_index << " - send error: " << std::strerror(-result);
+			}
+
+			terminate(slot);
+			release(slot);
+			return;
+		}
+
+		m_stats.bytes_sent.fetch_add(static_cast<uint64_t>(result), std::memory_order_relaxed);
+
+		// A short send leaves the rest of the chunk at the head of the queue
+		auto& chunk = connection.send_queue.front();
+		chunk.sent += static_cast<uint32_t>(result);
+
+		if (chunk.sent == chunk.size)
+		{
+			m_buffers->recycle(chunk.buffer_id);
+
+			connection.send_queue_bytes -= chunk.size;
+			m_stats.queued_bytes.fetch_sub(chunk.size, std::memory_order_relaxed);
+
+			connection.send_queue.erase(connection.send_queue.begin());
+		}
+
+		set_send(slot);
+
+		if (connection.is_read_paused && connection.send_queue_bytes <= m_downstream_options.send_low_water)
+		{
+			connection.is_read_paused = false;
+			set_receive(slot);
+		}
+	}
+
+	void resume_waiting_receives()
+	{
+		if (m_waiting_slots.empty())
+			return;
+
+		for (const auto slot : m_waiting_slots)
+		{
+			auto& connection = m_connections[slot];
+			if (!connection.is_waiting_buffers)
+				continue;
+
+			connection.is_waiting_buffers = false;
+			set_receive(slot);
+		}
+
+		m_waiting_slots.clear();
+	}
+
+	// Stop the connection, the slot is released once no operation refers to it
+	void terminate(const uint32_t slot)
+	{
+		auto& connection = m_connections[slot];
+		if (connection.is_closing)
+			return;
+
+		connection.is_closing = true;
+
+		if (connection.is_receiving)
+			m_ring->cancel(make_user_data(operation_receive, slot), make_user_data(operation_cancel, slot));
+	}
+
+	void release(const uint32_t slot)
+	{
+		auto& connection = m_connections[slot];
+		if (connection.is_receiving || connection.is_sending || connection.fd < 0)
+			return;
+
+		for (const auto& chunk : connection.send_queue)
+			m_buffers->recycle(chunk.buffer_id);
+
+		m_stats.queued_bytes.fetch_sub(connection.send_queue_bytes, std::memory_order_relaxed);
+		m_stats.connections.fetch_sub(1, std::memory_order_relaxed);
+
+		close(connection.fd);
+
+		// Keep the queue capacity for the next connection of the slot
+		connection.fd = -1;
+		connection.is_closing = false;
+		connection.is_read_paused = false;
+		connection.is_waiting_buffers = false;
+		connection.send_queue.clear();
+		connection.send_queue_bytes = 0;
+
+		m_free_slots.push_back(slot);
+	}
+
+	size_t m_index;
+	worker_stats& m_stats;
+	downstream_options m_downstream_options;
+	uring_options m_options;
+
+	int m_listen_fd{ -1 };
+	std::thread m_thread;
+	std::atomic<bool> m_is_failed{ false };
+
+	uring* m_ring{ nullptr };
+	uring_buffer_ring* m_buffers{ nullptr };
+
+	std::vector<uring_connection> m_connections;
+	std::vector<uint32_t> m_free_slots;
+	std::vector<uint32_t> m_waiting_slots;
+};
+
+// Echo server on the io_uring engine: one worker per thread, each with its own
+// listening socket, the kernel spreads incoming connections between them
+class uring_echo_server
+{
+public:
+	uring_echo_server(const size_t threads, const downstream_options& downstream, const uring_options& options)
+		: m_cpu_steering(options.cpu_steering)
+		, m_worker_stats(std::max<size_t>(1, threads))
+	{
+		for (size_t index = 0; index < m_worker_stats.size(); ++index)
+			m_workers.push_back(std::make_unique<uring_echo_worker>(index, m_worker_stats[index], downstream, options));
+	}
+
+	void listen(const std::string& address, const uint16_t port, const int backlog)
+	{
+		const asio::ip::tcp::endpoint endpoint(asio::ip::make_address(address), port);
+
+		for (const auto& worker : m_workers)
+			worker->listen(endpoint, backlog);
+
+		if (m_cpu_steering && !attach_reuseport_cpu_steering(m_workers.front()->listen_fd(), m_workers.size()))
+		{
+			PLOGW << "reuseport cpu steering is not supported, using the flow hash";
+		}
+
+		for (const auto& worker : m_workers)
+			worker->start();
+	}
+
+	// Block the calling thread, reporting the worker stats every interval. Returns
+	// once a worker failed, the server would go on with a share of its
+	// connections never accepted.
+	void run(const uint32_t stats_interval_seconds)
+	{
+		uint64_t last_messages = 0;
+		uint64_t last_bytes_received = 0;
+
+		for (uint64_t second = 1;; ++second)
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+
+			const auto failed = std::any_of(m_workers.begin(), m_workers.end(), [](const std::unique_ptr<uring_echo_worker>& worker)
+				{
+					return worker->is_failed();
+				});
+
+			if (failed)
+				return;
+
+			if (stats_interval_seconds == 0 || second % stats_interval_seconds != 0)
+				continue;
+
+			uint64_t total_connections = 0;
+			uint64_t total_messages = 0;
+			uint64_t total_bytes_received = 0;
+
+			for (size_t index = 0; index < m_worker_stats.size(); ++index)
+			{
+				const auto& stats = m_worker_stats[index];
+
+				PLOGI << "uring worker " << index
+					<< " - connections: " << stats.connections.load(std::memory_order_relaxed)
+					<< " - messages: " << stats.messages.load(std::memory_order_relaxed)
+					<< " - bytes received: " << stats.bytes_received.load(std::memory_order_relaxed)
+					<< " - bytes sent: " << stats.bytes_sent.load(std::memory_order_relaxed)
+					<< " - queued bytes: " << stats.queued_bytes.load(std::memory_order_relaxed)
+					<< " - max queued bytes: " << stats.max_queued_bytes.load(std::memory_order_relaxed)
+					<< " - read pauses: " << stats.read_pauses.load(std::memory_order_relaxed);
+
+				total_connections += stats.connections.load(std::memory_order_relaxed);
+				total_messages += stats.messages.load(std::memory_order_relaxed);
+				total_bytes_received += stats.bytes_received.load(std::memory_order_relaxed);
+			}
+
+			PLOGI << "total - connections: " << total_connections
+				<< " - " << (total_messages - last_messages) / stats_interval_seconds << " messages/s"
+				<< " - received: " << (total_bytes_received - last_bytes_received) / stats_interval_seconds << " bytes/s";
+
+			last_messages = total_messages;
+			last_bytes_received = total_bytes_received;
+		}
+	}
+
+private:
+	bool m_cpu_steering;
+
+	std::vector<worker_stats> m_worker_stats;
+	std::vector<std::unique_ptr<uring_echo_worker>> m_workers;
+};
+#endif
+
+int main(int argc, char* argv[])
+{
+	const command_line options(argc, argv);
+
+	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
+	init(plog::severityFromString(options.get_string("log_level", "verbose").c_str()), &console_appender);
+
+	PLOGD << "started plog verbose";
+
+	// One io_service per core by default, --threads=N overrides it
+	const auto threads = options.get_uint("threads", std::max(1u, std::thread::hardware_concurrency()));
+
+	downstream_options connection_options;
+	connection_options.send_high_water = options.get_uint("send_high_water", connection_options.send_high_water);
+	connection_options.send_low_water = std::min<size_t>(connection_options.send_high_water,
+		options.get_uint("send_low_water", connection_options.send_low_water));
+	connection_options.receive_buffers = options.get_uint("receive_buffers", connection_options.receive_buffers);
+	connection_options.receive_buffer_size = std::min<size_t>(buffer_pool::max_buffer_size,
+		options.get_uint("receive_buffer_size", connection_options.receive_buffer_size));
+	connection_options.direct_receive = options.get_string("receive_mode",
+		connection_options.direct_receive ? "direct" : "wait") == "direct";
+	connection_options.timestamps = options.get_bool("timestamps", false);
+
+	if (std::max<size_t>(2, connection_options.receive_buffers) * connection_options.receive_buffer_size <= connection_options.send_high_water)
+	{
+		PLOGW << "receive_buffers * receive_buffer_size does not exceed send_high_water, reads pause for lack of buffers before the water mark";
+	}
+
+	// The receive timestamps arrive as control messages of recvmsg
+	if (connection_options.timestamps)
+		connection_options.direct_receive = false;
+
+	const auto stats_interval = static_cast<uint32_t>(options.get_uint("stats_interval", 5));
+
+	// CPU steering only pays off when the socket of CPU i is served on CPU i
+	const auto cpu_steering = options.get_string("steering", "hash") == "cpu";
+	const auto pin_threads = options.get_bool("pin_threads", cpu_steering);
+	const auto backlog = static_cast<int>(options.get_uint("backlog", asio::socket_base::max_listen_connections));
+
+	if (options.get_string("engine", "asio") == "uring")
+	{
+#if defined(URING_ENGINE_SUPPORTED)
+		if (connection_options.timestamps)
+		{
+			PLOGW << "the io_uring engine does not collect kernel timestamps";
+		}
+
+		uring_options engine_options;
+		engine_options.buffers = options.get_uint("uring_buffers", engine_options.buffers);
+		engine_options.buffer_size = options.get_uint("uring_buffer_size", engine_options.buffer_size);
+		engine_options.queue_depth = static_cast<unsigned>(options.get_uint("uring_queue_depth", engine_options.queue_depth));
+		engine_options.cpu_steering = cpu_steering;
+		engine_options.pin_threads = pin_threads;
+
+		uring_echo_server uring_server(threads, connection_options, engine_options);
+		uring_server.listen(options.get_string("address", "0.0.0.0"),
+			static_cast<uint16_t>(options.get_uint("port", 7171)),
+			backlog);
+
+		PLOGD << "started io_uring engine - threads: " << threads;
+
+		uring_server.run(stats_interval);
+
+		// The other workers block in io_uring_enter and cannot be joined
+		PLOGE << "a uring worker failed, stopping the server";
+		std::_Exit(EXIT_FAILURE);
+#else
+		PLOGE << "the io_uring engine is not supported on this platform";
+		return 1;
+#endif
+	}
+
+	io_pool = std::make_shared<io_service_pool>(threads);
+	io_pool->set_pin_threads(pin_threads);
+
+	const auto current_server = std::make_shared<tcp_echo_server>(io_pool, connection_options, stats_interval);
+	PLOGD << "created tcp_echo_server class";
+
+	accept_options acceptor_options;
+	acceptor_options.shards = options.get_uint("shards", 0);
+	acceptor_options.depth = options.get_uint("accept_depth", 1);
+	acceptor_options.drain = options.get_string("accept_mode", "async") == "drain";
+	acceptor_options.backlog = backlog;
+	acceptor_options.cpu_steering = cpu_steering;
+
+	current_server->listen(options.get_string("address", "0.0.0.0"),
+		static_cast<uint16_t>(options.get_uint("port", 7171)),
+		acceptor_options);
 
-	current_server->listen("0.0.0.0", 7171);
+	PLOGD << "started io_service_pool - threads: " << io_pool->size();
 
-	service_thread(io_service);
+	io_pool->run();
 
-	PLOGD << "started io_service";
 	return 0;
 }
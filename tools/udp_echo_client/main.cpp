@@ -1,8 +1,11 @@
 /* ASIO INCLUDES */
 #include <asio.hpp>
+#include <array>
 #include <utility>
 #include <thread>
 #include <chrono>
+#include <functional>
+#include <future>
 
 /* PLOG INCLUDES */
 #include <random>
@@ -11,6 +14,19 @@
 #include <plog/Formatters/TxtFormatter.h>
 #include <plog/Appenders/ColorConsoleAppender.h>
 
+/* COMMON INCLUDES */
+#include <allocation_counter.hpp>
+#include <command_line.hpp>
+#include <handler_allocator.hpp>
+#include <latency_histogram.hpp>
+#include <open_loop.hpp>
+#include <pacer.hpp>
+#include <sequence_window.hpp>
+#include <source_addresses.hpp>
+#include <timestamping.hpp>
+#include <traffic_config.hpp>
+#include <udp_offload.hpp>
+
 static std::shared_ptr<asio::io_service> io_service;
 
 static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
@@ -37,16 +53,46 @@ static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
 		}).detach();
 }
 
+// Run function on the io_service thread and wait until it returned, for reading
+// state only that thread touches
+static void run_on_io_service(const std::function<void()>& function)
+{
+	std::promise<void> result;
+	asio::post(*io_service, [&]()
+		{
+			function();
+			result.set_value();
+		});
+
+	result.get_future().get();
+}
+
 class udp_echo_client
 	: public std::enable_shared_from_this<udp_echo_client>
 {
 public:
+	// Receive slots reused in a ring: a datagram is received into slot i and echoed
+	// from it while the next receive already lands in slot i + 1, so the endpoint
+	// and the payload live with the slot and are passed around by index
+	static constexpr size_t slot_count = 8;
+	static constexpr size_t slot_buffer_size = 65536;
+
+	// Round trips whose send and transmit times are kept until the echo arrives
+	static constexpr size_t timing_slots = 64;
+
 	explicit udp_echo_client(
 		std::shared_ptr<asio::io_service> service)
 		: m_io_service(std::move(service))
 	{
 	}
 
+	// Receive with recvmsg and split every round trip into the kernel round trip,
+	// transmit timestamp to receive timestamp, and the time spent in user space
+	void set_timestamps(const bool timestamps)
+	{
+		m_timestamps = timestamps;
+	}
+
 	void start()
 	{
 		if (m_started)
@@ -59,7 +105,17 @@ public:
 			PLOGD << "create upstream socket";
 			m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service, asio::ip::udp::endpoint());
 
-			m_receive_buffer.resize(262144);
+			m_slot_buffers.resize(slot_count * slot_buffer_size);
+
+#if defined(__linux__)
+			if (m_timestamps && !timestamping::enable(m_socket->native_handle()))
+			{
+				PLOGW << "SO_TIMESTAMPING is not supported, running without kernel timestamps";
+				m_timestamps = false;
+			}
+#else
+			m_timestamps = false;
+#endif
 
 			set_receive_from();
 		}
@@ -97,67 +153,170 @@ public:
 		}
 	}
 
-	void send_packet_to(const std::shared_ptr<asio::ip::udp::endpoint>& remote_endpoint, char* buffer, const size_t size)
+	// Send the first datagram of the ping loop, buffer has to outlive the send
+	void send_packet_to(const asio::ip::udp::endpoint& remote_endpoint, const char* buffer, const size_t size)
+	{
+		auto self(shared_from_this());
+		asio::post(*m_io_service, make_alloc_handler([self, remote_endpoint, buffer, size]()
+			{
+				if (self->m_is_terminated)
+					return;
+
+				self->note_send();
+
+				std::error_code error;
+				self->m_socket->send_to(asio::buffer(buffer, size), remote_endpoint, 0, error);
+
+				if (error)
+				{
+					PLOGE << "code: " << error.value() << " - message: " << error.message();
+					self->terminate();
+					return;
+				}
+
+				self->m_start_time = std::chrono::high_resolution_clock::now();
+			}));
+	}
+
+	uint64_t get_packets() const
+	{
+		return m_packets.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_timestamped_round_trips() const
+	{
+		return m_timestamped_round_trips.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_kernel_round_trip_ns() const
+	{
+		return m_kernel_round_trip_ns.load(std::memory_order_relaxed);
+	}
+
+	// Must be called on the io_service thread: add the round trips since the last
+	// call to latencies and start over
+	void take_latencies(latency_histogram& latencies)
+	{
+		latencies.merge(m_latencies);
+		m_latencies.reset();
+	}
+
+	uint64_t get_user_space_ns() const
+	{
+		return m_user_space_ns.load(std::memory_order_relaxed);
+	}
+
+private:
+	uint8_t* slot_data(const size_t index)
+	{
+		return m_slot_buffers.data() + index * slot_buffer_size;
+	}
+
+	// Every slot waiting for its echo stops the receives until a send completes
+	void set_receive_from()
 	{
-		if (m_is_terminated || m_is_sending)
+		if (m_is_terminated || m_is_receiving || m_receive_index - m_send_index == slot_count)
+			return;
+
+#if defined(__linux__)
+		if (m_timestamps)
 		{
+			receive_available();
 			return;
 		}
+#endif
 
-		m_is_sending = true;
+		m_is_receiving = true;
+
+		const auto index = m_receive_index % slot_count;
 
 		auto self(shared_from_this());
-		auto bounded_function = [self, remote_endpoint](const std::error_code& error, const size_t bytes_transferred)
+		auto bounded_function = [self, index](const std::error_code& error, const size_t bytes_transferred)
 			{
-				self->handler_send_packet_to(remote_endpoint, error, bytes_transferred);
+				self->handler_receive_from(index, error, bytes_transferred);
 			};
 
-		const auto asio_buffer = asio::buffer(buffer, size);
-		m_socket->async_send_to(asio_buffer, *remote_endpoint, bounded_function);
+		const auto asio_buffer = asio::buffer(slot_data(index), slot_buffer_size);
+		m_socket->async_receive_from(asio_buffer, m_slots[index].endpoint, make_alloc_handler(bounded_function));
 	}
 
-	void handler_send_packet_to(const std::shared_ptr<asio::ip::udp::endpoint>& remote_endpoint, const std::error_code& error, const size_t bytes_transferred)
+	void handler_receive_from(const size_t index, const std::error_code& error, const size_t bytes_transferred)
 	{
+		m_is_receiving = false;
+
 		if (error)
 		{
-			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			PLOGE << "error value: " << error.value() << " - message: " << error.message();
 			terminate();
 			return;
 		}
 
-		m_start_time = std::chrono::high_resolution_clock::now();
-
-		PLOGD << "send packet to " << remote_endpoint->address().to_v4().to_string()
-			<< ":" << remote_endpoint->port()
-			<< " - bytes: " << bytes_transferred;
-
-		m_is_sending = false;
+		handler_received(index, bytes_transferred, 0);
+		set_receive_from();
 	}
 
-	void set_receive_from()
+#if defined(__linux__)
+	// Readiness is edge triggered: read until the socket would block or every slot
+	// waits for its echo, the send completion resumes the reads then
+	void receive_available()
 	{
-		if (m_is_terminated || m_is_receiving)
+		read_transmit_times();
+
+		while (!m_is_terminated && m_receive_index - m_send_index < slot_count)
 		{
-			PLOGI << "m_is_terminated: " << m_is_terminated << " - m_is_receiving: " << m_is_receiving;
-			return;
+			const auto index = m_receive_index % slot_count;
+			auto& endpoint = m_slots[index].endpoint;
+
+			iovec vector{ slot_data(index), slot_buffer_size };
+			timestamping::control_buffer control;
+
+			msghdr header{};
+			header.msg_name = endpoint.data();
+			header.msg_namelen = static_cast<socklen_t>(endpoint.capacity());
+			header.msg_iov = &vector;
+			header.msg_iovlen = 1;
+			header.msg_control = control.data;
+			header.msg_controllen = sizeof(control.data);
+
+			const auto result = recvmsg(m_socket->native_handle(), &header, MSG_DONTWAIT);
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					set_receive_ready();
+					return;
+				}
+
+				PLOGE << "recvmsg error: " << std::strerror(errno);
+				terminate();
+				return;
+			}
+
+			endpoint.resize(header.msg_namelen);
+			handler_received(index, static_cast<size_t>(result), timestamping::get_receive_time(header));
 		}
+	}
 
+	void set_receive_ready()
+	{
 		m_is_receiving = true;
 
-		auto last_received_endpoint = std::make_shared<asio::ip::udp::endpoint>();
-
 		auto self(shared_from_this());
-		auto bounded_function = [self, last_received_endpoint](const std::error_code& error, const size_t bytes_transferred)
+		auto bounded_function = [self](const std::error_code& error)
 			{
-				self->handler_receive_from(last_received_endpoint, error, bytes_transferred);
+				self->handler_receive_ready(error);
 			};
 
-		const auto asio_buffer = asio::buffer(m_receive_buffer.data(), m_receive_buffer.size());
-		m_socket->async_receive_from(asio_buffer, *last_received_endpoint, bounded_function);
+		m_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler(bounded_function));
 	}
 
-	void handler_receive_from(const std::shared_ptr<asio::ip::udp::endpoint>& last_received_endpoint, const std::error_code& error, const size_t bytes_transferred)
+	void handler_receive_ready(const std::error_code& error)
 	{
+		m_is_receiving = false;
+
 		if (error)
 		{
 			PLOGE << "error value: " << error.value() << " - message: " << error.message();
@@ -165,57 +324,1367 @@ public:
 			return;
 		}
 
+		receive_available();
+	}
+
+	// A transmit timestamp waiting on the error queue keeps the socket readable,
+	// so every wake takes them all before the wait is armed again
+	void read_transmit_times()
+	{
+		uint32_t id = 0;
+		uint64_t transmit_time = 0;
+		while (timestamping::read_transmit_time(m_socket->native_handle(), id, transmit_time))
+			m_transmit_times[id % timing_slots] = transmit_time;
+	}
+#endif
+
+	void handler_received(const size_t index, const size_t bytes_transferred, const uint64_t receive_time)
+	{
+		m_packets.fetch_add(1, std::memory_order_relaxed);
+
 		const auto end_time = std::chrono::high_resolution_clock::now();
-		const auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - m_start_time);
+		const auto elapsed_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - m_start_time);
+		m_latencies.record(static_cast<uint64_t>(elapsed_time.count()));
 
-		PLOGD << "recv from " << last_received_endpoint->address().to_v4().to_string()
-			<< ":" << last_received_endpoint->port()
+		PLOGD << "recv from " << m_slots[index].endpoint.address().to_string()
+			<< ":" << m_slots[index].endpoint.port()
 			<< " - bytes: " << bytes_transferred
-			<< " - latency: " << elapsed_time.count() << " ms"
-			<< " - buffer: " << std::string(reinterpret_cast<char*>(m_receive_buffer.data()), bytes_transferred);
+			<< " - latency: " << elapsed_time.count() << " ns"
+			<< " - buffer: " << std::string(reinterpret_cast<char*>(slot_data(index)), bytes_transferred);
 
-		send_packet_to(last_received_endpoint, reinterpret_cast<char*>(m_receive_buffer.data()), bytes_transferred);
+		if (m_timestamps)
+			handler_round_trip(receive_time);
 
-		m_is_receiving = false;
+		m_slots[index].size = bytes_transferred;
+		++m_receive_index;
+
+		send_slots();
+	}
+
+	// User space send time of the next datagram, its OPT_ID is the number of sends so far
+	void note_send()
+	{
+#if defined(__linux__)
+		if (m_timestamps)
+			m_send_times[m_send_count++ % timing_slots] = timestamping::now_ns();
+#endif
+	}
+
+	// One datagram is in flight, so echo n answers send n
+	void handler_round_trip(const uint64_t receive_time)
+	{
+#if defined(__linux__)
+		const auto now = timestamping::now_ns();
+
+		read_transmit_times();
+
+		const auto reply = m_reply_count++;
+		if (reply >= m_send_count)
+			return;
+
+		const auto send_time = m_send_times[reply % timing_slots];
+		const auto sent_time = std::exchange(m_transmit_times[reply % timing_slots], 0);
+		if (receive_time == 0 || sent_time == 0 || receive_time < sent_time || now < send_time)
+			return;
+
+		const auto kernel_round_trip = receive_time - sent_time;
+		const auto user_space = now - send_time > kernel_round_trip ? now - send_time - kernel_round_trip : 0;
+
+		m_timestamped_round_trips.fetch_add(1, std::memory_order_relaxed);
+		m_kernel_round_trip_ns.fetch_add(kernel_round_trip, std::memory_order_relaxed);
+		m_user_space_ns.fetch_add(user_space, std::memory_order_relaxed);
+
+		PLOGD << "round trip - kernel: " << kernel_round_trip << " ns - user space: " << user_space << " ns";
+#else
+		(void)receive_time;
+#endif
+	}
+
+	// Echo the received slots in order, one send in flight at a time
+	void send_slots()
+	{
+		if (m_is_terminated || m_is_sending || m_send_index == m_receive_index)
+			return;
+
+		m_is_sending = true;
+
+		const auto index = m_send_index % slot_count;
+		note_send();
+
+		auto self(shared_from_this());
+		auto bounded_function = [self, index](const std::error_code& error, const size_t bytes_transferred)
+			{
+				self->handler_send_slot(index, error, bytes_transferred);
+			};
+
+		const auto asio_buffer = asio::buffer(slot_data(index), m_slots[index].size);
+		m_socket->async_send_to(asio_buffer, m_slots[index].endpoint, make_alloc_handler(bounded_function));
+	}
+
+	void handler_send_slot(const size_t index, const std::error_code& error, const size_t bytes_transferred)
+	{
+		m_is_sending = false;
+
+		if (error)
+		{
+			PLOGE << "code: " << error.value() << " - message: " << error.message();
+			terminate();
+			return;
+		}
+
+		m_start_time = std::chrono::high_resolution_clock::now();
+
+		PLOGD << "send packet to " << m_slots[index].endpoint.address().to_string()
+			<< ":" << m_slots[index].endpoint.port()
+			<< " - bytes: " << bytes_transferred;
+
+		++m_send_index;
+
+		send_slots();
 		set_receive_from();
 	}
 
-private:
+	struct datagram_slot
+	{
+		asio::ip::udp::endpoint endpoint;
+		size_t size{ 0 };
+	};
+
 	std::atomic<bool> m_started{ false };
 	std::atomic<bool> m_is_sending{ false };
 	std::atomic<bool> m_is_receiving{ false };
 	std::atomic<bool> m_is_terminated{ false };
 
+	std::atomic<uint64_t> m_packets{ 0 };
+	latency_histogram m_latencies;
+
 	std::shared_ptr<asio::io_service> m_io_service;
 
-	std::vector<uint8_t> m_receive_buffer;
+	bool m_timestamps{ false };
+	uint64_t m_send_count{ 0 };
+	uint64_t m_reply_count{ 0 };
+	std::array<uint64_t, timing_slots> m_send_times{};
+	std::array<uint64_t, timing_slots> m_transmit_times{};
+
+	std::atomic<uint64_t> m_timestamped_round_trips{ 0 };
+	std::atomic<uint64_t> m_kernel_round_trip_ns{ 0 };
+	std::atomic<uint64_t> m_user_space_ns{ 0 };
+
+	std::array<datagram_slot, slot_count> m_slots;
+	std::vector<uint8_t> m_slot_buffers;
+
+	// Slots received and echoed so far, the ones in between wait for their send
+	size_t m_receive_index{ 0 };
+	size_t m_send_index{ 0 };
+
 	std::chrono::time_point<std::chrono::high_resolution_clock> m_start_time;
 
 	std::shared_ptr<asio::ip::udp::socket> m_socket;
 };
 
-int main()
+#if defined(__linux__)
+struct bulk_options
 {
-	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
-	init(plog::verbose, &console_appender);
+	size_t payload_size{ 1200 };
 
-	PLOGD << "started plog verbose";
+	// Datagrams sent per burst and kept in flight at most
+	size_t burst{ 32 };
+	size_t window{ 512 };
 
-	io_service = std::make_shared<asio::io_service>();
-	service_thread(io_service);
+	// Send each burst with one UDP_SEGMENT send and receive with UDP_GRO
+	bool offload{ false };
 
-	const auto current_client = std::make_shared<udp_echo_client>(io_service);
-	PLOGD << "created udp_echo_client class";
+	// Sequences tracked below the highest one echoed, arrivals further behind
+	// are counted as late
+	size_t sequence_window{ 4096 };
+};
 
-	current_client->start();
+// Bulk datagram generator used to compare segmentation offload on and off: keeps
+// a window of equally sized datagrams in flight and checks that every echo comes
+// back with the datagram boundaries intact. Every datagram starts with a stamp
+// carrying the flow id, its sequence number and its send time, so the echoes tell
+// loss, reordering and duplication apart from slowness.
+class udp_bulk_client
+	: public std::enable_shared_from_this<udp_bulk_client>
+{
+public:
+	// Stalled windows are considered lost after this long without an echo
+	static constexpr std::chrono::milliseconds stall_timeout{ 200 };
 
-	const auto remote_endpoint = std::make_shared<asio::ip::udp::endpoint>(asio::ip::address_v4::from_string("127.0.0.1"), 7172);
+	udp_bulk_client(std::shared_ptr<asio::io_service> service, const bulk_options& options, const uint32_t flow)
+		: m_io_service(std::move(service))
+		, m_options(options)
+		, m_stall_timer(*m_io_service)
+		, m_flow(flow)
+		, m_sequences(std::max(options.sequence_window, options.window))
+	{
+		m_options.payload_size = std::min(std::max(datagram_stamp::size, m_options.payload_size), udp_offload::max_send_size);
+		m_options.burst = std::min(std::max<size_t>(1, m_options.burst), udp_offload::max_segments);
 
-	const auto buffer = std::string("get_remote_address");
-	current_client->send_packet_to(remote_endpoint, const_cast<char*>(buffer.data()), buffer.size());
+		// A segmented send is limited to the largest UDP payload
+		if (m_options.offload)
+			m_options.burst = std::min(m_options.burst, udp_offload::max_send_size / m_options.payload_size);
 
-	while (true)
-		std::this_thread::sleep_for(std::chrono::milliseconds(UINT16_MAX));
+		m_options.window = std::max(m_options.window, m_options.burst);
+	}
+
+	void start(const asio::ip::udp::endpoint& remote_endpoint, const asio::ip::udp::endpoint& local_endpoint)
+	{
+		try
+		{
+			m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service, local_endpoint);
+			m_socket->set_option(asio::socket_base::send_buffer_size(4194304));
+			m_socket->set_option(asio::socket_base::receive_buffer_size(4194304));
+			m_socket->connect(remote_endpoint);
+			m_socket->non_blocking(true);
+		}
+		catch (const std::exception& e)
+		{
+			PLOGE << e.what();
+			return;
+		}
+
+		if (m_options.offload && !udp_offload::enable_receive(m_socket->native_handle()))
+		{
+			PLOGW << "UDP_GRO is not supported, sending and receiving one datagram at a time";
+			m_options.offload = false;
+		}
+
+		m_send_buffer.assign(m_options.burst * m_options.payload_size, 'b');
+		m_receive_buffer.resize(udp_offload::max_buffer_size);
+
+		PLOGI << "started bulk - remote_endpoint " << remote_endpoint
+			<< " - payload size: " << m_options.payload_size
+			<< " - burst: " << m_options.burst
+			<< " - window: " << m_options.window
+			<< " - offload: " << m_options.offload;
+
+		set_receive();
+		set_stall_timer();
+		send_bursts();
+	}
+
+	uint64_t get_datagrams() const
+	{
+		return m_datagrams.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_bytes() const
+	{
+		return m_bytes.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_socket_calls() const
+	{
+		return m_socket_calls.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_boundary_errors() const
+	{
+		return m_boundary_errors.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_lost() const
+	{
+		return m_lost.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_reordered() const
+	{
+		return m_reordered.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_reorder_distance() const
+	{
+		return m_reorder_distance.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_max_reorder_distance() const
+	{
+		return m_max_reorder_distance.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_duplicates() const
+	{
+		return m_duplicates.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_late() const
+	{
+		return m_late.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_invalid() const
+	{
+		return m_invalid.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_round_trip_ns() const
+	{
+		return m_round_trip_ns.load(std::memory_order_relaxed);
+	}
+
+	// Must be called on the io_service thread: add the round trips since the last
+	// call to round_trips and start over
+	void take_round_trips(latency_histogram& round_trips)
+	{
+		round_trips.merge(m_round_trips);
+		m_round_trips.reset();
+	}
+
+private:
+	// Fill the window, a full socket buffer waits for writability
+	void send_bursts()
+	{
+		while (!m_is_waiting_write && m_in_flight + m_options.burst <= m_options.window)
+		{
+			if (!send_burst())
+			{
+				m_is_waiting_write = true;
+
+				auto self(shared_from_this());
+				m_socket->async_wait(asio::socket_base::wait_write, make_alloc_handler([self](const std::error_code& error)
+					{
+						self->m_is_waiting_write = false;
+						if (!error)
+							self->send_bursts();
+					}));
+				return;
+			}
+		}
+	}
+
+	// Returns false when the socket buffer is full
+	bool send_burst()
+	{
+		const auto fd = m_socket->native_handle();
+
+		// Stamp every datagram of the burst, a sequence is only used once its datagram is sent
+		datagram_stamp stamp;
+		stamp.flow = m_flow;
+		stamp.send_time_ns = now_ns();
+
+		for (size_t index = 0; index < m_options.burst; ++index)
+		{
+			stamp.sequence = m_next_sequence + index;
+			stamp.write(m_send_buffer.data() + index * m_options.payload_size);
+		}
+
+		if (m_options.offload)
+		{
+			iovec vector{ m_send_buffer.data(), m_send_buffer.size() };
+
+			msghdr header{};
+			header.msg_iov = &vector;
+			header.msg_iovlen = 1;
+			udp_offload::set_segment_size(header, m_send_control, m_send_buffer.size(), m_options.payload_size);
+
+			m_socket_calls.fetch_add(1, std::memory_order_relaxed);
+			if (sendmsg(fd, &header, MSG_DONTWAIT) < 0)
+				return !is_would_block();
+
+			m_next_sequence += m_options.burst;
+			m_in_flight += m_options.burst;
+			return true;
+		}
+
+		for (size_t index = 0; index < m_options.burst; ++index)
+		{
+			m_socket_calls.fetch_add(1, std::memory_order_relaxed);
+			if (send(fd, m_send_buffer.data() + index * m_options.payload_size, m_options.payload_size, MSG_DONTWAIT) < 0)
+				return !is_would_block();
+
+			++m_next_sequence;
+			++m_in_flight;
+		}
+
+		return true;
+	}
+
+	void set_receive()
+	{
+		auto self(shared_from_this());
+		m_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler([self](const std::error_code& error)
+			{
+				if (!error)
+					self->receive_available();
+			}));
+	}
+
+	// Readiness is edge triggered, read until the socket would block
+	void receive_available()
+	{
+		const auto fd = m_socket->native_handle();
+
+		while (true)
+		{
+			iovec vector{ m_receive_buffer.data(), m_receive_buffer.size() };
+
+			msghdr header{};
+			header.msg_iov = &vector;
+			header.msg_iovlen = 1;
+			header.msg_control = m_receive_control.data;
+			header.msg_controllen = sizeof(m_receive_control.data);
+
+			m_socket_calls.fetch_add(1, std::memory_order_relaxed);
+			const auto received = recvmsg(fd, &header, MSG_DONTWAIT);
+			if (received < 0)
+			{
+				if (!is_would_block())
+				{
+					PLOGE << "recvmsg error: " << std::strerror(errno);
+				}
+				break;
+			}
+
+			handler_received(static_cast<size_t>(received), udp_offload::get_segment_size(header));
+		}
+
+		publish_sequences();
+		send_bursts();
+		set_receive();
+	}
+
+	void handler_received(const size_t size, const size_t segment_size)
+	{
+		const auto now = now_ns();
+		const auto step = segment_size > 0 ? segment_size : size;
+
+		for (size_t offset = 0; offset < size; offset += step)
+		{
+			datagram_stamp stamp;
+			if (!stamp.read(m_receive_buffer.data() + offset, std::min(step, size - offset)) || stamp.flow != m_flow)
+			{
+				++m_invalid_stamps;
+				continue;
+			}
+
+			m_sequences.receive(stamp.sequence);
+			m_round_trip_sum += now - stamp.send_time_ns;
+			m_round_trips.record(now - stamp.send_time_ns);
+		}
+
+		// Every datagram was sent with payload_size bytes, a coalesced receive must
+		// hold whole datagrams split at exactly that size
+		const bool intact = segment_size > 0
+			? segment_size == m_options.payload_size && size % segment_size == 0
+			: size == m_options.payload_size;
+
+		if (!intact)
+			m_boundary_errors.fetch_add(1, std::memory_order_relaxed);
+
+		const auto datagrams = udp_offload::get_segments(size, segment_size);
+		m_in_flight -= std::min(m_in_flight, datagrams);
+		m_received_since_tick = true;
+
+		m_datagrams.fetch_add(datagrams, std::memory_order_relaxed);
+		m_bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+
+	// Datagrams dropped on the way never come back, reopen the window after a stall
+	void set_stall_timer()
+	{
+		auto self(shared_from_this());
+		m_stall_timer.expires_after(stall_timeout);
+		m_stall_timer.async_wait([self](const std::error_code& error)
+			{
+				if (error)
+					return;
+
+				// The sequence window counts them once later echoes push them out
+				if (!self->m_received_since_tick && self->m_in_flight > 0)
+				{
+					self->m_in_flight = 0;
+					self->send_bursts();
+				}
+
+				self->m_received_since_tick = false;
+				self->set_stall_timer();
+			});
+	}
+
+	// Copy the counters of the sequence window for the reporting thread
+	void publish_sequences()
+	{
+		m_lost.store(m_sequences.lost(), std::memory_order_relaxed);
+		m_reordered.store(m_sequences.reordered(), std::memory_order_relaxed);
+		m_reorder_distance.store(m_sequences.reorder_distance_sum(), std::memory_order_relaxed);
+		m_duplicates.store(m_sequences.duplicates(), std::memory_order_relaxed);
+		m_late.store(m_sequences.late(), std::memory_order_relaxed);
+		m_invalid.store(m_invalid_stamps, std::memory_order_relaxed);
+		m_round_trip_ns.store(m_round_trip_sum, std::memory_order_relaxed);
+
+		const auto distance = m_sequences.take_max_reorder_distance();
+		if (distance > m_max_reorder_distance.load(std::memory_order_relaxed))
+			m_max_reorder_distance.store(distance, std::memory_order_relaxed);
+	}
+
+	static uint64_t now_ns()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	static bool is_would_block()
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	bulk_options m_options;
+
+	std::shared_ptr<asio::ip::udp::socket> m_socket;
+	asio::steady_timer m_stall_timer;
+
+	std::vector<uint8_t> m_send_buffer;
+	std::vector<uint8_t> m_receive_buffer;
+	udp_control_buffer m_send_control{};
+	udp_control_buffer m_receive_control{};
+
+	size_t m_in_flight{ 0 };
+	bool m_is_waiting_write{ false };
+	bool m_received_since_tick{ false };
+
+	uint32_t m_flow;
+	uint64_t m_next_sequence{ 0 };
+	sequence_window m_sequences;
+	uint64_t m_invalid_stamps{ 0 };
+	uint64_t m_round_trip_sum{ 0 };
+	latency_histogram m_round_trips;
+
+	std::atomic<uint64_t> m_datagrams{ 0 };
+	std::atomic<uint64_t> m_bytes{ 0 };
+	std::atomic<uint64_t> m_socket_calls{ 0 };
+	std::atomic<uint64_t> m_boundary_errors{ 0 };
+	std::atomic<uint64_t> m_lost{ 0 };
+	std::atomic<uint64_t> m_reordered{ 0 };
+	std::atomic<uint64_t> m_reorder_distance{ 0 };
+	std::atomic<uint64_t> m_max_reorder_distance{ 0 };
+	std::atomic<uint64_t> m_duplicates{ 0 };
+	std::atomic<uint64_t> m_late{ 0 };
+	std::atomic<uint64_t> m_invalid{ 0 };
+	std::atomic<uint64_t> m_round_trip_ns{ 0 };
+};
+
+// Every bulk client owns a socket, so the clients use distinct source ports and
+// a SO_REUSEPORT server spreads them across its threads
+static void run_bulk(const asio::ip::udp::endpoint& remote_endpoint, const bulk_options& options, const size_t sockets, const source_addresses& sources)
+{
+	std::vector<std::shared_ptr<udp_bulk_client>> clients;
+	for (size_t index = 0; index < std::max<size_t>(1, sockets); ++index)
+	{
+		// Every socket on a source address of its own, if any were given
+		const auto local_endpoint = sources.empty()
+			? asio::ip::udp::endpoint(remote_endpoint.protocol(), 0)
+			: sources.get_endpoint<asio::ip::udp::endpoint>(index);
+
+		const auto client = std::make_shared<udp_bulk_client>(io_service, options, static_cast<uint32_t>(index));
+		asio::post(*io_service, [client, remote_endpoint, local_endpoint]()
+			{
+				client->start(remote_endpoint, local_endpoint);
+			});
+
+		clients.push_back(client);
+	}
+
+	uint64_t last_datagrams = 0;
+	uint64_t last_bytes = 0;
+	uint64_t last_socket_calls = 0;
+	uint64_t last_lost = 0;
+	uint64_t last_reordered = 0;
+	uint64_t last_reorder_distance = 0;
+	uint64_t last_duplicates = 0;
+	uint64_t last_round_trip_ns = 0;
+
+	latency_histogram round_trips;
+
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		// The clients record on the io thread, their histograms are merged there
+		round_trips.reset();
+		run_on_io_service([&]()
+			{
+				for (const auto& client : clients)
+					client->take_round_trips(round_trips);
+			});
+
+		uint64_t datagrams = 0;
+		uint64_t bytes = 0;
+		uint64_t socket_calls = 0;
+		uint64_t lost = 0;
+		uint64_t boundary_errors = 0;
+		uint64_t reordered = 0;
+		uint64_t reorder_distance = 0;
+		uint64_t max_reorder_distance = 0;
+		uint64_t duplicates = 0;
+		uint64_t late = 0;
+		uint64_t invalid = 0;
+		uint64_t round_trip_ns = 0;
+
+		for (const auto& client : clients)
+		{
+			datagrams += client->get_datagrams();
+			bytes += client->get_bytes();
+			socket_calls += client->get_socket_calls();
+			lost += client->get_lost();
+			boundary_errors += client->get_boundary_errors();
+			reordered += client->get_reordered();
+			reorder_distance += client->get_reorder_distance();
+			max_reorder_distance = std::max(max_reorder_distance, client->get_max_reorder_distance());
+			duplicates += client->get_duplicates();
+			late += client->get_late();
+			invalid += client->get_invalid();
+			round_trip_ns += client->get_round_trip_ns();
+		}
+
+		const auto interval_datagrams = datagrams - last_datagrams;
+		const auto interval_lost = lost - last_lost;
+		const auto interval_reordered = reordered - last_reordered;
+
+		PLOGI << "bulk - " << interval_datagrams << " datagrams/s"
+			<< " - " << (bytes - last_bytes) * 8 / 1000000 << " Mbit/s"
+			<< " - socket calls per datagram: " << static_cast<double>(socket_calls - last_socket_calls)
+				/ std::max<uint64_t>(1, interval_datagrams)
+			<< " - round trip: " << (round_trip_ns - last_round_trip_ns) / std::max<uint64_t>(1, interval_datagrams) / 1000 << " us"
+			<< " - boundary errors: " << boundary_errors;
+
+		PLOGI << "sequences - lost: " << interval_lost << "/s"
+			<< " (" << 100.0 * static_cast<double>(interval_lost) / static_cast<double>(std::max<uint64_t>(1, interval_lost + interval_datagrams)) << " %)"
+			<< " - reordered: " << interval_reordered << "/s"
+			<< " - reorder distance: " << static_cast<double>(reorder_distance - last_reorder_distance) / static_cast<double>(std::max<uint64_t>(1, interval_reordered))
+			<< " avg, " << max_reorder_distance << " max"
+			<< " - duplicates: " << duplicates - last_duplicates << "/s"
+			<< " - late: " << late
+			<< " - invalid: " << invalid;
+
+		PLOGI << "round trips - " << round_trips.get_count() << "/s - " << round_trips.get_summary();
+
+		last_datagrams = datagrams;
+		last_bytes = bytes;
+		last_socket_calls = socket_calls;
+		last_lost = lost;
+		last_reordered = reordered;
+		last_reorder_distance = reorder_distance;
+		last_duplicates = duplicates;
+		last_round_trip_ns = round_trip_ns;
+	}
+}
+#endif
+
+// Rate controlled generator driven by configs.ini: a thread of its own sends
+// datagrams to the destination as the token bucket pacer lets them out, and the
+// echoes are counted on the io_service. The datagram size follows the two rates,
+// bytes per second over packets per second, with the fraction carried over to the
+// next datagrams so both rates hold.
+class udp_paced_generator
+	: public std::enable_shared_from_this<udp_paced_generator>
+{
+public:
+	// Datagrams per sendmmsg
+	static constexpr size_t send_batch = 64;
+
+	explicit udp_paced_generator(std::shared_ptr<asio::io_service> service)
+		: m_io_service(std::move(service))
+		, m_send_buffer(udp_offload::max_send_size, 'x')
+		, m_receive_buffer(65536)
+	{
+	}
+
+	void start(const asio::ip::udp::endpoint& remote_endpoint)
+	{
+		m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service);
+		m_socket->open(remote_endpoint.protocol());
+		m_socket->connect(remote_endpoint);
+
+		// A full send buffer drops the datagram instead of stalling the schedule
+		m_socket->non_blocking(true);
+
+		const auto self(shared_from_this());
+		asio::post(*m_io_service, [self]()
+			{
+				self->set_receive();
+			});
+
+		std::thread([self]()
+			{
+				self->send_loop();
+			}).detach();
+	}
+
+	void set_rates(const uint64_t packets_per_second, const uint64_t bytes_per_second)
+	{
+		m_pacer.set_rates(packets_per_second, bytes_per_second);
+		m_datagram_size.store(get_datagram_size(packets_per_second, bytes_per_second), std::memory_order_relaxed);
+	}
+
+	uint64_t get_packets_sent() const
+	{
+		return m_packets_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_bytes_sent() const
+	{
+		return m_bytes_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_send_drops() const
+	{
+		return m_send_drops.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_packets_received() const
+	{
+		return m_packets_received.load(std::memory_order_relaxed);
+	}
+
+	// Average datagram size in bytes
+	static double get_datagram_size(const uint64_t packets_per_second, const uint64_t bytes_per_second)
+	{
+		if (packets_per_second == 0 || bytes_per_second == 0)
+			return 64;
+
+		return std::min(std::max(1.0, static_cast<double>(bytes_per_second) / static_cast<double>(packets_per_second)),
+			static_cast<double>(udp_offload::max_send_size));
+	}
+
+private:
+	void send_loop()
+	{
+		token_bucket_pacer::set_precise_timers();
+
+		double carry = 0;
+		std::array<size_t, send_batch> sizes{};
+
+		while (true)
+		{
+			const auto datagram_size = m_datagram_size.load(std::memory_order_relaxed);
+			const auto ready = m_pacer.wait(static_cast<size_t>(datagram_size + carry));
+			if (ready == 0)
+				return;
+
+			for (size_t first = 0; first < ready; first += send_batch)
+			{
+				const auto count = std::min(send_batch, ready - first);
+
+				uint64_t bytes = 0;
+				for (size_t index = 0; index < count; ++index)
+				{
+					sizes[index] = static_cast<size_t>(datagram_size + carry);
+					carry += datagram_size - static_cast<double>(sizes[index]);
+					bytes += sizes[index];
+				}
+
+				const auto sent = send_datagrams(sizes.data(), count);
+
+				// Dropped datagrams used their slot of the schedule as well
+				m_pacer.consume(count, bytes);
+				m_send_drops.fetch_add(count - sent.first, std::memory_order_relaxed);
+				m_packets_sent.fetch_add(sent.first, std::memory_order_relaxed);
+				m_bytes_sent.fetch_add(sent.second, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Datagrams and bytes the socket took
+	std::pair<size_t, uint64_t> send_datagrams(const size_t* sizes, const size_t count)
+	{
+		size_t sent = 0;
+		uint64_t bytes = 0;
+
+#if defined(__linux__)
+		for (size_t index = 0; index < count; ++index)
+		{
+			m_send_iovecs[index].iov_base = m_send_buffer.data();
+			m_send_iovecs[index].iov_len = sizes[index];
+
+			m_send_headers[index] = {};
+			m_send_headers[index].msg_hdr.msg_iov = &m_send_iovecs[index];
+			m_send_headers[index].msg_hdr.msg_iovlen = 1;
+		}
+
+		const auto result = sendmmsg(m_socket->native_handle(), m_send_headers.data(), static_cast<unsigned>(count), MSG_DONTWAIT);
+		sent = result > 0 ? static_cast<size_t>(result) : 0;
+
+		for (size_t index = 0; index < sent; ++index)
+			bytes += sizes[index];
+#else
+		for (size_t index = 0; index < count; ++index)
+		{
+			std::error_code error;
+			m_socket->send(asio::buffer(m_send_buffer.data(), sizes[index]), 0, error);
+
+			if (!error)
+			{
+				++sent;
+				bytes += sizes[index];
+			}
+		}
+#endif
+
+		return { sent, bytes };
+	}
+
+	void set_receive()
+	{
+		auto self(shared_from_this());
+		m_socket->async_receive(asio::buffer(m_receive_buffer), make_alloc_handler([self](const std::error_code& error, const size_t)
+			{
+				self->handler_receive(error);
+			}));
+	}
+
+	void handler_receive(const std::error_code& error)
+	{
+		// Nothing listening answers with ICMP port unreachable, keep receiving
+		if (error && error != asio::error::connection_refused)
+		{
+			PLOGE << "error value: " << error.value() << " - message: " << error.message();
+			return;
+		}
+
+		if (!error)
+			m_packets_received.fetch_add(1, std::memory_order_relaxed);
+
+		set_receive();
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	std::shared_ptr<asio::ip::udp::socket> m_socket;
+
+	token_bucket_pacer m_pacer;
+	std::atomic<double> m_datagram_size{ 64 };
+
+	std::vector<char> m_send_buffer;
+#if defined(__linux__)
+	std::array<iovec, send_batch> m_send_iovecs{};
+	std::array<mmsghdr, send_batch> m_send_headers{};
+#endif
+	std::vector<char> m_receive_buffer;
+
+	std::atomic<uint64_t> m_packets_sent{ 0 };
+	std::atomic<uint64_t> m_bytes_sent{ 0 };
+	std::atomic<uint64_t> m_send_drops{ 0 };
+	std::atomic<uint64_t> m_packets_received{ 0 };
+};
+
+// Draw new rates within the bounds of the configuration every rate_period
+// seconds and report every second how close the generator keeps to them
+static void run_paced(const traffic_config& config, const asio::ip::udp::endpoint& remote_endpoint, const uint64_t rate_period_seconds)
+{
+	std::mt19937_64 random(std::random_device{}());
+
+	const auto generator = std::make_shared<udp_paced_generator>(io_service);
+
+	auto rates = config.draw_rates(random);
+	generator->set_rates(rates.first, rates.second);
+	generator->start(remote_endpoint);
+
+	PLOGI << "paced - " << remote_endpoint << " - target: " << rates.first << " pps, " << rates.second << " bytes/s"
+		<< " - datagram size: " << udp_paced_generator::get_datagram_size(rates.first, rates.second);
+
+	uint64_t last_packets = 0;
+	uint64_t last_bytes = 0;
+	uint64_t last_received = 0;
+
+	for (uint64_t second = 1;; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		const auto packets = generator->get_packets_sent() - last_packets;
+		const auto bytes = generator->get_bytes_sent() - last_bytes;
+		const auto received = generator->get_packets_received() - last_received;
+
+		const auto error = [](const uint64_t value, const uint64_t target)
+			{
+				return target == 0 ? 0.0 : 100.0 * (static_cast<double>(value) - static_cast<double>(target)) / static_cast<double>(target);
+			};
+
+		PLOGI << "paced - sent: " << packets << " pps (" << error(packets, rates.first) << " %)"
+			<< " - " << bytes << " bytes/s (" << error(bytes, rates.second) << " %)"
+			<< " - echoes: " << received << " pps"
+			<< " - send drops: " << generator->get_send_drops();
+
+		last_packets += packets;
+		last_bytes += bytes;
+		last_received += received;
+
+		if (rate_period_seconds > 0 && second % rate_period_seconds == 0)
+		{
+			rates = config.draw_rates(random);
+			generator->set_rates(rates.first, rates.second);
+
+			PLOGI << "paced - target: " << rates.first << " pps, " << rates.second << " bytes/s"
+				<< " - datagram size: " << udp_paced_generator::get_datagram_size(rates.first, rates.second);
+		}
+	}
+}
+
+// Open-loop generator: a thread of its own sends datagrams on the arrival
+// schedule whether or not the echoes keep up, each stamped with its intended and
+// actual send time, and the echoes are timed against both on the io_service.
+// Datagrams the socket refuses count as send drops and are not retried, they
+// would only push the schedule back.
+class udp_open_loop_generator
+	: public std::enable_shared_from_this<udp_open_loop_generator>
+{
+public:
+	// Datagrams per sendmmsg
+	static constexpr size_t send_batch = 64;
+
+	udp_open_loop_generator(
+		std::shared_ptr<asio::io_service> service,
+		const arrival_schedule::arrivals arrivals,
+		const double rate,
+		const size_t payload_size,
+		const uint64_t seed)
+		: m_io_service(std::move(service))
+		, m_schedule(arrivals, rate, seed)
+		, m_payload_size(std::min(std::max(schedule_stamp::size, payload_size), udp_offload::max_send_size))
+		, m_send_buffer(send_batch * m_payload_size, 'o')
+		, m_receive_buffer(65536)
+	{
+	}
+
+	void start(const asio::ip::udp::endpoint& remote_endpoint)
+	{
+		m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service);
+		m_socket->open(remote_endpoint.protocol());
+		m_socket->set_option(asio::socket_base::receive_buffer_size(4194304));
+		m_socket->connect(remote_endpoint);
+		m_socket->non_blocking(true);
+
+		const auto self(shared_from_this());
+		asio::post(*m_io_service, [self]()
+			{
+				self->set_receive();
+			});
+
+		std::thread([self]()
+			{
+				self->send_loop();
+			}).detach();
+	}
+
+	void stop()
+	{
+		m_schedule.stop();
+	}
+
+	size_t get_payload_size() const
+	{
+		return m_payload_size;
+	}
+
+	uint64_t get_packets_sent() const
+	{
+		return m_packets_sent.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_send_drops() const
+	{
+		return m_send_drops.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_packets_received() const
+	{
+		return m_packets_received.load(std::memory_order_relaxed);
+	}
+
+	uint64_t get_invalid() const
+	{
+		return m_invalid.load(std::memory_order_relaxed);
+	}
+
+	// Furthest a datagram went out behind its intended time since the last call
+	uint64_t take_max_send_lag_ns()
+	{
+		return m_max_send_lag_ns.exchange(0, std::memory_order_relaxed);
+	}
+
+	// On the io_service thread: add the latencies of the echoes since the last call
+	void take_latencies(latency_histogram& raw, latency_histogram& corrected)
+	{
+		raw.merge(m_raw_latencies);
+		corrected.merge(m_corrected_latencies);
+		m_raw_latencies.reset();
+		m_corrected_latencies.reset();
+	}
+
+private:
+	void send_loop()
+	{
+		token_bucket_pacer::set_precise_timers();
+
+		auto* const data = reinterpret_cast<uint8_t*>(m_send_buffer.data());
+		uint64_t sequence = 0;
+
+		m_schedule.start(arrival_schedule::now_ns());
+		while (m_schedule.wait())
+		{
+			const auto now = arrival_schedule::now_ns();
+
+			size_t count = 0;
+			while (count < send_batch && m_schedule.get_next() <= now)
+			{
+				const schedule_stamp stamp{ sequence++, m_schedule.get_next(), now };
+				stamp.write(data + count * m_payload_size);
+
+				// Only this thread raises the maximum, a load and a store do
+				if (now - stamp.intended_ns > m_max_send_lag_ns.load(std::memory_order_relaxed))
+					m_max_send_lag_ns.store(now - stamp.intended_ns, std::memory_order_relaxed);
+
+				m_schedule.advance();
+				++count;
+			}
+
+			const auto sent = send_datagrams(count);
+			m_packets_sent.fetch_add(sent, std::memory_order_relaxed);
+			m_send_drops.fetch_add(count - sent, std::memory_order_relaxed);
+		}
+	}
+
+	// Datagrams the socket took
+	size_t send_datagrams(const size_t count)
+	{
+		size_t sent = 0;
+
+#if defined(__linux__)
+		for (size_t index = 0; index < count; ++index)
+		{
+			m_send_iovecs[index].iov_base = m_send_buffer.data() + index * m_payload_size;
+			m_send_iovecs[index].iov_len = m_payload_size;
+
+			m_send_headers[index] = {};
+			m_send_headers[index].msg_hdr.msg_iov = &m_send_iovecs[index];
+			m_send_headers[index].msg_hdr.msg_iovlen = 1;
+		}
+
+		const auto result = sendmmsg(m_socket->native_handle(), m_send_headers.data(), static_cast<unsigned>(count), MSG_DONTWAIT);
+		sent = result > 0 ? static_cast<size_t>(result) : 0;
+#else
+		for (size_t index = 0; index < count; ++index)
+		{
+			std::error_code error;
+			m_socket->send(asio::buffer(m_send_buffer.data() + index * m_payload_size, m_payload_size), 0, error);
+
+			if (!error)
+				++sent;
+		}
+#endif
+
+		return sent;
+	}
+
+	void set_receive()
+	{
+		auto self(shared_from_this());
+		m_socket->async_receive(asio::buffer(m_receive_buffer), make_alloc_handler([self](const std::error_code& error, const size_t bytes_transferred)
+			{
+				self->handler_receive(error, bytes_transferred);
+			}));
+	}
+
+	void handler_receive(const std::error_code& error, const size_t bytes_transferred)
+	{
+		// Nothing listening answers with ICMP port unreachable, keep receiving
+		if (error && error != asio::error::connection_refused)
+		{
+			PLOGE << "error value: " << error.value() << " - message: " << error.message();
+			return;
+		}
+
+		if (!error)
+		{
+			const auto now = arrival_schedule::now_ns();
+
+			schedule_stamp stamp;
+			if (stamp.read(reinterpret_cast<const uint8_t*>(m_receive_buffer.data()), bytes_transferred))
+			{
+				m_raw_latencies.record(now - std::min(now, stamp.sent_ns));
+				m_corrected_latencies.record(now - std::min(now, stamp.intended_ns));
+				m_packets_received.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				m_invalid.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		set_receive();
+	}
+
+	std::shared_ptr<asio::io_service> m_io_service;
+	std::shared_ptr<asio::ip::udp::socket> m_socket;
+
+	arrival_schedule m_schedule;
+	size_t m_payload_size;
+
+	std::vector<char> m_send_buffer;
+#if defined(__linux__)
+	std::array<iovec, send_batch> m_send_iovecs{};
+	std::array<mmsghdr, send_batch> m_send_headers{};
+#endif
+	std::vector<char> m_receive_buffer;
+
+	// Owned by the io_service thread
+	latency_histogram m_raw_latencies;
+	latency_histogram m_corrected_latencies;
+
+	std::atomic<uint64_t> m_packets_sent{ 0 };
+	std::atomic<uint64_t> m_send_drops{ 0 };
+	std::atomic<uint64_t> m_packets_received{ 0 };
+	std::atomic<uint64_t> m_invalid{ 0 };
+	std::atomic<uint64_t> m_max_send_lag_ns{ 0 };
+};
+
+// Open-loop workload on one socket. Every second reports the rates and the raw
+// and corrected latency of the echoes of that second, and the end of the run both
+// over the whole run. Raw latency starts when a datagram actually went out,
+// corrected latency at its intended send time, so only the latter counts the
+// time the sending thread fell behind its schedule.
+static void run_open_loop(
+	const asio::ip::udp::endpoint& remote_endpoint,
+	const double rate,
+	const arrival_schedule::arrivals arrivals,
+	const size_t payload_size,
+	const uint32_t duration_seconds,
+	const std::string& histogram_file)
+{
+	const auto generator = std::make_shared<udp_open_loop_generator>(
+		io_service, arrivals, rate, payload_size, std::random_device{}());
+	generator->start(remote_endpoint);
+
+	PLOGI << "started open loop - " << remote_endpoint
+		<< " - rate: " << rate << " pps"
+		<< " - arrivals: " << (arrivals == arrival_schedule::arrivals::poisson ? "poisson" : "constant")
+		<< " - payload size: " << generator->get_payload_size()
+		<< " - duration: " << duration_seconds << " s";
+
+	// Latencies of the echoes since the last call, collected on the io thread
+	const auto take_latencies = [&](latency_histogram& raw, latency_histogram& corrected)
+		{
+			run_on_io_service([&]()
+				{
+					generator->take_latencies(raw, corrected);
+				});
+		};
+
+	latency_histogram raw;
+	latency_histogram corrected;
+	latency_histogram raw_total;
+	latency_histogram corrected_total;
+
+	uint64_t last_sent = 0;
+	uint64_t last_received = 0;
+
+	for (uint32_t second = 1; second <= duration_seconds; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		raw.reset();
+		corrected.reset();
+		take_latencies(raw, corrected);
+
+		const auto sent = generator->get_packets_sent();
+		const auto received = generator->get_packets_received();
+
+		PLOGI << "open loop - sent: " << sent - last_sent << " pps"
+			<< " - echoes: " << received - last_received << " pps"
+			<< " - send drops: " << generator->get_send_drops()
+			<< " - send lag max: " << static_cast<double>(generator->take_max_send_lag_ns()) / 1000.0 << " us";
+		PLOGI << "open loop - raw " << raw.get_summary();
+		PLOGI << "open loop - corrected " << corrected.get_summary();
+
+		raw_total.merge(raw);
+		corrected_total.merge(corrected);
+
+		last_sent = sent;
+		last_received = received;
+	}
+
+	generator->stop();
+
+	// The echoes of the last datagrams get a moment to arrive
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	take_latencies(raw_total, corrected_total);
+
+	const auto sent = generator->get_packets_sent();
+	const auto received = generator->get_packets_received();
+
+	PLOGI << "open loop - sent: " << sent
+		<< " - echoes: " << received
+		<< " - lost: " << sent - std::min(sent, received)
+		<< " - send drops: " << generator->get_send_drops()
+		<< " - invalid: " << generator->get_invalid();
+	PLOGI << "open loop - total raw " << raw_total.get_summary();
+	PLOGI << "open loop - total corrected " << corrected_total.get_summary();
+
+	// The corrected distribution is the one to plot, the raw one goes next to it
+	if (!histogram_file.empty() && (!corrected_total.save(histogram_file) || !raw_total.save(histogram_file + ".raw")))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	const command_line options(argc, argv);
+
+	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
+	init(plog::severityFromString(options.get_string("log_level", "verbose").c_str()), &console_appender);
+
+	PLOGD << "started plog verbose";
+
+	io_service = std::make_shared<asio::io_service>();
+	service_thread(io_service);
+
+	// --paced sends at the rates of the traffic configuration instead of the ping loop
+	if (options.get_bool("paced", false))
+	{
+		traffic_config config;
+		if (!config.load(options.get_string("config", "configs.ini")))
+			return 1;
+
+		if (config.protocol != "UDP")
+		{
+			PLOGW << "configured protocol is " << config.protocol << ", sending UDP";
+		}
+
+		run_paced(config, { asio::ip::make_address(options.get_string("address", config.destination_address)),
+			static_cast<uint16_t>(options.get_uint("port", config.destination_port)) },
+			options.get_uint("rate_period", 10));
+		return 0;
+	}
+
+	// --open_loop sends --rate datagrams per second on a fixed schedule, whatever the echoes do
+	if (options.get_bool("open_loop", false))
+	{
+		auto arrivals = arrival_schedule::arrivals::constant;
+		if (!arrival_schedule::parse(options.get_string("arrivals", "constant"), arrivals))
+		{
+			PLOGE << "invalid --arrivals, expected constant or poisson";
+			return 1;
+		}
+
+		run_open_loop({ asio::ip::make_address(options.get_string("address", "127.0.0.1")),
+			static_cast<uint16_t>(options.get_uint("port", 7172)) },
+			static_cast<double>(options.get_uint("rate", 1000)),
+			arrivals,
+			options.get_uint("payload_size", 64),
+			static_cast<uint32_t>(options.get_uint("duration", 10)),
+			options.get_string("histogram_file", ""));
+		return 0;
+	}
+
+	// --bulk runs the datagram throughput workload instead of the ping loop
+	if (options.get_bool("bulk", false))
+	{
+#if defined(__linux__)
+		bulk_options bulk;
+		bulk.payload_size = options.get_uint("payload_size", bulk.payload_size);
+		bulk.burst = options.get_uint("burst", bulk.burst);
+		bulk.window = options.get_uint("window", bulk.window);
+		bulk.offload = options.get_bool("offload", false);
+		bulk.sequence_window = options.get_uint("sequence_window", bulk.sequence_window);
+
+		// --source_addresses=127.0.0.2-127.0.0.254 spreads the sockets over those
+		// local addresses, --source_ports=20000-60000 binds them to explicit ports
+		source_addresses sources;
+		if (!sources.add_addresses(options.get_string("source_addresses", ""))
+			|| !sources.set_ports(options.get_string("source_ports", "")))
+		{
+			PLOGE << "invalid --source_addresses or --source_ports";
+			return 1;
+		}
+
+		run_bulk({ asio::ip::make_address(options.get_string("address", "127.0.0.1")),
+			static_cast<uint16_t>(options.get_uint("port", 7172)) }, bulk, options.get_uint("sockets", 1), sources);
+#else
+		PLOGE << "bulk mode is only supported on Linux";
+#endif
+		return 0;
+	}
+
+	const auto current_client = std::make_shared<udp_echo_client>(io_service);
+	current_client->set_timestamps(options.get_bool("timestamps", false));
+	PLOGD << "created udp_echo_client class";
+
+	current_client->start();
+
+	const asio::ip::udp::endpoint remote_endpoint(
+		asio::ip::make_address(options.get_string("address", "127.0.0.1")),
+		static_cast<uint16_t>(options.get_uint("port", 7172)));
+
+	const auto buffer = std::string("get_remote_address");
+	current_client->send_packet_to(remote_endpoint, buffer.data(), buffer.size());
+
+	uint64_t last_allocations = 0;
+	uint64_t last_packets = 0;
+	uint64_t last_round_trips = 0;
+	uint64_t last_kernel_ns = 0;
+	uint64_t last_user_ns = 0;
+
+	// --duration=N stops after N seconds with a report over the whole run
+	const auto duration_seconds = options.get_uint("duration", 0);
+
+	latency_histogram latencies;
+	latency_histogram total;
+
+	for (uint64_t second = 1; duration_seconds == 0 || second <= duration_seconds; ++second)
+	{
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		latencies.reset();
+		run_on_io_service([&]()
+			{
+				current_client->take_latencies(latencies);
+			});
+
+		total.merge(latencies);
+
+		if (latencies.get_count() != 0)
+		{
+			PLOGI << "latency - round trips: " << latencies.get_count() << " - " << latencies.get_summary();
+		}
+
+		const auto round_trips = current_client->get_timestamped_round_trips();
+		if (round_trips != last_round_trips)
+		{
+			const auto kernel_ns = current_client->get_kernel_round_trip_ns();
+			const auto user_ns = current_client->get_user_space_ns();
+
+			PLOGI << "timestamps - round trips: " << round_trips - last_round_trips
+				<< " - kernel round trip: " << (kernel_ns - last_kernel_ns) / (round_trips - last_round_trips) << " ns"
+				<< " - user space: " << (user_ns - last_user_ns) / (round_trips - last_round_trips) << " ns";
+
+			last_round_trips = round_trips;
+			last_kernel_ns = kernel_ns;
+			last_user_ns = user_ns;
+		}
+
+		if (!allocation_counter::enabled())
+			continue;
+
+		const auto allocations = allocation_counter::get_allocations();
+		const auto packets = current_client->get_packets();
+
+		PLOGI << "allocations - " << allocations - last_allocations
+			<< " in " << packets - last_packets << " packets";
+
+		last_allocations = allocations;
+		last_packets = packets;
+	}
+
+	PLOGI << "latency - round trips: " << total.get_count() << " - total " << total.get_summary();
+
+	// --histogram_file=latency.hgrm dumps the whole distribution for plotting
+	const auto histogram_file = options.get_string("histogram_file", "");
+	if (!histogram_file.empty() && !total.save(histogram_file))
+	{
+		PLOGE << "cannot write " << histogram_file;
+	}
 
 	PLOGD << "started io_service";
 	return 0;
@@ -1,5 +1,11 @@
 /* ASIO INCLUDES */
 #include <asio.hpp>
+#include <array>
+#include <memory>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
 
 /* PLOG INCLUDES */
 #include <plog/Log.h>
@@ -7,39 +13,429 @@
 #include <plog/Formatters/TxtFormatter.h>
 #include <plog/Appenders/ColorConsoleAppender.h>
 
-static std::shared_ptr<asio::io_service> io_service;
+/* COMMON INCLUDES */
+#include <allocation_counter.hpp>
+#include <command_line.hpp>
+#include <datagram_ring.hpp>
+#include <handler_allocator.hpp>
+#include <io_service_pool.hpp>
+#include <peer_table.hpp>
+#include <receive_queue.hpp>
+#include <socket_options.hpp>
+#include <timestamping.hpp>
+#include <udp_offload.hpp>
+
+static std::shared_ptr<io_service_pool> io_pool;
+
+// Counters owned by one io thread, read by the stats timer
+struct alignas(64) udp_worker_stats
+{
+	std::atomic<uint64_t> packets_received{ 0 };
+	std::atomic<uint64_t> packets_sent{ 0 };
+	std::atomic<uint64_t> bytes_received{ 0 };
+
+	// Datagram system calls: one per receive and per send, or one per recvmmsg and
+	// sendmmsg batch including the call that finds the socket empty
+	std::atomic<uint64_t> socket_calls{ 0 };
+	std::atomic<uint64_t> packets_dropped{ 0 };
+	std::atomic<uint64_t> packets_truncated{ 0 };
+
+	// Async mode datagrams received while the send ring was full
+	std::atomic<uint64_t> ring_overflows{ 0 };
+
+	// Peer table size after the last sweep, peers dropped by the sweeps and
+	// datagrams of peers left out because the table was full
+	std::atomic<uint64_t> peers{ 0 };
+	std::atomic<uint64_t> peers_expired{ 0 };
+	std::atomic<uint64_t> packets_untracked{ 0 };
+
+	// Kernel timestamps: receive timestamp to the echo loop seeing the datagram,
+	// and receive timestamp to transmit timestamp of its echo, in nanoseconds
+	std::atomic<uint64_t> timestamped_receives{ 0 };
+	std::atomic<uint64_t> receive_delay_ns{ 0 };
+	std::atomic<uint64_t> timestamped_sends{ 0 };
+	std::atomic<uint64_t> turnaround_ns{ 0 };
+
+	// Datagrams the kernel dropped at the full receive queue of the socket: the
+	// counter polled with every stats report, and the highest SO_RXQ_OVFL value
+	// carried by a batch receive. Bytes waiting in the queue and its size at the
+	// last poll.
+	std::atomic<uint64_t> kernel_drops{ 0 };
+	std::atomic<uint64_t> overflow_counter{ 0 };
+	std::atomic<uint64_t> receive_queue_bytes{ 0 };
+	std::atomic<uint64_t> receive_buffer_bytes{ 0 };
+
+	// Peers promoted to a connected socket and the datagrams they sent there,
+	// included in the counters above
+	std::atomic<uint64_t> connected_peers{ 0 };
+	std::atomic<uint64_t> connected_packets{ 0 };
+};
+
+struct udp_server_options
+{
+	// Wait for readiness, drain up to batch_size datagrams with one recvmmsg and
+	// echo them all with one sendmmsg instead of one async operation per datagram
+	bool batch{ false };
+	size_t batch_size{ 64 };
+
+	// Receive slot size, longer datagrams are truncated
+	size_t datagram_size{ 65536 };
+
+	// SO_RCVBUF, the kernel doubles it and caps it at net.core.rmem_max
+	size_t receive_buffer_size{ 262144 };
 
-static void service_thread(const std::shared_ptr<asio::io_service>& io_service)
+	// Batch mode with UDP_GRO receives and UDP_SEGMENT echoes: one slot carries
+	// many datagrams of a flow, sent back with the same segment boundaries
+	bool offload{ false };
+
+	// Async mode: datagrams waiting for the socket to accept their echo
+	size_t send_ring{ 256 };
+
+	// Pick the SO_REUSEPORT socket by the receiving CPU instead of the flow hash
+	bool cpu_steering{ false };
+
+	// Batch mode with SO_TIMESTAMPING: measure the time datagrams wait in the
+	// kernel before the echo loop sees them and until their echo leaves
+	bool timestamps{ false };
+
+	// Peers tracked per io thread, 0 disables the peer table. Off by default: every
+	// datagram then pays a hash, a probe and a clock read
+	size_t max_peers{ 0 };
+
+	// Peers silent for longer are dropped by the sweep of every stats report, 0 keeps them
+	uint32_t peer_idle_timeout_seconds{ 60 };
+
+	// Busiest peers listed by every stats report
+	size_t top_peers{ 3 };
+
+	// Promote peers sending more datagrams per second to a connected socket of
+	// their own, 0 disables it; needs the peer table
+	uint64_t connect_above_pps{ 0 };
+
+	// Connected peers per io thread, each one runs its own thread
+	size_t max_connected_peers{ 4 };
+};
+
+// Answer "get_remote_address" in place, returns the datagram size to echo
+static size_t rewrite_remote_address(uint8_t* data, const size_t size, const size_t capacity, const asio::ip::udp::endpoint& endpoint)
 {
-	asio::io_service::work work(*io_service);
+	static constexpr char remote_address_request[] = "get_remote_address";
+	static constexpr size_t remote_address_request_size = sizeof(remote_address_request) - 1;
+
+	if (size != remote_address_request_size || !std::equal(data, data + size, remote_address_request))
+		return size;
+
+	const auto remote_address = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+	const auto copied = std::min(capacity, remote_address.size());
 
-	do
+	std::copy_n(remote_address.begin(), copied, data);
+	return copied;
+}
+
+// Echo path of one heavy peer taken off the shared socket: a socket bound to the
+// same port with SO_REUSEPORT and connected to the peer. The kernel prefers the
+// connected socket for the datagrams of that flow, and its sends skip the route
+// lookup and the address of every send_to. It is served by a thread of its own.
+class connected_peer
+{
+public:
+	// Datagrams drained per readiness event before yielding to the other handlers
+	static constexpr size_t max_receives = 256;
+
+	connected_peer(const asio::ip::udp::endpoint& peer, const udp_server_options& options)
+		: m_peer(peer)
+		, m_options(options)
+		, m_pool(std::make_unique<io_service_pool>(1))
 	{
-		try
+		m_io_service = m_pool->get_io_service(0);
+
+#if defined(__linux__)
+		// Batch mode keeps its batches, without an address per datagram
+		if (m_options.batch)
 		{
-			io_service->run();
-			break;
+			const auto batch_size = std::max<size_t>(1, m_options.batch_size);
+
+			m_buffer.resize(batch_size * m_options.datagram_size);
+			m_batch_iovecs.resize(batch_size);
+			m_batch_headers.resize(batch_size);
+			return;
 		}
-		catch (const std::system_error& ex)
+#endif
+
+		m_buffer.resize(m_options.datagram_size);
+	}
+
+	connected_peer(const connected_peer&) = delete;
+	connected_peer& operator=(const connected_peer&) = delete;
+
+	// The thread uses every member, stop and join it before any of them goes
+	~connected_peer()
+	{
+		m_pool.reset();
+	}
+
+	// Bind next to the shared sockets of local and connect to the peer
+	bool start(const asio::ip::udp::endpoint& local)
+	{
+#if defined(SO_REUSEPORT)
+		std::error_code error;
+		m_socket = std::make_unique<asio::ip::udp::socket>(*m_io_service);
+		m_socket->open(local.protocol(), error);
+		if (!error)
+			m_socket->set_option(reuse_port(true), error);
+		if (!error)
+			m_socket->bind(local, error);
+		if (!error)
+			m_socket->set_option(asio::socket_base::send_buffer_size(262144), error);
+		if (!error)
+			m_socket->set_option(asio::socket_base::receive_buffer_size(static_cast<int>(m_options.receive_buffer_size)), error);
+		if (!error)
+			m_socket->non_blocking(true, error);
+
+		// Connected last, the flow only moves to a socket that is ready for it
+		if (!error)
+			m_socket->connect(m_peer, error);
+
+		// Runs on the promotion timer, the peer stays on the shared socket
+		if (error)
 		{
-			if (ex.code().value() == (10057) /*asio::error::not_connected*/)
-				continue;
+			PLOGW << "cannot connect a socket to " << m_peer << " - message: " << error.message();
+			return false;
+		}
+
+		m_last_seen_ms.store(now_ms(), std::memory_order_relaxed);
+		m_pool->start();
+
+		asio::post(*m_io_service, [this]()
+			{
+				set_receive();
+			});
 
-			break;
+		return true;
+#else
+		(void)local;
+		return false;
+#endif
+	}
+
+	const asio::ip::udp::endpoint& peer() const
+	{
+		return m_peer;
+	}
+
+	uint64_t get_last_seen_ms() const
+	{
+		return m_last_seen_ms.load(std::memory_order_relaxed);
+	}
+
+	udp_worker_stats& stats()
+	{
+		return m_stats;
+	}
+
+	static uint64_t now_ms()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+private:
+	void set_receive()
+	{
+		m_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler([this](const std::error_code& error)
+			{
+				handler_receive(error);
+			}));
+	}
+
+	// Readiness is edge triggered: drain until the socket is empty, or post the
+	// rest so the flow cannot hold the thread forever
+	void handler_receive(const std::error_code& error)
+	{
+		if (error)
+			return;
+
+		for (size_t count = 0; count < max_receives;)
+		{
+#if defined(__linux__)
+			const auto echoed = m_batch_headers.empty() ? echo_datagram() : echo_batch();
+#else
+			const auto echoed = echo_datagram();
+#endif
+			if (echoed == 0)
+			{
+				if (!m_is_failed)
+					set_receive();
+
+				return;
+			}
+
+			if (count == 0)
+				m_last_seen_ms.store(now_ms(), std::memory_order_relaxed);
+
+			count += echoed;
 		}
-	} while (true);
-}
+
+		asio::post(*m_io_service, make_alloc_handler([this]()
+			{
+				handler_receive({});
+			}));
+	}
+
+	// Datagrams echoed, 0 once the socket is empty or failed
+	size_t echo_datagram()
+	{
+		std::error_code error;
+		const auto bytes_transferred = m_socket->receive(asio::buffer(m_buffer), 0, error);
+		m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+		if (error == asio::error::would_block || error == asio::error::try_again)
+			return 0;
+
+		if (error)
+		{
+			PLOGE << "connected peer " << m_peer << " - message: " << error.message();
+			m_is_failed = true;
+			return 0;
+		}
+
+		m_stats.packets_received.fetch_add(1, std::memory_order_relaxed);
+		m_stats.bytes_received.fetch_add(bytes_transferred, std::memory_order_relaxed);
+
+		const auto size = rewrite_remote_address(m_buffer.data(), bytes_transferred, m_buffer.size(), m_peer);
+
+		m_socket->send(asio::buffer(m_buffer.data(), size), 0, error);
+		m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+		if (error)
+		{
+			m_stats.packets_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			m_stats.packets_sent.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		return 1;
+	}
+
+#if defined(__linux__)
+	// One recvmmsg and one sendmmsg, what the send buffer does not take is dropped
+	size_t echo_batch()
+	{
+		const auto fd = m_socket->native_handle();
+
+		for (size_t index = 0; index < m_batch_headers.size(); ++index)
+		{
+			m_batch_iovecs[index].iov_base = m_buffer.data() + index * m_options.datagram_size;
+			m_batch_iovecs[index].iov_len = m_options.datagram_size;
+
+			m_batch_headers[index] = {};
+			m_batch_headers[index].msg_hdr.msg_iov = &m_batch_iovecs[index];
+			m_batch_headers[index].msg_hdr.msg_iovlen = 1;
+		}
+
+		const auto received = recvmmsg(fd, m_batch_headers.data(), static_cast<unsigned>(m_batch_headers.size()), MSG_DONTWAIT, nullptr);
+		m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+		if (received <= 0)
+		{
+			if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				PLOGE << "connected peer " << m_peer << " - recvmmsg error: " << std::strerror(errno);
+				m_is_failed = true;
+			}
+
+			return 0;
+		}
+
+		const auto count = static_cast<size_t>(received);
+		uint64_t bytes = 0;
+
+		for (size_t index = 0; index < count; ++index)
+		{
+			auto& message = m_batch_headers[index];
+			bytes += message.msg_len;
+			m_batch_iovecs[index].iov_len = rewrite_remote_address(static_cast<uint8_t*>(m_batch_iovecs[index].iov_base),
+				message.msg_len, m_options.datagram_size, m_peer);
+		}
+
+		m_stats.packets_received.fetch_add(count, std::memory_order_relaxed);
+		m_stats.bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+
+		size_t sent = 0;
+		while (sent < count)
+		{
+			const auto result = sendmmsg(fd, m_batch_headers.data() + sent, static_cast<unsigned>(count - sent), MSG_DONTWAIT);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				m_stats.packets_dropped.fetch_add(count - sent, std::memory_order_relaxed);
+				break;
+			}
+
+			m_stats.packets_sent.fetch_add(static_cast<uint64_t>(result), std::memory_order_relaxed);
+			sent += static_cast<size_t>(result);
+		}
+
+		return count;
+	}
+#endif
+
+	asio::ip::udp::endpoint m_peer;
+	udp_server_options m_options;
+
+	// The socket closes before the io_service it belongs to
+	std::shared_ptr<asio::io_service> m_io_service;
+	std::unique_ptr<asio::ip::udp::socket> m_socket;
+	std::unique_ptr<io_service_pool> m_pool;
+
+	std::vector<uint8_t> m_buffer;
+	bool m_is_failed{ false };
+	std::atomic<uint64_t> m_last_seen_ms{ 0 };
+
+#if defined(__linux__)
+	std::vector<iovec> m_batch_iovecs;
+	std::vector<mmsghdr> m_batch_headers;
+#endif
+
+	udp_worker_stats m_stats;
+};
+
+// A connected peer with its counters at the last fold into the stats of its io thread
+struct connected_peer_entry
+{
+	std::unique_ptr<connected_peer> peer;
+	uint64_t packets_received{ 0 };
+	uint64_t packets_sent{ 0 };
+	uint64_t bytes_received{ 0 };
+	uint64_t socket_calls{ 0 };
+	uint64_t packets_dropped{ 0 };
+};
 
 class udp_echo_server
 	: public std::enable_shared_from_this<udp_echo_server>
 {
 public:
-	explicit udp_echo_server(std::shared_ptr<asio::io_service> service)
+	// Batches drained per readiness event before yielding to the other handlers
+	static constexpr size_t max_receive_batches = 16;
+
+	udp_echo_server(std::shared_ptr<asio::io_service> service, udp_worker_stats& stats, const udp_server_options& options)
 		: m_io_service(std::move(service)), m_local_port(0)
+		, m_options(options)
+		, m_promote_timer(*m_io_service)
+		, m_stats(stats)
 	{
+		if (m_options.max_peers > 0)
+			m_peers = std::make_unique<peer_table>(m_options.max_peers);
 	}
 
-	void listen(const std::string& address, const uint16_t port)
+	// shared: bind with SO_REUSEPORT next to the sockets of the other io threads
+	void listen(const std::string& address, const uint16_t port, const bool shared = false)
 	{
 		if (m_started)
 			return;
@@ -52,16 +448,89 @@ public:
 		m_local_port = port;
 
 		m_endpoint = std::make_shared<asio::ip::udp::endpoint>(asio::ip::make_address(address), port);
-		m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service, *m_endpoint);
+		m_socket = std::make_shared<asio::ip::udp::socket>(*m_io_service);
+		m_socket->open(m_endpoint->protocol());
+
+#if defined(SO_REUSEPORT)
+		if (shared)
+			m_socket->set_option(reuse_port(true));
+#else
+		if (shared)
+		{
+			PLOGW << "SO_REUSEPORT is not supported, the sockets cannot share the port";
+		}
+#endif
+
+		m_socket->bind(*m_endpoint);
 
 		m_socket->set_option(asio::socket_base::send_buffer_size(262144));
-		m_socket->set_option(asio::socket_base::receive_buffer_size(262144));
+		m_socket->set_option(asio::socket_base::receive_buffer_size(static_cast<int>(m_options.receive_buffer_size)));
+
+		// Sends are attempted inline and only wait for writability on a full buffer
+		m_socket->non_blocking(true);
+
+		if (m_options.connect_above_pps > 0)
+		{
+			if (m_peers)
+			{
+				set_promote_timer();
+			}
+			else
+			{
+				PLOGW << "connected peers need the peer table, not promoting any";
+			}
+		}
 
-		m_receive_buffer.resize(262144);
+#if defined(__linux__)
+		if (m_options.batch)
+		{
+			create_batch_slots();
+
+			if (m_options.offload && !udp_offload::enable_receive(m_socket->native_handle()))
+			{
+				PLOGW << "UDP_GRO is not supported, receiving one datagram per slot";
+				m_options.offload = false;
+			}
+
+			if (m_options.timestamps && !timestamping::enable(m_socket->native_handle()))
+			{
+				PLOGW << "SO_TIMESTAMPING is not supported, running without kernel timestamps";
+				m_options.timestamps = false;
+			}
+
+			if (!receive_queue::enable_overflow_counter(m_socket->native_handle()))
+			{
+				PLOGW << "SO_RXQ_OVFL is not supported, kernel drops are only polled";
+			}
+
+			set_receive_batch();
+			return;
+		}
+#else
+		if (m_options.batch)
+		{
+			PLOGW << "recvmmsg/sendmmsg are not supported, receiving one datagram per operation";
+		}
+#endif
+
+		m_send_ring = std::make_unique<datagram_ring<asio::ip::udp::endpoint>>(
+			std::max<size_t>(1, m_options.send_ring), m_options.datagram_size);
+		m_receive_buffer.resize(m_options.datagram_size);
+
+#if defined(__linux__)
+		// Headers of the sendmmsg that drains the ring
+		m_batch_iovecs.resize(std::max<size_t>(1, m_options.batch_size));
+		m_batch_headers.resize(m_batch_iovecs.size());
+#endif
 
 		set_receive_from();
 	}
 
+	std::shared_ptr<asio::ip::udp::socket> socket()
+	{
+		return m_socket;
+	}
+
 	void terminate()
 	{
 		if (m_is_terminated)
@@ -76,6 +545,8 @@ public:
 		PLOGD << "call terminate downstream - m_is_terminated: " << self->m_is_terminated;
 		try
 		{
+			self->m_promote_timer.cancel();
+			self->m_connected.clear();
 			self->m_socket->close();
 			self->m_socket.reset();
 		}
@@ -85,6 +556,9 @@ public:
 		}
 	}
 
+	// Receive straight into the next free slot of the send ring, so the echo goes
+	// out from where the datagram landed. A full ring receives into the scratch
+	// buffer and the datagram is counted as an overflow.
 	void set_receive_from()
 	{
 		if (m_is_terminated || m_is_receiving)
@@ -94,22 +568,25 @@ public:
 		}
 
 		m_is_receiving = true;
+		m_receive_slot = m_send_ring->reserve();
 
-		std::shared_ptr<asio::ip::udp::endpoint> last_received_endpoint =
-			std::make_shared<asio::ip::udp::endpoint>();
+		auto* data = m_receive_slot ? m_receive_slot->data : m_receive_buffer.data();
+		auto& endpoint = m_receive_slot ? m_receive_slot->endpoint : m_overflow_endpoint;
 
 		auto self(shared_from_this());
-		auto bounded_function = [self, last_received_endpoint](const std::error_code& error, const size_t bytes_transferred)
+		auto bounded_function = [self](const std::error_code& error, const size_t bytes_transferred)
 			{
-				self->handler_receive_from(last_received_endpoint, error, bytes_transferred);
+				self->handler_receive_from(error, bytes_transferred);
 			};
 
-		const auto asio_buffer = asio::buffer(m_receive_buffer.data(), m_receive_buffer.size());
-		m_socket->async_receive_from(asio_buffer, *last_received_endpoint, bounded_function);
+		const auto asio_buffer = asio::buffer(data, m_send_ring->slot_size());
+		m_socket->async_receive_from(asio_buffer, endpoint, make_alloc_handler(bounded_function));
 	}
 
-	void handler_receive_from(const std::shared_ptr<asio::ip::udp::endpoint>& last_received_endpoint, const std::error_code& error, const size_t bytes_transferred)
+	void handler_receive_from(const std::error_code& error, const size_t bytes_transferred)
 	{
+		m_is_receiving = false;
+
 		if (error)
 		{
 			PLOGE << "error value: " << error.value() << " - message: " << error.message();
@@ -117,41 +594,173 @@ public:
 			return;
 		}
 
-		PLOGD << "recv from " << last_received_endpoint->address().to_v4().to_string()
-			<< ":" << last_received_endpoint->port()
+		m_stats.packets_received.fetch_add(1, std::memory_order_relaxed);
+		m_stats.bytes_received.fetch_add(bytes_transferred, std::memory_order_relaxed);
+		m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+		record_peer(m_receive_slot ? m_receive_slot->endpoint : m_overflow_endpoint, 1, bytes_transferred, m_peers ? now_ms() : 0);
+
+		if (!m_receive_slot)
+		{
+			m_stats.ring_overflows.fetch_add(1, std::memory_order_relaxed);
+			set_receive_from();
+			return;
+		}
+
+		PLOGD << "recv from " << m_receive_slot->endpoint.address().to_string()
+			<< ":" << m_receive_slot->endpoint.port()
 			<< " - bytes: " << bytes_transferred;
 
-		send_packet_to(last_received_endpoint, m_receive_buffer.data(), bytes_transferred);
+		m_receive_slot->size = rewrite_remote_address(m_receive_slot->data, bytes_transferred, m_receive_slot->endpoint);
+		m_send_ring->commit();
+		m_receive_slot = nullptr;
 
-		m_is_receiving = false;
+		receive_queued();
+		send_queued();
 		set_receive_from();
 	}
 
-	void send_packet_to(const std::shared_ptr<asio::ip::udp::endpoint>& last_received_endpoint, void* buffer, const size_t size)
+	// The async receive completes with a single datagram: take the ones queued
+	// behind it with non-blocking receives, up to batch_size, so their echoes
+	// leave together
+	void receive_queued()
 	{
-		if (m_is_terminated || m_is_sending)
+		for (size_t count = 1; count < m_options.batch_size && !m_is_terminated; ++count)
 		{
+			auto* slot = m_send_ring->reserve();
+			if (!slot)
+				return;
+
+			std::error_code error;
+			const auto bytes_transferred = m_socket->receive_from(asio::buffer(slot->data, m_send_ring->slot_size()), slot->endpoint, 0, error);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			// Anything else is reported by the next async receive
+			if (error)
+				return;
+
+			m_stats.packets_received.fetch_add(1, std::memory_order_relaxed);
+			m_stats.bytes_received.fetch_add(bytes_transferred, std::memory_order_relaxed);
+
+			record_peer(slot->endpoint, 1, bytes_transferred, m_peers ? now_ms() : 0);
+
+			slot->size = rewrite_remote_address(slot->data, bytes_transferred, slot->endpoint);
+			m_send_ring->commit();
+		}
+	}
+
+	// Echo the queued datagrams until the ring is empty or the socket buffer is
+	// full, then wait for writability instead of dropping the rest
+	void send_queued()
+	{
+		if (m_is_sending)
 			return;
+
+#if defined(__linux__)
+		send_queued_batch();
+#else
+		while (const auto* slot = m_send_ring->front())
+		{
+			if (m_is_terminated)
+				return;
+
+			std::error_code error;
+			const auto bytes_transferred = m_socket->send_to(asio::buffer(slot->data, slot->size), slot->endpoint, 0, error);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			if (error == asio::error::would_block || error == asio::error::try_again)
+			{
+				set_send_ready();
+				return;
+			}
+
+			if (error)
+			{
+				PLOGE << "code: " << error.value() << " - message: " << error.message();
+				m_stats.packets_dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				PLOGD << "send packet to " << slot->endpoint.address().to_string()
+					<< ":" << slot->endpoint.port()
+					<< " - bytes: " << bytes_transferred;
+
+				m_stats.packets_sent.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			m_send_ring->pop();
+		}
+#endif
+	}
+
+#if defined(__linux__)
+	// One sendmmsg for up to batch_size queued datagrams, straight from their slots
+	void send_queued_batch()
+	{
+		while (!m_send_ring->empty() && !m_is_terminated)
+		{
+			size_t count = 0;
+			for (; count < m_batch_headers.size(); ++count)
+			{
+				auto* slot = m_send_ring->at(count);
+				if (!slot)
+					break;
+
+				m_batch_iovecs[count] = { slot->data, slot->size };
+
+				m_batch_headers[count] = {};
+				m_batch_headers[count].msg_hdr.msg_name = slot->endpoint.data();
+				m_batch_headers[count].msg_hdr.msg_namelen = static_cast<socklen_t>(slot->endpoint.size());
+				m_batch_headers[count].msg_hdr.msg_iov = &m_batch_iovecs[count];
+				m_batch_headers[count].msg_hdr.msg_iovlen = 1;
+			}
+
+			const auto result = sendmmsg(m_socket->native_handle(), m_batch_headers.data(), static_cast<unsigned>(count), MSG_DONTWAIT);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					set_send_ready();
+					return;
+				}
+
+				// Only the first datagram failed, the rest go with the next call
+				PLOGE << "sendmmsg error: " << std::strerror(errno);
+				m_stats.packets_dropped.fetch_add(1, std::memory_order_relaxed);
+				m_send_ring->pop();
+				continue;
+			}
+
+			PLOGD << "sent " << result << " queued datagrams";
+
+			m_stats.packets_sent.fetch_add(static_cast<uint64_t>(result), std::memory_order_relaxed);
+			m_send_ring->pop(static_cast<size_t>(result));
 		}
+	}
+#endif
 
+	void set_send_ready()
+	{
 		m_is_sending = true;
 
 		auto self(shared_from_this());
-		auto bounded_function = [self, last_received_endpoint](const std::error_code& error, const size_t bytes_transferred)
+		auto bounded_function = [self](const std::error_code& error)
 			{
-				self->handler_send_packet_to(last_received_endpoint, error, bytes_transferred);
+				self->handler_send_ready(error);
 			};
 
-		std::string data_buffer = std::string((char*)buffer, size);
-		if (data_buffer == "get_remote_address")
-			data_buffer = last_received_endpoint->address().to_v4().to_string() + ":" + std::to_string(last_received_endpoint->port());
-
-		const auto asio_buffer = asio::buffer(data_buffer.data(), data_buffer.size());
-		m_socket->async_send_to(asio_buffer, *last_received_endpoint, bounded_function);
+		m_socket->async_wait(asio::socket_base::wait_write, make_alloc_handler(bounded_function));
 	}
 
-	void handler_send_packet_to(const std::shared_ptr<asio::ip::udp::endpoint>& last_received_endpoint, const std::error_code& error, size_t bytes_transferred)
+	void handler_send_ready(const std::error_code& error)
 	{
+		m_is_sending = false;
+
 		if (error)
 		{
 			PLOGE << "code: " << error.value() << " - message: " << error.message();
@@ -159,13 +768,408 @@ public:
 			return;
 		}
 
-		PLOGD << "send packet to " << last_received_endpoint->address().to_v4().to_string()
-			<< ":" << last_received_endpoint->port()
-			<< " - bytes: " << bytes_transferred;
+		send_queued();
+	}
 
-		m_is_sending = false;
+	void set_promote_timer()
+	{
+		auto self(shared_from_this());
+		m_promote_timer.expires_after(std::chrono::seconds(1));
+		m_promote_timer.async_wait([self](const std::error_code& error)
+			{
+				self->handler_promote_timer(error);
+			});
 	}
 
+	// Once a second: fold the counters of the connected peers into the stats of
+	// this thread, close the idle ones and promote the peers above the rate
+	void handler_promote_timer(const std::error_code& error)
+	{
+		if (error || m_is_terminated)
+			return;
+
+		const auto now = connected_peer::now_ms();
+		const auto idle_timeout_ms = uint64_t{ m_options.peer_idle_timeout_seconds } * 1000;
+
+		for (auto iterator = m_connected.begin(); iterator != m_connected.end();)
+		{
+			fold_connected_stats(*iterator);
+
+			if (idle_timeout_ms > 0 && now - iterator->peer->get_last_seen_ms() > idle_timeout_ms)
+			{
+				PLOGI << "connected peer " << iterator->peer->peer() << " idle, back on the shared socket";
+				iterator = m_connected.erase(iterator);
+				continue;
+			}
+
+			++iterator;
+		}
+
+		for (const auto& endpoint : m_peers->take_heavy(m_options.connect_above_pps))
+		{
+			if (m_connected.size() >= m_options.max_connected_peers)
+				break;
+
+			const auto connected = std::any_of(m_connected.begin(), m_connected.end(), [&endpoint](const connected_peer_entry& entry)
+				{
+					return entry.peer->peer() == endpoint;
+				});
+
+			if (connected)
+				continue;
+
+			auto peer = std::make_unique<connected_peer>(endpoint, m_options);
+			if (!peer->start(*m_endpoint))
+				continue;
+
+			PLOGI << "peer " << endpoint << " above " << m_options.connect_above_pps << " pps, promoted to a connected socket";
+
+			connected_peer_entry entry;
+			entry.peer = std::move(peer);
+			m_connected.push_back(std::move(entry));
+		}
+
+		m_stats.connected_peers.store(m_connected.size(), std::memory_order_relaxed);
+		set_promote_timer();
+	}
+
+	// Poll the receive queue of the socket, runs on the thread of the server
+	void report_socket()
+	{
+#if defined(__linux__)
+		if (m_is_terminated || !m_socket)
+			return;
+
+		receive_queue::state queue;
+		if (!receive_queue::read(m_socket->native_handle(), queue))
+			return;
+
+		m_stats.kernel_drops.store(queue.drops, std::memory_order_relaxed);
+		m_stats.receive_queue_bytes.store(queue.queued_bytes, std::memory_order_relaxed);
+		m_stats.receive_buffer_bytes.store(queue.buffer_bytes, std::memory_order_relaxed);
+#endif
+	}
+
+	// Sweep the idle peers and list the busiest ones, runs on the thread of the server
+	void report_peers(const size_t worker)
+	{
+		if (!m_peers)
+			return;
+
+		const auto now = now_ms();
+
+		if (m_options.peer_idle_timeout_seconds > 0)
+		{
+			const auto expired = m_peers->sweep(now, uint64_t{ m_options.peer_idle_timeout_seconds } * 1000);
+			m_stats.peers_expired.fetch_add(expired, std::memory_order_relaxed);
+		}
+
+		m_stats.peers.store(m_peers->size(), std::memory_order_relaxed);
+		m_stats.packets_untracked.store(m_peers->untracked_packets(), std::memory_order_relaxed);
+
+		if (m_peers->size() == 0)
+			return;
+
+		PLOGI << "worker " << worker
+			<< " - peers: " << m_peers->size()
+			<< " - untracked packets: " << m_peers->untracked_packets()
+			<< " - peer table: " << m_peers->memory_bytes() << " bytes";
+
+		size_t rank = 0;
+		for (const auto& peer : m_peers->top(m_options.top_peers, now))
+		{
+			PLOGI << "worker " << worker << " - top " << ++rank << ": " << peer.endpoint
+				<< " - packets: " << peer.packets
+				<< " - bytes: " << peer.bytes
+				<< " - idle: " << peer.idle_ms << " ms";
+		}
+	}
+
+	static uint64_t now_ms()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void record_peer(const asio::ip::udp::endpoint& endpoint, const uint64_t packets, const uint64_t bytes, const uint64_t now)
+	{
+		if (m_peers)
+			m_peers->record(endpoint, packets, bytes, now);
+	}
+
+	// A connected peer counts on its own thread, this thread adds what changed
+	void fold_connected_stats(connected_peer_entry& entry)
+	{
+		const auto fold = [](const std::atomic<uint64_t>& counter, uint64_t& last, std::atomic<uint64_t>& total)
+			{
+				const auto value = counter.load(std::memory_order_relaxed);
+				total.fetch_add(value - last, std::memory_order_relaxed);
+				last = value;
+			};
+
+		const auto& stats = entry.peer->stats();
+		const auto last_received = entry.packets_received;
+
+		fold(stats.packets_received, entry.packets_received, m_stats.packets_received);
+		fold(stats.packets_sent, entry.packets_sent, m_stats.packets_sent);
+		fold(stats.bytes_received, entry.bytes_received, m_stats.bytes_received);
+		fold(stats.socket_calls, entry.socket_calls, m_stats.socket_calls);
+		fold(stats.packets_dropped, entry.packets_dropped, m_stats.packets_dropped);
+
+		m_stats.connected_packets.fetch_add(entry.packets_received - last_received, std::memory_order_relaxed);
+	}
+
+	size_t rewrite_remote_address(uint8_t* data, const size_t size, const asio::ip::udp::endpoint& endpoint) const
+	{
+		return ::rewrite_remote_address(data, size, m_options.datagram_size, endpoint);
+	}
+
+#if defined(__linux__)
+	// One receive slot per batch entry, every header points at its own buffer
+	// and address so recvmmsg fills them in place and sendmmsg reuses them
+	void create_batch_slots()
+	{
+		const auto batch_size = std::max<size_t>(1, m_options.batch_size);
+
+		// Pages are only touched once a datagram of that size arrives
+		m_batch_buffers.reset(new uint8_t[batch_size * m_options.datagram_size]);
+		m_batch_addresses.resize(batch_size);
+		m_batch_iovecs.resize(batch_size);
+		m_batch_headers.resize(batch_size);
+		m_batch_controls.resize(batch_size);
+		m_batch_segments.resize(batch_size);
+		m_batch_receive_times.resize(batch_size);
+	}
+
+	void reset_batch_slots(const size_t count)
+	{
+		for (size_t index = 0; index < count; ++index)
+		{
+			m_batch_iovecs[index].iov_base = m_batch_buffers.get() + index * m_options.datagram_size;
+			m_batch_iovecs[index].iov_len = m_options.datagram_size;
+
+			auto& header = m_batch_headers[index].msg_hdr;
+			header = {};
+			header.msg_name = &m_batch_addresses[index];
+			header.msg_namelen = sizeof(m_batch_addresses[index]);
+			header.msg_iov = &m_batch_iovecs[index];
+			header.msg_iovlen = 1;
+			header.msg_control = m_batch_controls[index].data;
+			header.msg_controllen = sizeof(m_batch_controls[index].data);
+		}
+	}
+
+	void set_receive_batch()
+	{
+		if (m_is_terminated || m_is_receiving)
+		{
+			PLOGI << "m_is_terminated: " << m_is_terminated << " - m_is_receiving: " << m_is_receiving;
+			return;
+		}
+
+		m_is_receiving = true;
+
+		auto self(shared_from_this());
+		auto bounded_function = [self](const std::error_code& error)
+			{
+				self->handler_receive_batch(error);
+			};
+
+		m_socket->async_wait(asio::socket_base::wait_read, make_alloc_handler(bounded_function));
+	}
+
+	void handler_receive_batch(const std::error_code& error)
+	{
+		m_is_receiving = false;
+
+		if (error)
+		{
+			PLOGE << "error value: " << error.value() << " - message: " << error.message();
+			terminate();
+			return;
+		}
+
+		receive_batches();
+	}
+
+	// Readiness is edge triggered: drain until recvmmsg would block, or post the
+	// rest so a flood on this socket cannot starve the other handlers
+	void receive_batches()
+	{
+		for (size_t batch = 0; batch < max_receive_batches; ++batch)
+		{
+			if (m_is_terminated)
+				return;
+
+			reset_batch_slots(m_batch_headers.size());
+
+			const auto received = recvmmsg(m_socket->native_handle(), m_batch_headers.data(),
+				static_cast<unsigned>(m_batch_headers.size()), MSG_DONTWAIT, nullptr);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			if (received < 0)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				{
+					set_receive_batch();
+					return;
+				}
+
+				PLOGE << "recvmmsg error: " << std::strerror(errno);
+				terminate();
+				return;
+			}
+
+			send_batch(static_cast<size_t>(received));
+		}
+
+		auto self(shared_from_this());
+		asio::post(*m_io_service, make_alloc_handler([self]()
+			{
+				self->receive_batches();
+			}));
+	}
+
+	// Echo every received datagram to its sender with as few sendmmsg calls as the
+	// socket buffer allows, what does not fit is dropped like any UDP overflow
+	void send_batch(const size_t count)
+	{
+		uint64_t datagrams = 0;
+		uint64_t bytes = 0;
+
+		const auto now = m_peers ? now_ms() : 0;
+		const auto now_ns = m_options.timestamps ? timestamping::now_ns() : 0;
+		uint64_t receive_delay = 0;
+
+		// The counter only grows, the last datagram carries the latest value
+		const auto overflow_counter = count > 0 ? receive_queue::get_overflow_counter(m_batch_headers[count - 1].msg_hdr) : 0;
+		if (overflow_counter > m_stats.overflow_counter.load(std::memory_order_relaxed))
+			m_stats.overflow_counter.store(overflow_counter, std::memory_order_relaxed);
+
+		for (size_t index = 0; index < count; ++index)
+		{
+			auto& message = m_batch_headers[index];
+			if (message.msg_hdr.msg_flags & MSG_TRUNC)
+				m_stats.packets_truncated.fetch_add(1, std::memory_order_relaxed);
+
+			// Read before the control area is reused for the send
+			if (m_options.timestamps)
+			{
+				m_batch_receive_times[index] = timestamping::get_receive_time(message.msg_hdr);
+				if (m_batch_receive_times[index] != 0 && now_ns > m_batch_receive_times[index])
+					receive_delay += now_ns - m_batch_receive_times[index];
+			}
+
+			// A coalesced receive goes back out split at the same segment size
+			const auto segment_size = m_options.offload ? udp_offload::get_segment_size(message.msg_hdr) : 0;
+			const auto size = segment_size > 0 && message.msg_len > segment_size
+				? message.msg_len
+				: rewrite_remote_address(message.msg_hdr, message.msg_len);
+
+			m_batch_iovecs[index].iov_len = size;
+			m_batch_segments[index] = udp_offload::get_segments(message.msg_len, segment_size);
+			udp_offload::set_segment_size(message.msg_hdr, m_batch_controls[index], size, segment_size);
+			message.msg_hdr.msg_flags = 0;
+
+			datagrams += m_batch_segments[index];
+			bytes += message.msg_len;
+
+			if (m_peers)
+				m_peers->record(get_endpoint(message.msg_hdr), m_batch_segments[index], message.msg_len, now);
+		}
+
+		m_stats.packets_received.fetch_add(datagrams, std::memory_order_relaxed);
+		m_stats.bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+
+		if (m_options.timestamps)
+		{
+			m_stats.timestamped_receives.fetch_add(count, std::memory_order_relaxed);
+			m_stats.receive_delay_ns.fetch_add(receive_delay, std::memory_order_relaxed);
+		}
+
+		size_t sent = 0;
+		while (sent < count)
+		{
+			const auto result = sendmmsg(m_socket->native_handle(), m_batch_headers.data() + sent,
+				static_cast<unsigned>(count - sent), MSG_DONTWAIT);
+			m_stats.socket_calls.fetch_add(1, std::memory_order_relaxed);
+
+			if (result < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					PLOGE << "sendmmsg error: " << std::strerror(errno);
+				}
+
+				m_stats.packets_dropped.fetch_add(count_segments(sent, count), std::memory_order_relaxed);
+				break;
+			}
+
+			m_stats.packets_sent.fetch_add(count_segments(sent, sent + static_cast<size_t>(result)), std::memory_order_relaxed);
+
+			// Every message sent takes the next OPT_ID of the socket
+			if (m_options.timestamps)
+			{
+				for (size_t index = sent; index < sent + static_cast<size_t>(result); ++index)
+					m_transmit_receive_times[m_transmit_id++ & (transmit_ids - 1)] = m_batch_receive_times[index];
+			}
+
+			sent += static_cast<size_t>(result);
+		}
+
+		if (m_options.timestamps)
+			read_transmit_times();
+	}
+
+	// Match the transmit timestamps of the echoes with the receive timestamps of
+	// their datagrams
+	void read_transmit_times()
+	{
+		uint64_t sends = 0;
+		uint64_t turnaround = 0;
+
+		uint32_t id = 0;
+		uint64_t transmit_time = 0;
+		while (timestamping::read_transmit_time(m_socket->native_handle(), id, transmit_time))
+		{
+			const auto receive_time = m_transmit_receive_times[id & (transmit_ids - 1)];
+			if (receive_time == 0 || transmit_time < receive_time)
+				continue;
+
+			++sends;
+			turnaround += transmit_time - receive_time;
+		}
+
+		m_stats.timestamped_sends.fetch_add(sends, std::memory_order_relaxed);
+		m_stats.turnaround_ns.fetch_add(turnaround, std::memory_order_relaxed);
+	}
+
+	uint64_t count_segments(const size_t first, const size_t last) const
+	{
+		uint64_t segments = 0;
+		for (size_t index = first; index < last; ++index)
+			segments += m_batch_segments[index];
+
+		return segments;
+	}
+
+	size_t rewrite_remote_address(const msghdr& header, const size_t size) const
+	{
+		return rewrite_remote_address(static_cast<uint8_t*>(header.msg_iov->iov_base), size, get_endpoint(header));
+	}
+
+	static asio::ip::udp::endpoint get_endpoint(const msghdr& header)
+	{
+		asio::ip::udp::endpoint endpoint;
+		std::memcpy(endpoint.data(), header.msg_name, std::min<size_t>(header.msg_namelen, endpoint.capacity()));
+		endpoint.resize(std::min<size_t>(header.msg_namelen, endpoint.capacity()));
+		return endpoint;
+	}
+#endif
+
 private:
 	std::shared_ptr<asio::ip::udp::endpoint> m_endpoint;
 	std::shared_ptr<asio::ip::udp::socket> m_socket;
@@ -175,30 +1179,331 @@ private:
 	std::string m_local_address;
 	uint16_t m_local_port;
 
+	udp_server_options m_options;
+
 	std::atomic<bool> m_started{ false };
 	std::atomic<bool> m_is_sending{ false };
 	std::atomic<bool> m_is_receiving{ false };
 	std::atomic<bool> m_is_terminated{ false };
 
+	// Async mode: received datagrams wait here until the socket takes them
+	std::unique_ptr<datagram_ring<asio::ip::udp::endpoint>> m_send_ring;
+	datagram_ring<asio::ip::udp::endpoint>::slot* m_receive_slot{ nullptr };
+
+	// Peers seen by this socket, owned by the io thread
+	std::unique_ptr<peer_table> m_peers;
+
+	// Heavy peers served by a connected socket
+	std::vector<connected_peer_entry> m_connected;
+	asio::steady_timer m_promote_timer;
+
+	// Landing place of the datagrams that find the ring full
 	std::vector<uint8_t> m_receive_buffer;
+	asio::ip::udp::endpoint m_overflow_endpoint;
+
+#if defined(__linux__)
+	std::unique_ptr<uint8_t[]> m_batch_buffers;
+	std::vector<sockaddr_storage> m_batch_addresses;
+	std::vector<iovec> m_batch_iovecs;
+	std::vector<mmsghdr> m_batch_headers;
+	std::vector<udp_control_buffer> m_batch_controls;
+
+	// Datagrams carried by every slot of the current batch
+	std::vector<size_t> m_batch_segments;
+
+	// Receive timestamps of the current batch and of the echoes whose transmit
+	// timestamp is still due, by OPT_ID
+	static constexpr size_t transmit_ids = 4096;
+	std::vector<uint64_t> m_batch_receive_times;
+	std::array<uint64_t, transmit_ids> m_transmit_receive_times{};
+	uint32_t m_transmit_id{ 0 };
+#endif
+
+	udp_worker_stats& m_stats;
+};
+
+// One udp_echo_server per io thread. With more than one thread every socket binds
+// the port with SO_REUSEPORT and the kernel hashes the client flows across them,
+// so each thread serves its own flows with its own buffers and counters.
+class udp_server_pool
+	: public std::enable_shared_from_this<udp_server_pool>
+{
+public:
+	udp_server_pool(std::shared_ptr<io_service_pool> pool, const udp_server_options& options, const uint32_t stats_interval_seconds)
+		: m_io_pool(std::move(pool))
+		, m_options(options)
+		, m_stats_timer(*m_io_pool->get_io_service(0))
+		, m_stats_interval_seconds(stats_interval_seconds)
+		, m_worker_stats(m_io_pool->size())
+		, m_last_worker_packets(m_io_pool->size())
+	{
+	}
+
+	void listen(const std::string& address, const uint16_t port)
+	{
+		// Connected peers join the port next to the sockets of the pool
+		const bool shared = m_io_pool->size() > 1 || m_options.connect_above_pps > 0;
+
+		for (size_t index = 0; index < m_io_pool->size(); ++index)
+		{
+			const auto server = std::make_shared<udp_echo_server>(
+				m_io_pool->get_io_service(index), m_worker_stats[index], m_options);
+
+			server->listen(address, port, shared);
+			m_servers.push_back(server);
+		}
+
+		// The program belongs to the whole group, any socket can carry it
+		if (m_options.cpu_steering && shared)
+		{
+			if (attach_reuseport_cpu_steering(m_servers.front()->socket()->native_handle(), m_servers.size()))
+			{
+				PLOGI << "reuseport cpu steering attached - sockets: " << m_servers.size();
+			}
+			else
+			{
+				PLOGW << "reuseport cpu steering is not supported, using the flow hash";
+			}
+		}
+
+		set_stats_timer();
+	}
+
+	void set_stats_timer()
+	{
+		if (m_stats_interval_seconds == 0)
+			return;
+
+		auto self(shared_from_this());
+		m_stats_timer.expires_after(std::chrono::seconds(m_stats_interval_seconds));
+		m_stats_timer.async_wait([self](const std::error_code& error)
+			{
+				self->handler_stats_timer(error);
+			});
+	}
+
+	void handler_stats_timer(const std::error_code& error)
+	{
+		if (error)
+			return;
+
+		uint64_t packets_received = 0;
+		uint64_t packets_sent = 0;
+		uint64_t bytes_received = 0;
+		uint64_t socket_calls = 0;
+		uint64_t packets_dropped = 0;
+		uint64_t packets_truncated = 0;
+		uint64_t ring_overflows = 0;
+		uint64_t peers = 0;
+		uint64_t peers_expired = 0;
+		uint64_t packets_untracked = 0;
+		uint64_t timestamped_receives = 0;
+		uint64_t receive_delay_ns = 0;
+		uint64_t timestamped_sends = 0;
+		uint64_t turnaround_ns = 0;
+		uint64_t kernel_drops = 0;
+		uint64_t overflow_counter = 0;
+		uint64_t receive_queue_bytes = 0;
+		uint64_t receive_buffer_bytes = 0;
+		uint64_t connected_peers = 0;
+		uint64_t connected_packets = 0;
+
+		for (size_t index = 0; index < m_worker_stats.size(); ++index)
+		{
+			const auto& stats = m_worker_stats[index];
+			auto& last = m_last_worker_packets[index];
+
+			const auto worker_packets = stats.packets_received.load(std::memory_order_relaxed);
+			const auto worker_drops = stats.kernel_drops.load(std::memory_order_relaxed);
+
+			if (m_worker_stats.size() > 1)
+			{
+				PLOGI << "worker " << index
+					<< " - packets received: " << (worker_packets - last) / m_stats_interval_seconds << " pps"
+					<< " - total: " << worker_packets
+					<< " - kernel drops: " << worker_drops;
+			}
+
+			last = worker_packets;
+
+			packets_received += worker_packets;
+			packets_sent += stats.packets_sent.load(std::memory_order_relaxed);
+			bytes_received += stats.bytes_received.load(std::memory_order_relaxed);
+			socket_calls += stats.socket_calls.load(std::memory_order_relaxed);
+			packets_dropped += stats.packets_dropped.load(std::memory_order_relaxed);
+			packets_truncated += stats.packets_truncated.load(std::memory_order_relaxed);
+			ring_overflows += stats.ring_overflows.load(std::memory_order_relaxed);
+			peers += stats.peers.load(std::memory_order_relaxed);
+			peers_expired += stats.peers_expired.load(std::memory_order_relaxed);
+			packets_untracked += stats.packets_untracked.load(std::memory_order_relaxed);
+			timestamped_receives += stats.timestamped_receives.load(std::memory_order_relaxed);
+			receive_delay_ns += stats.receive_delay_ns.load(std::memory_order_relaxed);
+			timestamped_sends += stats.timestamped_sends.load(std::memory_order_relaxed);
+			turnaround_ns += stats.turnaround_ns.load(std::memory_order_relaxed);
+			kernel_drops += worker_drops;
+			overflow_counter += stats.overflow_counter.load(std::memory_order_relaxed);
+			receive_queue_bytes += stats.receive_queue_bytes.load(std::memory_order_relaxed);
+			receive_buffer_bytes += stats.receive_buffer_bytes.load(std::memory_order_relaxed);
+			connected_peers += stats.connected_peers.load(std::memory_order_relaxed);
+			connected_packets += stats.connected_packets.load(std::memory_order_relaxed);
+
+			// The peer table and the socket belong to the server thread, so do their
+			// reports; the kernel counters show up in the next report
+			const auto server = m_servers[index];
+			asio::post(*m_io_pool->get_io_service(index), [server, index]()
+				{
+					server->report_socket();
+					server->report_peers(index);
+				});
+		}
+
+		PLOGI << "packets received: " << (packets_received - m_last_packets_received) / m_stats_interval_seconds << " pps"
+			<< " - " << (bytes_received - m_last_bytes_received) / m_stats_interval_seconds << " bytes/s"
+			<< " - packets sent: " << (packets_sent - m_last_packets_sent) / m_stats_interval_seconds << " pps"
+			<< " - socket calls per packet: " << static_cast<double>(socket_calls - m_last_socket_calls)
+				/ std::max<uint64_t>(1, packets_received - m_last_packets_received)
+			<< " - dropped: " << packets_dropped
+			<< " - truncated: " << packets_truncated
+			<< " - ring overflows: " << ring_overflows
+			<< " - peers: " << peers
+			<< " - expired peers: " << peers_expired
+			<< " - untracked packets: " << packets_untracked;
+
+		// Where the datagrams were lost: at the full receive queue in the kernel,
+		// at the full send buffer, or at the full send ring of the application
+		PLOGI << "losses - kernel receive queue: " << (kernel_drops - m_last_kernel_drops) / m_stats_interval_seconds << "/s"
+			<< " - total: " << kernel_drops
+			<< " - SO_RXQ_OVFL: " << overflow_counter
+			<< " - send buffer: " << (packets_dropped - m_last_packets_dropped) / m_stats_interval_seconds << "/s"
+			<< " - ring overflows: " << (ring_overflows - m_last_ring_overflows) / m_stats_interval_seconds << "/s"
+			<< " - receive queue: " << receive_queue_bytes << " of " << receive_buffer_bytes << " bytes";
+
+		if (m_options.connect_above_pps > 0)
+		{
+			PLOGI << "connected peers: " << connected_peers
+				<< " - packets received on connected sockets: " << (connected_packets - m_last_connected_packets) / m_stats_interval_seconds << " pps";
+
+			m_last_connected_packets = connected_packets;
+		}
+
+		m_last_socket_calls = socket_calls;
+		m_last_bytes_received = bytes_received;
+		m_last_kernel_drops = kernel_drops;
+		m_last_packets_dropped = packets_dropped;
+		m_last_ring_overflows = ring_overflows;
+
+		if (m_options.timestamps)
+		{
+			PLOGI << "timestamps - kernel to user: "
+				<< (receive_delay_ns - m_last_receive_delay_ns) / std::max<uint64_t>(1, timestamped_receives - m_last_timestamped_receives) << " ns"
+				<< " - receive to transmit: "
+				<< (turnaround_ns - m_last_turnaround_ns) / std::max<uint64_t>(1, timestamped_sends - m_last_timestamped_sends) << " ns"
+				<< " - timestamped sends: " << timestamped_sends - m_last_timestamped_sends;
+
+			m_last_timestamped_receives = timestamped_receives;
+			m_last_receive_delay_ns = receive_delay_ns;
+			m_last_timestamped_sends = timestamped_sends;
+			m_last_turnaround_ns = turnaround_ns;
+		}
+
+		if (allocation_counter::enabled())
+		{
+			const auto allocations = allocation_counter::get_allocations();
+			const auto packets = packets_received - m_last_packets_received;
+
+			PLOGI << "allocations - " << allocations - m_last_allocations
+				<< " in " << packets << " packets"
+				<< " - per packet: " << static_cast<double>(allocations - m_last_allocations) / std::max<uint64_t>(1, packets);
+
+			m_last_allocations = allocations;
+		}
+
+		m_last_packets_received = packets_received;
+		m_last_packets_sent = packets_sent;
+
+		set_stats_timer();
+	}
+
+private:
+	std::shared_ptr<io_service_pool> m_io_pool;
+	udp_server_options m_options;
+
+	std::vector<std::shared_ptr<udp_echo_server>> m_servers;
+
+	asio::steady_timer m_stats_timer;
+	uint32_t m_stats_interval_seconds;
+
+	std::vector<udp_worker_stats> m_worker_stats;
+	std::vector<uint64_t> m_last_worker_packets;
+	uint64_t m_last_packets_received{ 0 };
+	uint64_t m_last_packets_sent{ 0 };
+	uint64_t m_last_socket_calls{ 0 };
+	uint64_t m_last_bytes_received{ 0 };
+	uint64_t m_last_allocations{ 0 };
+	uint64_t m_last_timestamped_receives{ 0 };
+	uint64_t m_last_receive_delay_ns{ 0 };
+	uint64_t m_last_timestamped_sends{ 0 };
+	uint64_t m_last_turnaround_ns{ 0 };
+	uint64_t m_last_kernel_drops{ 0 };
+	uint64_t m_last_packets_dropped{ 0 };
+	uint64_t m_last_ring_overflows{ 0 };
+	uint64_t m_last_connected_packets{ 0 };
 };
 
-int main()
+int main(int argc, char* argv[])
 {
+	const command_line options(argc, argv);
+
 	static plog::ColorConsoleAppender<plog::TxtFormatter> console_appender;
-	init(plog::verbose, &console_appender);
+	init(plog::severityFromString(options.get_string("log_level", "verbose").c_str()), &console_appender);
 
 	PLOGD << "started plog verbose";
 
-	io_service = std::make_shared<asio::io_service>();
+	// One socket and io thread by default, --threads=N binds N sockets with SO_REUSEPORT
+	io_pool = std::make_shared<io_service_pool>(options.get_uint("threads", 1));
+
+	udp_server_options server_options;
+	server_options.batch = options.get_string("receive_mode", "async") == "batch";
+	server_options.batch_size = options.get_uint("batch_size", server_options.batch_size);
+	server_options.datagram_size = std::max<size_t>(1, options.get_uint("datagram_size", server_options.datagram_size));
+	server_options.send_ring = options.get_uint("send_ring", server_options.send_ring);
+	server_options.receive_buffer_size = std::max<size_t>(1, options.get_uint("receive_buffer", server_options.receive_buffer_size));
+	server_options.offload = options.get_bool("offload", false);
+	server_options.cpu_steering = options.get_string("steering", "hash") == "cpu";
+	server_options.timestamps = options.get_bool("timestamps", false);
+	server_options.max_peers = options.get_uint("max_peers", server_options.max_peers);
+	server_options.peer_idle_timeout_seconds = static_cast<uint32_t>(
+		options.get_uint("peer_idle_timeout", server_options.peer_idle_timeout_seconds));
+	server_options.top_peers = options.get_uint("top_peers", server_options.top_peers);
+	server_options.connect_above_pps = options.get_uint("connect_above", server_options.connect_above_pps);
+	server_options.max_connected_peers = options.get_uint("max_connected_peers", server_options.max_connected_peers);
+
+	// CPU steering only pays off when socket i is served on CPU i
+	io_pool->set_pin_threads(options.get_bool("pin_threads", server_options.cpu_steering));
+
+#if defined(__linux__)
+	// Offload needs the batch slots, and slots that fit a whole coalesced receive
+	if (server_options.offload)
+	{
+		server_options.batch = true;
+		server_options.datagram_size = std::max(server_options.datagram_size, udp_offload::max_buffer_size);
+	}
+
+	// The receive timestamps arrive as control messages, only recvmmsg sees them
+	if (server_options.timestamps)
+		server_options.batch = true;
+#endif
+
+	const auto current_server = std::make_shared<udp_server_pool>(io_pool, server_options,
+		static_cast<uint32_t>(options.get_uint("stats_interval", 5)));
+	PLOGD << "created udp_server_pool class";
 
-	const auto current_server = std::make_shared<udp_echo_server>(io_service);
-	PLOGD << "created udp_echo_server class";
+	current_server->listen(options.get_string("address", "0.0.0.0"),
+		static_cast<uint16_t>(options.get_uint("port", 7172)));
 
-	current_server->listen("0.0.0.0", 7172);
+	PLOGD << "started io_service_pool - threads: " << io_pool->size();
 
-	service_thread(io_service);
+	io_pool->run();
 
-	PLOGD << "started io_service";
 	return 0;
 }
\ No newline at end of file